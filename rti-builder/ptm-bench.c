@@ -0,0 +1,614 @@
+/*
+ * Benchmarks the stages of PTM encoding and decoding.
+ *
+ * Usage: ptm-bench [-W width] [-H height] [-n lights] [-r repeat] >> bench.jsonl
+ *
+ * Synthesizes a light stack from a known analytic surface: a field of
+ * hemispherical bumps on a rippled plane, with a colored albedo pattern, lit by
+ * lights on a spiral over the hemisphere.  The images are compressed to JPEG
+ * in memory.  Then it runs the same stages the encoder and decoder run and
+ * times each one separately:
+ *
+ *   - decode:   decode all JPEG images
+ *   - svd:      the singular value decomposition of the light matrix
+ *   - fit:      fit the polynomials (and average the chroma for LRGB)
+ *   - scale:    scale the coefficients into bytes
+ *   - compress: write the PTM file (compresses the JPEG and zlib formats)
+ *   - read:     read the PTM file back
+ *   - relight:  render one JPEG image from the PTM
+ *
+ * With -p the PTM is read back into planar blocks and relit from them.
+ *
+ * Each stage is run repeat times and the fastest and the median wall clock
+ * times are reported.  The results go to stdout as one line of JSON, so that
+ * the results of many runs can be collected in one file.  The RMS error of the
+ * fit against the input images is reported too, so that optimizations that
+ * break the fit get noticed.
+ *
+ * With -d the synthesized images and a .lp file are also written into a
+ * directory, for use with ptm-encoder.
+ *
+ * Author: Marcello Perathoner <marcello@perathoner.de>
+ *
+ * License: GPL3
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <math.h>
+#include <omp.h>
+#include <sys/stat.h>
+
+#include "ptmlib.h"
+
+const char *argp_program_version = "PTM Bench 0.1";
+
+static struct argp_option options[] = {
+    { "dataset",  'd', "DIR",    0, "Also write the synthesized images and a .lp file into DIR.", 0},
+    { "format",   'f', "FORMAT", 0, "Which PTM format to benchmark (default: PTM_FORMAT_JPEG_RGB).", 0},
+    { "height",   'H', "N",      0, "The height of the images (default: 768).",            0},
+    { "label",    'L', "TEXT",   0, "Label the results, eg. with the version control revision.", 0},
+    { "lights",   'n', "N",      0, "The no. of lights (default: 48).",                    0},
+    { "output",   'o', "FILE",   0, "Append to FILE instead of writing to STDOUT.",        1},
+    { "planar",   'p', 0,        0, "Read and relight the PTM with planar blocks.",        0},
+    { "repeat",   'r', "N",      0, "Run each stage N times (default: 3).",                1},
+    { "verbose",  'v', 0,        0, "Produce verbose output.",                             2},
+    { "width",    'W', "N",      0, "The width of the images (default: 1024).",            0},
+    { 0 }
+};
+
+struct arguments {
+    const ptm_format_t *format;
+    const char *dataset_dir;
+    const char *filename_output;
+    const char *label;
+    int width;
+    int height;
+    int lights;
+    int repeat;
+    int planar;
+    int verbose;
+};
+
+/** The stages we time. */
+typedef enum {
+    STAGE_DECODE,
+    STAGE_SVD,
+    STAGE_FIT,
+    STAGE_SCALE,
+    STAGE_COMPRESS,
+    STAGE_READ,
+    STAGE_RELIGHT,
+    N_STAGES
+} stage_enum_t;
+
+static const char *stage_names[N_STAGES] = {
+    "decode", "svd", "fit", "scale", "compress", "read", "relight"
+};
+
+/** The light stack in memory. */
+typedef struct {
+    decoder_t **decoders;      /**< One decoder per image, holds the light. */
+    unsigned char **jpegs;     /**< The compressed images. */
+    unsigned long *jpeg_sizes; /**< The sizes of the compressed images. */
+    int n_images;
+} light_stack_t;
+
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+    switch (key) {
+    case 'd':
+        arguments->dataset_dir = arg;
+        break;
+    case 'f':
+        arguments->format = ptm_get_format (arg);
+        if (arguments->format == NULL)
+            argp_error (state, "No format by that name: %s", arg);
+        if (arguments->format->color_components != 0 && arguments->format->color_components != 3)
+            argp_error (state, "Can only benchmark RGB and LRGB formats: %s", arg);
+        break;
+    case 'H':
+        arguments->height = atoi (arg);
+        break;
+    case 'L':
+        arguments->label = arg;
+        break;
+    case 'n':
+        arguments->lights = atoi (arg);
+        break;
+    case 'o':
+        arguments->filename_output = arg;
+        break;
+    case 'p':
+        arguments->planar = 1;
+        break;
+    case 'r':
+        arguments->repeat = atoi (arg);
+        break;
+    case 'v':
+        arguments->verbose = 1;
+        break;
+    case 'W':
+        arguments->width = atoi (arg);
+        break;
+    case ARGP_KEY_END:
+        if (arguments->width < 16 || arguments->height < 16)
+            argp_error (state, "The images must be at least 16x16 pixels.");
+        if (arguments->lights < 12)
+            argp_error (state, "Need at least 12 lights.");
+        if (arguments->repeat < 1)
+            argp_error (state, "Must repeat at least once.");
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {
+    options,
+    parse_opt,
+    NULL,
+    "Benchmark the stages of PTM encoding and decoding on a synthetic light stack.",
+    NULL,
+    NULL,
+    NULL
+};
+
+/**
+ * The surface normal at a pixel.
+ *
+ * A grid of hemispherical bumps on a plane with a sinusoidal ripple.  The
+ * normal is in the (u, v, w) frame of the light positions: u points right, v
+ * points up.
+ */
+void surface_normal (const struct arguments *arguments, int x, int y, float *n) {
+    const float cell = (arguments->width < arguments->height ? arguments->width : arguments->height) / 4.0f;
+    const float r    = cell * 0.4f;
+    float dx = fmodf (x, cell) - cell / 2;
+    float dy = fmodf (y, cell) - cell / 2;
+    float d2 = dx * dx + dy * dy;
+    if (d2 < r * r) {
+        n[0] = dx / r;
+        n[1] = -dy / r;
+        n[2] = sqrtf (r * r - d2) / r;
+    } else {
+        const float k = 2.0f * (float) M_PI / (cell / 3);
+        n[0] = 0.3f * cosf (x * k);
+        n[1] = 0.3f * sinf (y * k);
+        n[2] = 1.0f;
+        float len = sqrtf (n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        n[0] /= len;
+        n[1] /= len;
+        n[2] /= len;
+    }
+}
+
+/**
+ * The albedo at a pixel.
+ */
+void surface_albedo (const struct arguments *arguments, int x, int y, float *rgb) {
+    const float cell = (arguments->width < arguments->height ? arguments->width : arguments->height) / 16.0f;
+    const int checker = ((int) (x / cell) + (int) (y / cell)) & 1;
+    rgb[0] = checker ? 0.9f : 0.6f;
+    rgb[1] = 0.55f + 0.3f * sinf (x / cell);
+    rgb[2] = 0.55f + 0.3f * cosf (y / cell);
+}
+
+/**
+ * Synthesize the light stack.
+ *
+ * The lights are on a spiral over the hemisphere between 15 and 75 degrees of
+ * elevation.  The images are Lambertian with a little ambient light.
+ */
+light_stack_t *synthesize_stack (const struct arguments *arguments) {
+    light_stack_t *stack = calloc (1, sizeof (light_stack_t));
+    stack->n_images   = arguments->lights;
+    stack->decoders   = calloc (stack->n_images, sizeof (decoder_t *));
+    stack->jpegs      = calloc (stack->n_images, sizeof (unsigned char *));
+    stack->jpeg_sizes = calloc (stack->n_images, sizeof (unsigned long));
+
+    const float el_min = 15.0f * (float) M_PI / 180.0f;
+    const float el_max = 75.0f * (float) M_PI / 180.0f;
+
+    for (int i = 0; i < stack->n_images; ++i) {
+        float el = el_min + (el_max - el_min) * (i + 0.5f) / stack->n_images;
+        float az = i * 2.39996323f; // the golden angle
+        decoder_t *decoder = calloc (1, sizeof (decoder_t));
+        decoder->filename = malloc (32);
+        sprintf (decoder->filename, "img%03d.jpg", i + 1);
+        decoder->u = cosf (el) * cosf (az);
+        decoder->v = cosf (el) * sinf (az);
+        decoder->w = sinf (el);
+        stack->decoders[i] = decoder;
+    }
+
+    const int width  = arguments->width;
+    const int height = arguments->height;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < stack->n_images; ++i) {
+        const decoder_t *decoder = stack->decoders[i];
+
+        struct jpeg_error_mgr jerr;
+        struct jpeg_compress_struct cinfo;
+        cinfo.err = jpeg_std_error (&jerr);
+        jpeg_create_compress (&cinfo);
+        cinfo.image_width      = width;
+        cinfo.image_height     = height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space   = JCS_RGB;
+        jpeg_set_defaults (&cinfo);
+        jpeg_set_quality (&cinfo, 95, TRUE);
+        jpeg_mem_dest (&cinfo, &stack->jpegs[i], &stack->jpeg_sizes[i]);
+        jpeg_start_compress (&cinfo, TRUE);
+
+        JSAMPLE *row = malloc (width * 3);
+        while (cinfo.next_scanline < cinfo.image_height) {
+            int y = cinfo.next_scanline;
+            for (int x = 0; x < width; ++x) {
+                float n[3], albedo[3];
+                surface_normal (arguments, x, y, n);
+                surface_albedo (arguments, x, y, albedo);
+                float shade = n[0] * decoder->u + n[1] * decoder->v + n[2] * decoder->w;
+                shade = 0.05f + (shade > 0.0f ? shade : 0.0f);
+                for (int c = 0; c < 3; ++c) {
+                    row[x * 3 + c] = CLIP (255.0f * albedo[c] * shade);
+                }
+            }
+            jpeg_write_scanlines (&cinfo, &row, 1);
+        }
+        free (row);
+
+        jpeg_finish_compress (&cinfo);
+        jpeg_destroy_compress (&cinfo);
+    }
+    return stack;
+}
+
+/**
+ * Write the light stack into a directory.
+ *
+ * @returns 0 on success.
+ */
+int write_stack (const light_stack_t *stack, const char *dir) {
+    mkdir (dir, 0777);
+    char *path = malloc (strlen (dir) + 32);
+
+    sprintf (path, "%s/bench.lp", dir);
+    FILE *fp_lp = fopen (path, "w");
+    if (fp_lp == NULL) {
+        fprintf (stderr, "can't open %s\n", path);
+        free (path);
+        return 1;
+    }
+    fprintf (fp_lp, "%d\n", stack->n_images);
+
+    for (int i = 0; i < stack->n_images; ++i) {
+        const decoder_t *decoder = stack->decoders[i];
+        sprintf (path, "%s/%s", dir, decoder->filename);
+        FILE *fp = fopen (path, "wb");
+        if (fp == NULL) {
+            fprintf (stderr, "can't open %s\n", path);
+            fclose (fp_lp);
+            free (path);
+            return 1;
+        }
+        fwrite (stack->jpegs[i], stack->jpeg_sizes[i], 1, fp);
+        fclose (fp);
+        fprintf (fp_lp, "%s %f %f %f\n", decoder->filename,
+                 (double) decoder->u, (double) decoder->v, (double) decoder->w);
+    }
+    fclose (fp_lp);
+    free (path);
+    return 0;
+}
+
+void free_stack (light_stack_t *stack) {
+    for (int i = 0; i < stack->n_images; ++i) {
+        free (stack->decoders[i]->filename);
+        free (stack->decoders[i]);
+        free (stack->jpegs[i]);
+    }
+    free (stack->decoders);
+    free (stack->jpegs);
+    free (stack->jpeg_sizes);
+    free (stack);
+}
+
+/**
+ * The RMS error of the fit of one color component against the input images.
+ *
+ * Looks only at every 7th pixel, that's plenty.
+ */
+double fit_rms (const ptm_image_info_t *info,
+                decoder_t **decoders,
+                const JSAMPLE *buffer,
+                size_t component,
+                const ptm_unscaled_coefficients_t *coeffs) {
+    double sum = 0.0;
+    size_t n = 0;
+    for (size_t i = 0; i < info->pixels; i += 7) {
+        const ptm_unscaled_coefficients_t *c = coeffs + i;
+        for (size_t d = 0; d < info->n_decoders; ++d) {
+            const float u = decoders[d]->u;
+            const float v = decoders[d]->v;
+            float fit = c->cu2 * u * u + c->cv2 * v * v + c->cuv * u * v + c->cu * u + c->cv * v + c->c1;
+            float err = fit - buffer[d * info->decoder_stride + i * 3 + component];
+            sum += err * err;
+            ++n;
+        }
+    }
+    return sqrt (sum / n);
+}
+
+int compare_doubles (const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * Run all stages once.
+ *
+ * @param times   [out] The wall clock times of the stages in ms.
+ * @param rms     [out] The RMS error of the fit.
+ * @param size    [out] The size of the PTM file.
+ *
+ * @returns 0 on success.
+ */
+int run_stages (const struct arguments *arguments, const light_stack_t *stack,
+                double *times, double *rms, size_t *size) {
+    double t;
+    const ptm_format_t *format = arguments->format;
+    const J_COLOR_SPACE color_space = (format->color_components > 0) ? JCS_YCbCr : JCS_RGB;
+
+    ptm_image_info_t info;
+    info.width          = arguments->width;
+    info.height         = arguments->height;
+    info.pixels         = info.width * info.height;
+    info.row_stride     = info.width * 3;
+    info.decoder_stride = info.height * info.row_stride;
+    info.sample_size    = 1;
+    info.n_decoders     = stack->n_images;
+
+    const ptm_input_info_t input_info = { info.width, info.height, 3, 1 };
+    const ptm_input_format_t *jpeg = ptm_find_input_format (stack->jpegs[0], stack->jpeg_sizes[0]);
+
+    /* decode */
+
+    t = ptm_wall_time ();
+    JSAMPLE *buffer = malloc (info.n_decoders * info.decoder_stride);
+    int status = 0;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t n = 0; n < info.n_decoders; ++n) {
+        void **row_pointer = malloc (info.height * sizeof (void *));
+        for (size_t y = 0; y < info.height; ++y) {
+            // flip the image vertically
+            row_pointer[y] = buffer + (n * info.decoder_stride) + ((info.height - y - 1) * info.row_stride);
+        }
+        if (jpeg->decode (stack->jpegs[n], stack->jpeg_sizes[n], color_space, 1, &input_info, row_pointer)) {
+            #pragma omp atomic write
+            status = 1;
+        }
+        free (row_pointer);
+    }
+    times[STAGE_DECODE] = (ptm_wall_time () - t) * 1000.0;
+    if (status) {
+        fprintf (stderr, "error decoding synthetic images\n");
+        free (buffer);
+        return 1;
+    }
+
+    /* svd */
+
+    t = ptm_wall_time ();
+    float *M = ptm_svd (stack->decoders, info.n_decoders);
+    times[STAGE_SVD] = (ptm_wall_time () - t) * 1000.0;
+    if (M == NULL) {
+        fprintf (stderr, "Error in Singular Value Decomposition\n");
+        free (buffer);
+        return 1;
+    }
+
+    /* fit */
+
+    ptm_header_t *ptm_header = ptm_alloc_header ();
+    ptm_header->format   = format;
+    ptm_header->dimen[0] = info.width;
+    ptm_header->dimen[1] = info.height;
+    ptm_block_t *blocks  = ptm_alloc_blocks (ptm_header);
+    ptm_unscaled_coefficients_t *coeffs = calloc (format->ptm_blocks * info.pixels,
+                                                  sizeof (ptm_unscaled_coefficients_t));
+
+    t = ptm_wall_time ();
+    for (int r = 0; r < format->ptm_blocks; ++r) {
+        ptm_fit_poly_jsample (&info, buffer + r, 3, M, 0, NULL, coeffs + (r * info.pixels));
+    }
+    times[STAGE_FIT] = (ptm_wall_time () - t) * 1000.0;
+
+    // the LRGB conversion changes the coefficients, so measure the error first
+    *rms = fit_rms (&info, stack->decoders, buffer, 0, coeffs);
+    if (format->color_components == 3) {
+        t = ptm_wall_time ();
+        ptm_cbcr_avg (&info, (const ycbcr_coefficients_t *) buffer,
+                      (ycbcr_coefficients_t *) blocks[format->ptm_blocks], coeffs);
+        times[STAGE_FIT] += (ptm_wall_time () - t) * 1000.0;
+    }
+    free (buffer);
+
+    /* scale */
+
+    t = ptm_wall_time ();
+    ptm_scale_coefficients (ptm_header, coeffs, blocks);
+    times[STAGE_SCALE] = (ptm_wall_time () - t) * 1000.0;
+    free (coeffs);
+
+    /* compress */
+
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    char *ptm_data = NULL;
+    size_t ptm_size = 0;
+    FILE *fp = open_memstream (&ptm_data, &ptm_size);
+    t = ptm_wall_time ();
+    status = ptm_write_ptm (&ctx, fp, ptm_header, blocks);
+    fflush (fp);
+    times[STAGE_COMPRESS] = (ptm_wall_time () - t) * 1000.0;
+    fclose (fp);
+    *size = ptm_size;
+    ptm_free_blocks (ptm_header, blocks);
+    free (ptm_header);
+    if (status) {
+        fprintf (stderr, "%s\n", ctx.message);
+        free (ptm_data);
+        free (M);
+        return 1;
+    }
+
+    /* read */
+
+    fp = fmemopen (ptm_data, ptm_size, "rb");
+    t = ptm_wall_time ();
+    ptm_header = ptm_read_header (&ctx, fp);
+    if (ptm_header)
+        ptm_header->planar = arguments->planar;
+    blocks = ptm_header ? ptm_alloc_blocks (ptm_header) : NULL;
+    status = blocks ? ptm_read_ptm (&ctx, fp, ptm_header, blocks) : 1;
+    times[STAGE_READ] = (ptm_wall_time () - t) * 1000.0;
+    fclose (fp);
+    free (ptm_data);
+    if (status) {
+        fprintf (stderr, "%s\n", ctx.message);
+        ptm_free_blocks (ptm_header, blocks);
+        free (ptm_header);
+        free (M);
+        return 1;
+    }
+
+    /* relight */
+
+    char *jpeg_data = NULL;
+    size_t jpeg_size = 0;
+    fp = open_memstream (&jpeg_data, &jpeg_size);
+    t = ptm_wall_time ();
+    status = ptm_write_jpeg (&ctx, fp, ptm_header, blocks, 0.3f, 0.2f);
+    fflush (fp);
+    times[STAGE_RELIGHT] = (ptm_wall_time () - t) * 1000.0;
+    fclose (fp);
+    free (jpeg_data);
+    if (status)
+        fprintf (stderr, "%s\n", ctx.message);
+
+    ptm_free_blocks (ptm_header, blocks);
+    free (ptm_header);
+    free (M);
+    return status ? 1 : 0;
+}
+
+int main (int argc, char *argv[]) {
+    struct arguments arguments;
+
+    arguments.format          = ptm_get_format ("PTM_FORMAT_JPEG_RGB");
+    arguments.dataset_dir     = NULL;
+    arguments.filename_output = NULL;
+    arguments.label           = "";
+    arguments.width           = 1024;
+    arguments.height          = 768;
+    arguments.lights          = 48;
+    arguments.repeat          = 3;
+    arguments.planar          = 0;
+    arguments.verbose         = 0;
+
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.verbose) {
+        fprintf (stderr, "synthesizing %d images of %dx%d ...\n",
+                 arguments.lights, arguments.width, arguments.height);
+        fflush (stderr);
+    }
+    light_stack_t *stack = synthesize_stack (&arguments);
+
+    if (arguments.dataset_dir && write_stack (stack, arguments.dataset_dir)) {
+        free_stack (stack);
+        return 1;
+    }
+
+    double *times = calloc (N_STAGES * arguments.repeat, sizeof (double));
+    double rms = 0.0;
+    size_t ptm_size = 0;
+    for (int r = 0; r < arguments.repeat; ++r) {
+        if (run_stages (&arguments, stack, times + r * N_STAGES, &rms, &ptm_size)) {
+            free (times);
+            free_stack (stack);
+            return 1;
+        }
+        if (arguments.verbose) {
+            fprintf (stderr, "run %d:", r + 1);
+            for (int s = 0; s < N_STAGES; ++s) {
+                fprintf (stderr, " %s %.1fms", stage_names[s], times[r * N_STAGES + s]);
+            }
+            fprintf (stderr, "\n");
+            fflush (stderr);
+        }
+    }
+
+    FILE *fp = stdout;
+    if (arguments.filename_output && (fp = fopen (arguments.filename_output, "a")) == NULL) {
+        fprintf (stderr, "can't open %s\n", arguments.filename_output);
+        free (times);
+        free_stack (stack);
+        return 1;
+    }
+
+    const double mpixels = arguments.width * (double) arguments.height * arguments.lights / 1e6;
+
+    fprintf (fp, "{\"program\": \"%s\", ", argp_program_version);
+    fprintf (fp, "\"label\": ");
+    ptm_write_json_string (fp, arguments.label);
+    fprintf (fp, ", ");
+    fprintf (fp, "\"format\": \"%s\", ", arguments.format->name);
+    fprintf (fp, "\"planar\": %d, ", arguments.planar);
+    fprintf (fp, "\"width\": %d, ", arguments.width);
+    fprintf (fp, "\"height\": %d, ", arguments.height);
+    fprintf (fp, "\"lights\": %d, ", arguments.lights);
+    fprintf (fp, "\"threads\": %d, ", omp_get_max_threads ());
+    fprintf (fp, "\"repeat\": %d, ", arguments.repeat);
+    fprintf (fp, "\"ptm_size\": %zu, ", ptm_size);
+    fprintf (fp, "\"fit_rms\": %.4f, ", rms);
+    fprintf (fp, "\"peak_rss\": %zu, ", ptm_peak_rss ());
+    fprintf (fp, "\"stages\": {");
+
+    double *samples = malloc (arguments.repeat * sizeof (double));
+    double total_min = 0.0;
+    for (int s = 0; s < N_STAGES; ++s) {
+        for (int r = 0; r < arguments.repeat; ++r) {
+            samples[r] = times[r * N_STAGES + s];
+        }
+        qsort (samples, arguments.repeat, sizeof (double), compare_doubles);
+        double min    = samples[0];
+        double median = samples[arguments.repeat / 2];
+        total_min += min;
+        fprintf (fp, "\"%s\": {\"min_ms\": %.3f, \"median_ms\": %.3f, \"max_ms\": %.3f",
+                 stage_names[s], min, median, samples[arguments.repeat - 1]);
+        if (s == STAGE_DECODE || s == STAGE_FIT) {
+            // these stages look at all input pixels
+            fprintf (fp, ", \"mpixels_per_s\": %.2f", min > 0.0 ? mpixels * 1000.0 / min : 0.0);
+        }
+        fprintf (fp, "}, ");
+    }
+    fprintf (fp, "\"total\": {\"min_ms\": %.3f}}}\n", total_min);
+
+    if (fp != stdout)
+        fclose (fp);
+
+    free (samples);
+    free (times);
+    free_stack (stack);
+    return 0;
+}
@@ -1,12 +1,18 @@
 /*
  * A simple command-line PTM to JPEG decoder.
  *
- * Usage: ptm-decoder filename.ptm [U V] > filename.jpg
+ * Usage: ptm-decoder [OPTION] filename.ptm [U V] > filename.jpg
  *
  * Set the light by specifying U and V.  U and V are the coordinates of the
  * normal projection from the unity sphere (the dome) onto the object
  * plane. (U^2 + V^2 <= 1)
  *
+ * Options:
+ *
+ *   --diffuse-gain[=GAIN]        exaggerate the surface curvature (default: 2)
+ *   --specular[=KD,KS,EXPONENT]  add highlights (default: 0.8,0.4,20)
+ *   --normals                    output the surface normals as colors
+ *
  * It reads PTMs in the following formats:
  *
  *   - PTM_FORMAT_RGB
@@ -14,12 +20,16 @@
  *   - PTM_FORMAT_LUM (not tested for want of test images)
  *   - PTM_FORMAT_JPEG_RGB
  *   - PTM_FORMAT_JPEG_LRGB
+ *   - PTM_FORMAT_ZLIB_RGB (lossless, not in the PTM specification)
+ *   - PTM_FORMAT_ZLIB_LRGB (lossless, not in the PTM specification)
  *
  * Prediction using motion compensation is not supported.  Output is to stdout,
  * so you can easily use this on a web server too.
  *
- * TODO: Add specular enhancement and diffuse enhancement.
- *       Add JPEG2000 if we find PTMs using it in the wild.
+ * If there is an index next to the PTM, as written by ptm-encoder --index, the
+ * JPEG streams are decoded in parallel.
+ *
+ * TODO: Add JPEG2000 if we find PTMs using it in the wild.
  *
  * Author: Marcello Perathoner <marcello@perathoner.de>
  *
@@ -32,22 +42,40 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ptmlib.h"
 
 int main (int argc, char *argv[]) {
-    if (argc != 2 && argc != 4) {
-        fprintf (stderr, "Usage: %s filename.ptm [u v]\n", argv[0]);
+    ptm_render_params_t params;
+    ptm_render_defaults (&params);
+
+    // options start with --, so that negative u and v work
+    const char *args[3];
+    int n_args = 0;
+    int bad = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp (argv[i], "--", 2)) {
+            if (ptm_parse_render_option (argv[i], &params) != 1)
+                bad = 1;
+        } else if (n_args < 3) {
+            args[n_args++] = argv[i];
+        } else {
+            bad = 1;
+        }
+    }
+    if (bad || (n_args != 1 && n_args != 3)) {
+        fprintf (stderr, "Usage: %s [--diffuse-gain[=GAIN] | --specular[=KD,KS,EXPONENT] | --normals] filename.ptm [u v]\n", argv[0]);
         fprintf (stderr, "       Outputs JPEG to stdout\n");
         return 1;
     }
 
-    const char *filename = argv[1];
+    const char *filename = args[0];
     float u = 0.0;
     float v = 0.0;
-    if (argc == 4) {
-        sscanf (argv[2], "%f", &u);
-        sscanf (argv[3], "%f", &v);
+    if (n_args == 3) {
+        sscanf (args[1], "%f", &u);
+        sscanf (args[2], "%f", &v);
     }
 
     /* Open the PTM file and read the header. */
@@ -58,20 +86,48 @@ int main (int argc, char *argv[]) {
     }
 
     /* Read the PTM header. */
-    ptm_header_t *ptm = ptm_read_header (fp);
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    ptm_header_t *ptm = ptm_read_header (&ctx, fp);
     if (ptm == NULL) {
+        fprintf (stderr, "%s: %s\n", filename, ctx.message);
+        fclose (fp);
         return 1; /* not a PTM */
     }
 
-    /* Read the PTM data. */
+    /* Read the PTM data, with the index if there is one. */
+    ptm_index_t *index = ptm_index_open (&ctx, filename);
+    if (index == NULL && ctx.error) {
+        fprintf (stderr, "%s\n", ctx.message);
+        ptm_ctx_init (&ctx);
+    }
+    if (index && !ptm_index_matches (index, fp, ptm)) {
+        fprintf (stderr, "%s: ignoring stale index\n", filename);
+        ptm_index_close (index);
+        index = NULL;
+    }
+    // we only relight, which is fastest from planar blocks
+    ptm->planar = 1;
     ptm_block_t *blocks = ptm_alloc_blocks (ptm);
-    ptm_read_ptm (fp, ptm, blocks);
+    int err = blocks == NULL || (index ? ptm_read_ptm_indexed (&ctx, fp, ptm, blocks, index)
+                                       : ptm_read_ptm (&ctx, fp, ptm, blocks));
+    ptm_index_close (index);
+    if (err) {
+        fprintf (stderr, "%s: %s\n", filename, blocks ? ctx.message : "out of memory");
+        ptm_free_blocks (ptm, blocks);
+        free (ptm);
+        fclose (fp);
+        return 1;
+    }
     fclose (fp);
 
     /* Create output jpeg. */
-    ptm_write_jpeg (stdout, ptm, blocks, u, v);
+    int status = ptm_write_jpeg_enhanced (&ctx, stdout, ptm, blocks, NULL, &params, u, v);
+    if (status)
+        fprintf (stderr, "%s\n", ctx.message);
 
     /* Cleanup */
     ptm_free_blocks (ptm, blocks);
     free (ptm);
+    return status ? 1 : 0;
 }
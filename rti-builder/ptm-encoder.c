@@ -1,18 +1,69 @@
 /*
- * Encodes multiple JPEG files into a PTM file.
+ * Encodes multiple image files into a PTM file.
  *
  * Usage: ptm-encoder -o filename.ptm filename.lp
+ *        ptm-encoder run1/sample.lp run2/sample.lp ...
+ *        ptm-encoder -m manifest.txt
  *
  * filename.lp is of the same format used by the PTMFitter utility, ie. a list
  * of "filename u v w\n" strings.  The filename may contain a path which is
  * resolved relative to filename.lp.
  *
+ * If more than one .lp file is given, each one is encoded into a PTM file of the
+ * same name with the extension changed to .ptm.  All runs are processed in one
+ * process: the images of the next run are decoded while the current run is
+ * being fitted and written.  At most two runs are held in memory at any time.
+ *
+ * The input files are read whole into memory by a pool of reader threads, a
+ * few files ahead of the decoders.  This keeps many large reads in flight,
+ * which helps a lot with network storage.  Before that, the headers of all
+ * files are probed in a cheap separate pass, so that a run with a bad file
+ * fails early.  The no. of files open and of JPEG decoders alive at any time
+ * is bounded by the no. of reader threads and decoder jobs.
+ *
+ * With --mosaic, runs of an object too large for the dome are stitched into one
+ * PTM.  Each run is fitted on its own and spilled into a temporary file.  Then
+ * the tiles are scaled to a common range and written row by row.
+ *
+ * The manifest file contains one run per line: "filename.lp [filename.ptm]".
+ * Relative paths are resolved relative to the manifest.  Empty lines and lines
+ * starting with # are ignored.
+ *
+ * The input images may be JPEG, PNG, TIFF, PGM or PPM files.  8 bit and 16 bit
+ * images are supported.  16 bit images are fitted with full precision; the
+ * samples are only quantized to 8 bits when the PTM is written.
+ *
+ * The images may be cropped, shrunk and rotated while they are decoded.  JPEG
+ * images are shrunk by up to 8 by libjpeg itself, which is a lot faster than
+ * decoding the full image.  When rotating, the light directions are rotated
+ * too.
+ *
+ * With --calibration the brightness of each image is corrected by a gain and a
+ * flat-field image per light while fitting.  The flat-field images are decoded
+ * once for all runs.
+ *
+ * With --near-field the light directions are corrected for the position of
+ * each pixel under a dome of the given radius.  The pseudo-inverse is then
+ * computed once per tile of 64 x 64 pixels instead of once for the whole image.
+ *
+ * The big buffers are first touched by the threads that will fit and scale
+ * their rows, so that on NUMA machines the rows are local to the threads.
+ * With --pin the threads stay on their cores and the placement holds.
+ *
+ * Optionally it also outputs a map of the surface normals and the albedo as
+ * PNG files next to the PTM.  These are computed from the fitted coefficients
+ * at full precision before they are quantized.  With --photometric-stereo no
+ * PTM is fitted at all; the normals and the albedo are estimated directly from
+ * the images with the Lambertian model, which is a lot faster.
+ *
  * It builds PTMs in the following formats:
  *
  *   - PTM_FORMAT_RGB
  *   - PTM_FORMAT_LRGB
  *   - PTM_FORMAT_JPEG_RGB
  *   - PTM_FORMAT_JPEG_LRGB
+ *   - PTM_FORMAT_ZLIB_RGB (lossless, not in the PTM specification)
+ *   - PTM_FORMAT_ZLIB_LRGB (lossless, not in the PTM specification)
  *
  * Author: Marcello Perathoner <marcello@perathoner.de>
  *
@@ -25,10 +76,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <errno.h>
 #include <assert.h>
-#include <argp.h>
-#include <time.h>
+#include <float.h>
 #include <math.h>
+#include <sys/types.h>
+#include <argp.h>
 #include <omp.h>
 #include <cblas.h>
 
@@ -36,34 +90,151 @@
 
 const char *argp_program_version = "PTM Encoder 0.1";
 
+enum {
+    OPT_CROP = 256,
+    OPT_ROTATE,
+    OPT_SHRINK,
+    OPT_NORMALS,
+    OPT_ALBEDO,
+    OPT_PHOTOMETRIC_STEREO,
+    OPT_PROGRESSIVE,
+    OPT_MOSAIC,
+    OPT_NEAR_FIELD,
+    OPT_CALIBRATION,
+    OPT_CHROMA,
+    OPT_PIN,
+    OPT_INDEX
+};
+
+/** The size of the tiles for the near-field correction. */
+#define NEAR_FIELD_TILE 64
+
 static struct argp_option options[] = {
-    { "format",  'f', "FORMAT", 0, "Which PTM format to output (default: PTM_FORMAT_JPEG_RGB).", 0},
-    { "list",    'l', 0,        0, "List supported PTM formats.",                                0},
-    { "output",  'o', "FILE",   0, "Output to FILE instead of STDOUT.",                          1},
-    { "verbose", 'v', 0,        0, "Produce verbose output.",                                    2},
+    { "albedo",   OPT_ALBEDO, 0,     0, "Also output the albedo as PNG.",                         1},
+    { "cache",    'c', "DIR",    0, "Cache SVD matrices in DIR.",                                 0},
+    { "calibration", OPT_CALIBRATION, "FILE", 0,
+      "Read the gain and flat-field image of each light from FILE.",                              0},
+    { "chroma",   OPT_CHROMA, "METHOD", 0,
+      "How to find the chroma of LRGB formats: mean, median or trimmed (default: mean).",        0},
+    { "crop",     OPT_CROP, "WxH+X+Y", 0, "Crop the input images to this rectangle.",            0},
+    { "format",   'f', "FORMAT", 0, "Which PTM format to output (default: PTM_FORMAT_JPEG_RGB).", 0},
+    { "index",    OPT_INDEX, 0,      0, "Also write an index of each PTM.",                       1},
+    { "io-threads", 'i', "N",    0, "Read input files with N threads (default: 4).",              0},
+    { "jobs",     'j', "N",      0, "Decode N images in parallel (default: no. of threads).",     0},
+    { "list",     'l', 0,        0, "List supported PTM formats.",                                0},
+    { "manifest", 'm', "FILE",   0, "Read the list of runs to encode from FILE.",                 1},
+    { "mosaic",   OPT_MOSAIC, "FILE", 0, "Stitch the runs listed in FILE into one PTM.",           1},
+    { "near-field", OPT_NEAR_FIELD, "RADIUS", 0,
+      "Correct the light directions for a dome of RADIUS pixels.",                                 0},
+    { "normals",  OPT_NORMALS, 0,    0, "Also output the surface normals as PNG.",                1},
+    { "output",   'o', "FILE",   0, "Output to FILE instead of STDOUT.",                          1},
+    { "photometric-stereo", OPT_PHOTOMETRIC_STEREO, 0, 0,
+      "Only output the normals (and albedo) estimated by photometric stereo, no PTM.",            1},
+    { "pin",      OPT_PIN,  0,       0, "Pin the threads to cores.",                              2},
+    { "stats",    's', "FILE",   0, "Append timing statistics as JSON to FILE.",                  2},
+    { "progressive", OPT_PROGRESSIVE, 0, 0, "Write progressive JPEG streams.",                      1},
+    { "rotate",   OPT_ROTATE, "DEG", 0, "Rotate the input images clockwise by 90, 180 or 270 degrees.", 0},
+    { "shrink",   OPT_SHRINK, "N",   0, "Shrink the input images by the integer factor N.",       0},
+    { "verbose",  'v', 0,        0, "Produce verbose output.",                                    2},
     { 0 }
 };
 
+/** The brightness calibration of the lights of a dome. */
+typedef struct {
+    int n_lights;        /**< The no. of lights or 0 if not calibrated. */
+    float *gains;        /**< The gain of each light. */
+    char **filenames_flat; /**< The flat-field image of each light or NULL. */
+    float **flat_fields; /**< The decoded flat-field correction of each light
+                            or NULL.  Decoded once for all runs. */
+    ptm_input_info_t flat_info; /**< The size of the flat-field images as
+                                   probed. */
+    ptm_calibration_t fit;      /**< The above as the fits take it. */
+} calibration_t;
+
 struct arguments {
     const ptm_format_t *format;
-    const char *filename_lp;
+    const char **filenames_lp;
+    int n_filenames_lp;
+    const char *filename_manifest;
+    const char *filename_mosaic;
     const char *filename_ptm;
+    const char *cache_dir;
+    const char *filename_stats;
+    ptm_transform_t transform;
+    int normals;
+    int albedo;
+    int photometric_stereo;
+    int progressive;
+    int index;
+    float near_field_radius;
+    const char *filename_calibration;
+    ptm_chroma_enum_t chroma;
+    calibration_t calibration;
+    int io_threads;
+    int jobs;
+    int pin;
     int verbose;
 };
 
-#define TIME(...)                                                       \
-    end = clock ();                                                     \
-    if (arguments.verbose) {                                            \
-        fprintf (stderr, __VA_ARGS__,                                   \
-                 (end - start) * 1000 / CLOCKS_PER_SEC);                \
-        fflush (stderr);                                                \
-    }                                                                   \
-    start = clock ()
+/** One capture run, ie. one .lp file and the PTM built from it. */
+typedef struct {
+    char *filename_lp;          /**< The light positions file. */
+    char *filename_ptm;         /**< The output file or "-" for stdout. */
+    decoder_t **decoders;       /**< One decoder per input image. */
+    ptm_image_info_t info;      /**< Info about the input images. */
+    ptm_input_info_t input_info; /**< Info about the input images as probed. */
+    void *buffer;               /**< All input images decoded. */
+    ptm_arena_t *arena;         /**< Where the big buffers of the run come from. */
+    ptm_stats_t stats;          /**< The timings of the stages. */
+    int status;                 /**< Non-zero if the run failed. */
+    size_t x;                   /**< The position of the tile in the mosaic. */
+    size_t y;
+    FILE *fp_tile;              /**< The fitted coefficients of the tile. */
+    ptm_unscaled_coefficients_t min; /**< The range of the coefficients of the tile. */
+    ptm_unscaled_coefficients_t max;
+} run_t;
+
+/**
+ * Print the time a stage took, if verbose.
+ */
+void report_stage (const struct arguments *arguments, const ptm_stage_t *stage) {
+    if (arguments->verbose && stage) {
+        fprintf (stderr, "time for %s = %.0fms (cpu %.0fms)\n",
+                 stage->name, stage->wall * 1000, stage->cpu * 1000);
+        fflush (stderr);
+    }
+}
 
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
     switch (key) {
+    case OPT_ALBEDO:
+        arguments->albedo = 1;
+        break;
+    case 'c':
+        arguments->cache_dir = arg;
+        break;
+    case OPT_CALIBRATION:
+        arguments->filename_calibration = arg;
+        break;
+    case OPT_CHROMA:
+        if (!strcmp (arg, "mean"))
+            arguments->chroma = PTM_CHROMA_MEAN;
+        else if (!strcmp (arg, "median"))
+            arguments->chroma = PTM_CHROMA_MEDIAN;
+        else if (!strcmp (arg, "trimmed"))
+            arguments->chroma = PTM_CHROMA_TRIMMED_MEAN;
+        else
+            argp_error (state, "unknown chroma method: %s", arg);
+        break;
+    case OPT_CROP: {
+        ptm_transform_t *t = &arguments->transform;
+        int n = sscanf (arg, "%zux%zu+%zu+%zu", &t->crop_width, &t->crop_height, &t->crop_x, &t->crop_y);
+        if ((n != 2 && n != 4) || t->crop_width == 0 || t->crop_height == 0)
+            argp_error (state, "bad crop geometry: %s", arg);
+        break;
+    }
     case 'f':
         arguments->format = ptm_get_format (arg);
         if (arguments->format == NULL) {
@@ -71,6 +242,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
             exit (0);
         }
         break;
+    case 'i':
+        arguments->io_threads = atoi (arg);
+        break;
+    case 'j':
+        arguments->jobs = atoi (arg);
+        break;
     case 'l':
         printf ("Supported formats:\n");
         const ptm_format_t *format = ptm_formats;
@@ -80,20 +257,58 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
         }
         exit (0);
         break;
+    case 'm':
+        arguments->filename_manifest = arg;
+        break;
+    case OPT_MOSAIC:
+        arguments->filename_mosaic = arg;
+        break;
+    case OPT_INDEX:
+        arguments->index = 1;
+        break;
+    case OPT_NEAR_FIELD:
+        arguments->near_field_radius = atof (arg);
+        if (arguments->near_field_radius <= 0.0f)
+            argp_error (state, "bad dome radius: %s", arg);
+        break;
+    case OPT_NORMALS:
+        arguments->normals = 1;
+        break;
+    case OPT_PHOTOMETRIC_STEREO:
+        arguments->photometric_stereo = 1;
+        arguments->normals = 1;
+        break;
     case 'o':
         arguments->filename_ptm = arg;
         break;
+    case OPT_PIN:
+        arguments->pin = 1;
+        break;
+    case OPT_PROGRESSIVE:
+        arguments->progressive = 1;
+        break;
+    case OPT_ROTATE:
+        arguments->transform.rotate = atoi (arg);
+        if (arguments->transform.rotate % 90 || arguments->transform.rotate < 0 ||
+            arguments->transform.rotate > 270)
+            argp_error (state, "can only rotate by 0, 90, 180 or 270 degrees: %s", arg);
+        break;
+    case OPT_SHRINK:
+        if (atoi (arg) < 1)
+            argp_error (state, "bad shrink factor: %s", arg);
+        arguments->transform.shrink = atoi (arg);
+        break;
+    case 's':
+        arguments->filename_stats = arg;
+        break;
     case 'v':
         arguments->verbose = 1;
         break;
     case ARGP_KEY_ARG:
-        if (state->arg_num >= 1)
-            /* Too many arguments. */
-            argp_usage (state);
-        arguments->filename_lp = arg;
+        arguments->filenames_lp[arguments->n_filenames_lp++] = arg;
         break;
     case ARGP_KEY_END:
-        if (state->arg_num < 1)
+        if (state->arg_num < 1 && arguments->filename_manifest == NULL && arguments->filename_mosaic == NULL)
             /* Not enough arguments. */
             argp_usage (state);
         break;
@@ -106,46 +321,252 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 static struct argp argp = {
     options,
     parse_opt,
-    "FILENAME.LP",
-    "Encode a series of JPEG files into a PTM file.",
+    "FILENAME.LP...",
+    "Encode a series of image files into a PTM file.",
     NULL,
     NULL,
     NULL
 };
 
-int main (int argc, char *argv[]) {
-    struct arguments arguments;
+/**
+ * Replace the extension of a filename.
+ */
+char *change_extension (const char *filename, const char *extension) {
+    char *result = malloc (strlen (filename) + strlen (extension) + 1);
+    strcpy (result, filename);
+    char *ext   = strrchr (result, '.');
+    char *slash = strrchr (result, '/');
+    if (ext == NULL || (slash && ext < slash))
+        ext = result + strlen (result);
+    strcpy (ext, extension);
+    return result;
+}
 
-    arguments.verbose      = 0;
-    arguments.format       = ptm_get_format ("PTM_FORMAT_JPEG_RGB");
-    arguments.filename_ptm = "-";
+/**
+ * Make the default output filename for a run.
+ *
+ * Replaces the extension of the .lp file with .ptm.
+ */
+char *default_filename_ptm (const char *filename_lp) {
+    return change_extension (filename_lp, ".ptm");
+}
 
-    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+/**
+ * Write one of the extra images of a run into a PNG file.
+ *
+ * The file is named after the PTM file, or after the .lp file if the PTM goes
+ * to stdout, eg. sample-normals.png.
+ *
+ * @returns 0 on success.
+ */
+int write_png_for_run (const run_t *run, const char *suffix, const JSAMPLE *rgb) {
+    const char *base = strcmp (run->filename_ptm, "-") ? run->filename_ptm : run->filename_lp;
+    char *filename = change_extension (base, suffix);
+    FILE *fp = fopen (filename, "wb");
+    int status = fp == NULL || ptm_write_png (fp, run->info.width, run->info.height, rgb);
+    if (fp && fclose (fp))
+        status = 1;
+    if (status)
+        fprintf (stderr, "can't write %s\n", filename);
+    free (filename);
+    return status;
+}
 
-    clock_t start;
-    clock_t end;
-    start = clock ();
+/**
+ * Resolve a path relative to a directory.
+ */
+char *resolve_path (const char *dir, const char *filename) {
+    if (filename[0] == '/')
+        return strdup (filename);
+    char *path = malloc (strlen (dir) + strlen (filename) + 2);
+    sprintf (path, "%s/%s", dir, filename);
+    return path;
+}
 
-    /* Open the light points file and build one JPEG decoder per input file.
-       Store decoders into an array (for easy access with opencl). */
+/**
+ * Read the list of runs from a manifest file.
+ *
+ * @returns The no. of runs appended to runs or -1 on error.
+ */
+int read_manifest (const char *filename_manifest, run_t **runs, int *max_runs, int n_runs) {
+    FILE *fp;
+    if ((fp = fopen (filename_manifest, "rb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", filename_manifest);
+        return -1;
+    }
+    char *dir_copy = strdup (filename_manifest);
+    const char *dir = dirname (dir_copy);
 
-    FILE *fp_lp;
-    if ((fp_lp = fopen (arguments.filename_lp, "rb")) == NULL) {
-        fprintf (stderr, "can't open %s\n", arguments.filename_lp);
+    char *line = NULL;
+    size_t len = 0;
+    while (getline (&line, &len, fp) != -1) {
+        char *filename_lp  = malloc (len + 1);
+        char *filename_ptm = malloc (len + 1);
+        int n = sscanf (line, "%s %s", filename_lp, filename_ptm);
+        if (n >= 1 && filename_lp[0] != '#') {
+            if (n_runs >= *max_runs) {
+                *max_runs *= 2;
+                *runs = realloc (*runs, *max_runs * sizeof (run_t));
+            }
+            run_t *run = *runs + n_runs;
+            memset (run, 0, sizeof (run_t));
+            run->filename_lp  = resolve_path (dir, filename_lp);
+            run->filename_ptm = (n == 2) ? resolve_path (dir, filename_ptm) : default_filename_ptm (run->filename_lp);
+            ++n_runs;
+        }
+        free (filename_lp);
+        free (filename_ptm);
+    }
+    free (line);
+    free (dir_copy);
+    fclose (fp);
+    return n_runs;
+}
+
+/**
+ * Read the list of tiles from a mosaic file.
+ *
+ * Each line contains a .lp file and the position of its top left corner in
+ * the mosaic: "filename.lp X Y".
+ *
+ * @returns The no. of runs appended to runs or -1 on error.
+ */
+int read_mosaic (const char *filename_mosaic, run_t **runs, int *max_runs, int n_runs) {
+    FILE *fp;
+    if ((fp = fopen (filename_mosaic, "rb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", filename_mosaic);
+        return -1;
+    }
+    char *dir_copy = strdup (filename_mosaic);
+    const char *dir = dirname (dir_copy);
+
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline (&line, &len, fp) != -1) {
+        char *filename_lp = malloc (len + 1);
+        size_t x, y;
+        int n = sscanf (line, "%s %zu %zu", filename_lp, &x, &y);
+        ++lineno;
+        if (n >= 1 && filename_lp[0] != '#') {
+            if (n != 3) {
+                fprintf (stderr, "%s:%d: expected filename.lp X Y\n", filename_mosaic, lineno);
+                n_runs = -1;
+                free (filename_lp);
+                break;
+            }
+            if (n_runs >= *max_runs) {
+                *max_runs *= 2;
+                *runs = realloc (*runs, *max_runs * sizeof (run_t));
+            }
+            run_t *run = *runs + n_runs;
+            memset (run, 0, sizeof (run_t));
+            run->filename_lp = resolve_path (dir, filename_lp);
+            run->x = x;
+            run->y = y;
+            ++n_runs;
+        }
+        free (filename_lp);
+    }
+    free (line);
+    free (dir_copy);
+    fclose (fp);
+    return n_runs;
+}
+
+/**
+ * Read the calibration of the lights.
+ *
+ * The file contains one line per light in the same order as the .lp files:
+ * the gain optionally followed by a flat-field image, ie. an image of a
+ * uniform white target taken with that light.  Relative paths are resolved
+ * relative to the calibration file.
+ *
+ * @returns 0 on success.
+ */
+int read_calibration (const char *filename_calibration, calibration_t *calibration) {
+    FILE *fp;
+    if ((fp = fopen (filename_calibration, "rb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", filename_calibration);
         return 1;
     }
-    char *dirname_lp = strdup (arguments.filename_lp);
-    dirname_lp = dirname (dirname_lp);
+    char *dir_copy = strdup (filename_calibration);
+    const char *dir = dirname (dir_copy);
 
-    ptm_header_t * const ptm_header = ptm_alloc_header ();
-    ptm_header->format = arguments.format;
+    int max_lights = 64;
+    calibration->gains          = malloc (max_lights * sizeof (float));
+    calibration->filenames_flat = malloc (max_lights * sizeof (char *));
+    calibration->flat_fields    = NULL;
+    calibration->n_lights       = 0;
 
-    size_t max_decoders = 64; // start with 64, maybe double them later
-    decoder_t **decoders = malloc (max_decoders * sizeof (decoder_t *));
-    ptm_image_info_t info;
-    info.n_decoders = 0;
+    int status = 0;
+    char *line = NULL;
+    size_t len = 0;
+    int lineno = 0;
+    while (getline (&line, &len, fp) != -1) {
+        char *first = malloc (len + 1);
+        char *flat  = malloc (len + 1);
+        float gain;
+        ++lineno;
+        int n = sscanf (line, "%s %s", first, flat);
+        if (n >= 1 && first[0] != '#') {
+            if (sscanf (first, "%f", &gain) != 1 || gain <= 0.0f) {
+                fprintf (stderr, "%s:%d: expected GAIN [FLATFIELD]\n", filename_calibration, lineno);
+                status = 1;
+            }
+            if (calibration->n_lights >= max_lights) {
+                max_lights *= 2;
+                calibration->gains          = realloc (calibration->gains, max_lights * sizeof (float));
+                calibration->filenames_flat = realloc (calibration->filenames_flat, max_lights * sizeof (char *));
+            }
+            calibration->gains[calibration->n_lights]          = gain;
+            calibration->filenames_flat[calibration->n_lights] = (n == 2) ? resolve_path (dir, flat) : NULL;
+            ++calibration->n_lights;
+        }
+        free (first);
+        free (flat);
+    }
+    free (line);
+    free (dir_copy);
+    fclose (fp);
+    calibration->fit.gains       = calibration->gains;
+    calibration->fit.flat_fields = NULL;
+    return status;
+}
+
+void free_calibration (calibration_t *calibration) {
+    if (calibration->gains == NULL)
+        return; // nothing was read
+    for (int i = 0; i < calibration->n_lights; ++i) {
+        free (calibration->filenames_flat[i]);
+        if (calibration->flat_fields)
+            free (calibration->flat_fields[i]);
+    }
+    free (calibration->filenames_flat);
+    free (calibration->flat_fields);
+    free (calibration->gains);
+    memset (calibration, 0, sizeof (calibration_t));
+}
+
+/**
+ * Read the light points file and build one decoder per input file.
+ *
+ * Store decoders into an array (for easy access with opencl).
+ *
+ * @returns 0 on success.
+ */
+int open_decoders (const struct arguments *arguments, run_t *run) {
+    FILE *fp_lp;
+    if ((fp_lp = fopen (run->filename_lp, "rb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", run->filename_lp);
+        return 1;
+    }
+    char *dir_copy = strdup (run->filename_lp);
+    const char *dirname_lp = dirname (dir_copy);
 
-    struct jpeg_error_mgr jerr;
+    size_t max_decoders = 64; // start with 64, maybe double them later
+    run->decoders = malloc (max_decoders * sizeof (decoder_t *));
+    run->info.n_decoders = 0;
 
     char *line = NULL;
     size_t len = 0;
@@ -160,126 +581,786 @@ int main (int argc, char *argv[]) {
                         filename, (double) u, (double) v, (double) w);
                fflush (stderr); */
 
-            char *path = malloc (strlen (dirname_lp) + strlen (filename) + 2);
-            sprintf (path, "%s/%s", dirname_lp, filename);
-
-            FILE *fp_jpeg;
-            if ((fp_jpeg = fopen (path, "rb")) == NULL) {
-                fprintf (stderr, "can't open %s\n", path);
-                return 1;
-            }
-            free (path);
-
             decoder_t *decoder = malloc (sizeof (decoder_t));
-            struct jpeg_decompress_struct *dinfo = &decoder->dinfo;
-            decoder->fp = fp_jpeg;
-            decoder->filename = filename;
+            decoder->filename = malloc (strlen (dirname_lp) + strlen (filename) + 2);
+            sprintf (decoder->filename, "%s/%s", dirname_lp, filename);
             decoder->u = u;
             decoder->v = v;
             decoder->w = w;
+            ptm_transform_light (&arguments->transform, decoder);
 
-            dinfo->err = jpeg_std_error (&jerr);
-            jpeg_create_decompress (dinfo);
-            jpeg_stdio_src (dinfo, decoder->fp);
-            (void) jpeg_read_header (dinfo, TRUE);
-
-            // use YCbCr color space for PTM_LUM and PTM_LRGB files
-            // use RGB color space for PTM_RGB files
-            dinfo->out_color_space = (ptm_header->format->color_components > 0) ? JCS_YCbCr : JCS_RGB;
-
-            (void) jpeg_start_decompress (dinfo);
-
-            decoders[info.n_decoders] = decoder;
-            ++info.n_decoders;
-            if (info.n_decoders >= max_decoders) {
+            run->decoders[run->info.n_decoders] = decoder;
+            ++run->info.n_decoders;
+            if (run->info.n_decoders >= max_decoders) {
                 max_decoders *= 2;
-                decoders = realloc (decoders, max_decoders * sizeof (decoder_t *));
+                run->decoders = realloc (run->decoders, max_decoders * sizeof (decoder_t *));
             }
         }
+        free (filename);
     }
     free (line);
-    free (dirname_lp);
+    free (dir_copy);
     fclose (fp_lp);
 
-    if (info.n_decoders < 12) {
-        fprintf (stderr, "not enough jpegs %u < %d\n", info.n_decoders, 12);
+    const calibration_t *calibration = &arguments->calibration;
+    if (calibration->n_lights && calibration->n_lights != (int) run->info.n_decoders) {
+        fprintf (stderr, "%s: %u images but %d lights in %s\n", run->filename_lp,
+                 run->info.n_decoders, calibration->n_lights, arguments->filename_calibration);
         return 1;
     }
 
-    if (arguments.verbose) {
-        fprintf (stderr, "%u JPEGs opened ...\n", info.n_decoders);
+    if (run->info.n_decoders < 12) {
+        fprintf (stderr, "%s: not enough images %u < %d\n", run->filename_lp, run->info.n_decoders, 12);
+        return 1;
+    }
+
+    if (arguments->verbose) {
+        fprintf (stderr, "%u images found ...\n", run->info.n_decoders);
         fflush (stderr);
     }
+    return 0;
+}
 
-    /* Do the SVD */
-    float *M = ptm_svd (decoders, info.n_decoders);
-    if (M == NULL) {
-        fprintf (stderr, "Error in Singular Value Decomposition\n");
+/**
+ * The color space to decode the input images into.
+ */
+J_COLOR_SPACE input_color_space (const struct arguments *arguments) {
+    // use YCbCr color space for PTM_LUM and PTM_LRGB files
+    // use RGB color space for PTM_RGB files and photometric stereo
+    if (arguments->photometric_stereo)
+        return JCS_RGB;
+    return (arguments->format->color_components > 0) ? JCS_YCbCr : JCS_RGB;
+}
+
+/**
+ * Fill in the image info of a run from the probed input info.
+ *
+ * The image info holds the dimensions after the transformation.
+ *
+ * @returns 0 on success.
+ */
+int transform_info (const struct arguments *arguments, const char *filename, run_t *run) {
+    ptm_image_info_t *info = &run->info;
+    ptm_input_info_t output_info;
+    if (ptm_transform_info (&arguments->transform, &run->input_info, &output_info)) {
+        fprintf (stderr, "%s: crop rectangle outside of image %lux%lu\n",
+                 filename, run->input_info.width, run->input_info.height);
         return 1;
     }
+    info->width          = output_info.width;
+    info->height         = output_info.height;
+    info->pixels         = info->height * info->width;
+    info->row_stride     = info->width * run->input_info.components;
+    info->decoder_stride = info->height * info->row_stride;
+    info->sample_size    = run->input_info.sample_size;
+    return 0;
+}
 
-    if (arguments.verbose) {
-        fprintf (stderr, "done SVD\n");
-        fflush (stderr);
+/**
+ * Probe the headers of all input files of a run.
+ *
+ * Reads only as much of each file as needed to parse the header.  Checks that
+ * all images have the same dimensions and fills in the image info.
+ *
+ * @returns 0 on success.
+ */
+int probe_run (const struct arguments *arguments, run_t *run) {
+    ptm_image_info_t *info = &run->info;
+    ptm_input_info_t *input_infos = calloc (info->n_decoders, sizeof (ptm_input_info_t));
+    int status = 0;
+
+    #pragma omp parallel for schedule(dynamic) num_threads (arguments->io_threads)
+    for (size_t n = 0; n < info->n_decoders; ++n) {
+        decoder_t *decoder = run->decoders[n];
+        ptm_ctx_t ctx;
+        ptm_ctx_init (&ctx);
+        if (ptm_probe_input (&ctx, decoder->filename, input_color_space (arguments),
+                             &decoder->input_format, &input_infos[n])) {
+            fprintf (stderr, "%s\n", ctx.message);
+            #pragma omp atomic write
+            status = 1;
+        }
+    }
+
+    if (status == 0) {
+        // sanity check: all images must be the same size
+        const ptm_input_info_t *i0 = &input_infos[0];
+        for (size_t n = 1; n < info->n_decoders; ++n) {
+            const ptm_input_info_t *in = &input_infos[n];
+            if (memcmp (i0, in, sizeof (ptm_input_info_t))) {
+                fprintf (stderr, "%s: size %lux%lux%dx%d differs from %s: %lux%lux%dx%d\n",
+                         run->decoders[n]->filename, in->width, in->height, in->components, in->sample_size * 8,
+                         run->decoders[0]->filename, i0->width, i0->height, i0->components, i0->sample_size * 8);
+                status = 1;
+            }
+        }
     }
 
-    const struct jpeg_decompress_struct *dinfo = &decoders[0]->dinfo;
+    run->input_info = input_infos[0];
+    if (transform_info (arguments, run->filename_lp, run))
+        status = 1;
 
-    info.height         = dinfo->output_height;
-    info.width          = dinfo->output_width;
-    info.pixels         = info.height * info.width;
-    info.row_stride     = info.width * dinfo->output_components;
-    info.decoder_stride = info.height * info.row_stride;
+    const calibration_t *calibration = &arguments->calibration;
+    if (status == 0 && calibration->flat_fields &&
+        memcmp (&calibration->flat_info, &run->input_info, sizeof (ptm_input_info_t))) {
+        fprintf (stderr, "%s: size of the images differs from the flat-field images in %s\n",
+                 run->filename_lp, arguments->filename_calibration);
+        status = 1;
+    }
 
-    ptm_header->dimen[0] = info.width;
-    ptm_header->dimen[1] = info.height;
+    free (input_infos);
+    return status;
+}
 
-    // sanity check: all images must be the same size
-    for (size_t i = 0; i < info.n_decoders; ++i) {
-        const struct jpeg_decompress_struct *dinfo2 = &decoders[i]->dinfo;
-        assert (dinfo2->output_width      == dinfo->output_width);
-        assert (dinfo2->output_height     == dinfo->output_height);
-        assert (dinfo2->output_components == dinfo->output_components);
+/**
+ * Decode one image of a run.
+ *
+ * The image is flipped vertically and transformed.  If the image is to be
+ * transformed, it is decoded into a scratch buffer first, else it is decoded
+ * straight into image.
+ *
+ * @param image [out] The decoded image, decoder_stride samples.
+ *
+ * @returns 0 on success.
+ */
+int decode_image (const struct arguments *arguments, const run_t *run,
+                  const ptm_input_format_t *format, const unsigned char *data, size_t size,
+                  unsigned char *image) {
+    const ptm_image_info_t *info = &run->info;
+    const ptm_input_info_t output_info = {
+        info->width, info->height, run->input_info.components, run->input_info.sample_size
+    };
+
+    void **row_pointer = ptm_arena_alloc (run->arena, info->height * sizeof (void *));
+    if (row_pointer == NULL) {
+        fprintf (stderr, "out of memory\n");
+        return 1;
     }
+    for (size_t y = 0; y < info->height; ++y) {
+        // flip the image vertically
+        size_t flipped_y = (info->height - y - 1);
+        row_pointer[y] = image + flipped_y * info->row_stride * info->sample_size;
+    }
+    int err_decode;
+    if (ptm_transform_is_identity (&arguments->transform)) {
+        err_decode = format->decode (data, size, input_color_space (arguments), 1,
+                                     &run->input_info, row_pointer);
+    } else {
+        unsigned int scale_denom = ptm_transform_prescale (&arguments->transform,
+                                                           format->max_scale_denom);
+        ptm_input_info_t decoded_info;
+        ptm_transform_prescaled_info (&run->input_info, scale_denom, &decoded_info);
+        size_t stride = decoded_info.width * decoded_info.components * decoded_info.sample_size;
+        unsigned char *scratch = malloc (decoded_info.height * stride);
+        void **scratch_rows = malloc (decoded_info.height * sizeof (void *));
+        if (scratch == NULL || scratch_rows == NULL) {
+            fprintf (stderr, "out of memory\n");
+            free (scratch_rows);
+            free (scratch);
+            return 1;
+        }
+        for (size_t y = 0; y < decoded_info.height; ++y) {
+            scratch_rows[y] = scratch + y * stride;
+        }
+        err_decode = format->decode (data, size, input_color_space (arguments), scale_denom,
+                                     &decoded_info, scratch_rows);
+        if (!err_decode) {
+            ptm_transform_image (&arguments->transform, scale_denom, &decoded_info, scratch,
+                                 &output_info, row_pointer);
+        }
+        free (scratch_rows);
+        free (scratch);
+    }
+    return err_decode;
+}
+
+/**
+ * Decode the flat-field images of the calibration.
+ *
+ * The images are decoded and transformed like the input images and turned
+ * into flat-field corrections once, before the first run.  All flat-field
+ * images must have the same size.
+ *
+ * @returns 0 on success.
+ */
+int load_flat_fields (struct arguments *arguments) {
+    calibration_t *calibration = &arguments->calibration;
+    const char *first = NULL;
+    for (int n = 0; n < calibration->n_lights && first == NULL; ++n)
+        first = calibration->filenames_flat[n];
+    if (first == NULL)
+        return 0;
+
+    // a run of flat-field images, for decode_image ()
+    run_t run;
+    memset (&run, 0, sizeof (run_t));
+    const ptm_input_format_t *format;
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    if (ptm_probe_input (&ctx, first, input_color_space (arguments), &format, &run.input_info)) {
+        fprintf (stderr, "%s\n", ctx.message);
+        return 1;
+    }
+    if (transform_info (arguments, first, &run))
+        return 1;
+    calibration->flat_info = run.input_info;
+    calibration->flat_fields = calloc (calibration->n_lights, sizeof (float *));
+    run.arena = ptm_arena_create ();
+    if (calibration->flat_fields == NULL || run.arena == NULL) {
+        fprintf (stderr, "out of memory\n");
+        ptm_arena_destroy (run.arena);
+        return 1;
+    }
+    calibration->fit.flat_fields = calibration->flat_fields;
 
-    JSAMPLE * const buffer = calloc (info.n_decoders * info.decoder_stride, sizeof (JSAMPLE));
+    const ptm_image_info_t *info = &run.info;
+    const ptm_input_info_t output_info = {
+        info->width, info->height, run.input_info.components, run.input_info.sample_size
+    };
+    int status = 0;
 
-    /* Parallel decode all JPEGs into huge buffer. */
     #pragma omp parallel for schedule(dynamic)
-    for (size_t n = 0; n < info.n_decoders; ++n) {
-        struct jpeg_decompress_struct *dinfo2 = &decoders[n]->dinfo;
-        JSAMPROW *row_pointer = calloc (info.height, sizeof (JSAMPROW));
-        for (size_t y = 0; y < info.height; ++y) {
-            // flip the image vertically
-            size_t flipped_y = (info.height - y - 1);
-            row_pointer[y] = buffer + (n * info.decoder_stride) + (flipped_y * info.row_stride);
+    for (int n = 0; n < calibration->n_lights; ++n) {
+        const char *filename_flat = calibration->filenames_flat[n];
+        if (filename_flat == NULL)
+            continue;
+
+        const ptm_input_format_t *format;
+        ptm_input_info_t flat_info;
+        unsigned char *data = NULL;
+        size_t size;
+        int err;
+        ptm_ctx_t ctx;
+        ptm_ctx_init (&ctx);
+        if (ptm_probe_input (&ctx, filename_flat, input_color_space (arguments), &format, &flat_info)) {
+            fprintf (stderr, "%s\n", ctx.message);
+            #pragma omp atomic write
+            status = 1;
+            continue;
+        }
+        if (memcmp (&flat_info, &run.input_info, sizeof (ptm_input_info_t))) {
+            fprintf (stderr, "%s: size differs from %s\n", filename_flat, first);
+            #pragma omp atomic write
+            status = 1;
+            continue;
+        }
+        if ((err = ptm_read_file (filename_flat, &data, &size))) {
+            fprintf (stderr, "can't open %s: %s\n", filename_flat, strerror (err));
+            #pragma omp atomic write
+            status = 1;
+            continue;
+        }
+        unsigned char *scratch = malloc (info->decoder_stride * info->sample_size);
+        float *flat = NULL;
+        if (scratch == NULL)
+            fprintf (stderr, "out of memory\n");
+        else if (decode_image (arguments, &run, format, data, size, scratch))
+            fprintf (stderr, "%s: can't decode %s\n", filename_flat, format->name);
+        else if ((flat = ptm_flat_field (&output_info, input_color_space (arguments), scratch)) == NULL)
+            fprintf (stderr, "out of memory\n");
+        free (scratch);
+        free (data);
+        calibration->flat_fields[n] = flat;
+        if (flat == NULL) {
+            #pragma omp atomic write
+            status = 1;
+        }
+    }
+
+    ptm_arena_destroy (run.arena);
+    return status;
+}
+
+/**
+ * Parallel decode all images of a run into one huge buffer.
+ *
+ * If the images are to be transformed, each image is decoded into a scratch
+ * buffer first, else it is decoded straight into the huge buffer.
+ *
+ * @returns 0 on success.
+ */
+int decode_run (const struct arguments *arguments, run_t *run) {
+    ptm_stats_start (&run->stats);
+
+    ptm_image_info_t *info = &run->info;
+
+    const char **paths = malloc (info->n_decoders * sizeof (char *));
+    for (size_t i = 0; i < info->n_decoders; ++i) {
+        paths[i] = run->decoders[i]->filename;
+    }
+    int n_jobs = arguments->jobs > 0 ? arguments->jobs : omp_get_max_threads ();
+    ptm_prefetcher_t *prefetcher = ptm_prefetch_start (paths, info->n_decoders,
+                                                       arguments->io_threads,
+                                                       arguments->io_threads + n_jobs);
+
+    unsigned char * const buffer = ptm_arena_alloc (run->arena,
+                                                    info->n_decoders * info->decoder_stride * info->sample_size);
+    if (buffer == NULL) {
+        fprintf (stderr, "%s: out of memory\n", run->filename_lp);
+        ptm_prefetch_stop (prefetcher);
+        free (paths);
+        return 1;
+    }
+    run->buffer = buffer;
+    ptm_first_touch (buffer, info->n_decoders, info->height, info->row_stride * info->sample_size);
+
+    int status = 0;
+    size_t bytes_read = 0;
+
+    /* Parallel decode all images into huge buffer. */
+    #pragma omp parallel for schedule(dynamic) num_threads (n_jobs)
+    for (size_t n = 0; n < info->n_decoders; ++n) {
+        const unsigned char *data;
+        size_t size;
+        int err = ptm_prefetch_get (prefetcher, n, &data, &size);
+        if (err) {
+            fprintf (stderr, "can't open %s: %s\n", paths[n], strerror (err));
+            #pragma omp atomic write
+            status = 1;
+            ptm_prefetch_release (prefetcher, n);
+            continue;
         }
-        while (dinfo2->output_scanline < dinfo2->output_height) {
-            (void) jpeg_read_scanlines (dinfo2, row_pointer + dinfo2->output_scanline, info.height);
+        #pragma omp atomic update
+        bytes_read += size;
+
+        const ptm_input_format_t *format = run->decoders[n]->input_format;
+        unsigned char *image = buffer + n * info->decoder_stride * info->sample_size;
+        if (decode_image (arguments, run, format, data, size, image)) {
+            // the file may have changed since we probed it
+            fprintf (stderr, "%s: can't decode %s\n", paths[n], format->name);
+            #pragma omp atomic write
+            status = 1;
         }
-        (void) jpeg_finish_decompress (dinfo2);
-        (void) jpeg_destroy_decompress (dinfo2);
-        fclose (decoders[n]->fp);
-        free (row_pointer);
+        ptm_prefetch_release (prefetcher, n);
+    }
+
+    ptm_prefetch_stop (prefetcher);
+    free (paths);
+
+    ptm_stage_t *stage = ptm_stats_stop (&run->stats, "decode");
+    if (stage) {
+        stage->bytes_read    = bytes_read;
+        stage->mpixel_lights = run->input_info.width * run->input_info.height * info->n_decoders / 1e6;
+    }
+    report_stage (arguments, stage);
+
+    return status;
+}
+
+/**
+ * The brightness calibration as the fits take it.
+ *
+ * @returns The calibration or NULL if not calibrated.
+ */
+const ptm_calibration_t *fit_calibration (const struct arguments *arguments) {
+    return arguments->calibration.n_lights ? &arguments->calibration.fit : NULL;
+}
+
+/**
+ * Fit the polynomials to one color component of the input images.
+ *
+ * Dispatches on the sample size of the input images.
+ */
+void fit_poly (const ptm_image_info_t *info,
+               const void *buffer,
+               size_t component,
+               size_t pixel_stride,
+               const float *M,
+               size_t tile_size,
+               const ptm_calibration_t *calibration,
+               ptm_unscaled_coefficients_t *output) {
+    if (info->sample_size == 2) {
+        ptm_fit_poly_u16 (info, (const uint16_t *) buffer + component, pixel_stride, M, tile_size,
+                          calibration, output);
+    } else {
+        ptm_fit_poly_jsample (info, (const JSAMPLE *) buffer + component, pixel_stride, M, tile_size,
+                              calibration, output);
     }
+}
 
-    TIME ("time for decoding %u JPEGs = %lums\n", info.n_decoders);
+/**
+ * Set up the near-field correction for a run.
+ *
+ * The center of the dome is assumed over the center of the input images.
+ * Crop, shrink and rotation are taken into account.
+ */
+void near_field_for_run (const struct arguments *arguments, const run_t *run, ptm_near_field_t *near_field) {
+    const ptm_transform_t *t = &arguments->transform;
+    near_field->radius    = arguments->near_field_radius / (t->shrink > 1 ? t->shrink : 1);
+    near_field->center_x  = run->input_info.width  / 2.0f;
+    near_field->center_y  = run->input_info.height / 2.0f;
+    near_field->tile_size = NEAR_FIELD_TILE;
+    ptm_transform_point (t, &run->input_info, &near_field->center_x, &near_field->center_y);
+}
+
+/**
+ * Average the YCbCr values of all input images.
+ *
+ * Dispatches on the method and the sample size of the input images.  If
+ * coeffs is given, outputs LRGB.
+ */
+void cbcr_avg (const ptm_image_info_t *info,
+               const void *buffer,
+               ptm_chroma_enum_t method,
+               ycbcr_coefficients_t *block,
+               ptm_unscaled_coefficients_t *coeffs) {
+    if (method != PTM_CHROMA_MEAN) {
+        ptm_cbcr_median (info, buffer, method, block, coeffs);
+    } else if (info->sample_size == 2) {
+        ptm_cbcr_avg_u16 (info, (const uint16_t *) buffer, block, coeffs);
+    } else {
+        ptm_cbcr_avg (info, (const ycbcr_coefficients_t *) buffer, block, coeffs);
+    }
+}
+
+/**
+ * Load a run: read the .lp file and decode all images.
+ *
+ * @returns 0 on success.
+ */
+int load_run (const struct arguments *arguments, run_t *run) {
+    ptm_stats_init (&run->stats);
+    run->status = open_decoders (arguments, run);
+    if (run->status == 0) {
+        run->status = probe_run (arguments, run);
+        report_stage (arguments, ptm_stats_stop (&run->stats, "probe"));
+    }
+    if (run->status == 0)
+        run->status = decode_run (arguments, run);
+    return run->status;
+}
+
+/**
+ * Save the fitted coefficients of a tile for the mosaic.
+ *
+ * The coefficients go into a temporary file, followed by the color block if
+ * the format has one.  Also finds the range of the coefficients.
+ *
+ * @returns 0 on success.
+ */
+int spill_tile (const ptm_header_t *ptm_header, run_t *run,
+                const ptm_unscaled_coefficients_t *coeffs, ptm_block_t *blocks) {
+    const ptm_format_t *format = ptm_header->format;
+    const size_t pixels = run->info.pixels;
+
+    // the blocks are contiguous, so treat them as one tall image
+    ptm_coefficients_range (coeffs, run->info.width, run->info.height * format->ptm_blocks,
+                            &run->min, &run->max);
+
+    if ((run->fp_tile = tmpfile ()) == NULL) {
+        fprintf (stderr, "%s: can't create temporary file: %s\n", run->filename_lp, strerror (errno));
+        return 1;
+    }
+    size_t n = fwrite (coeffs, sizeof (ptm_unscaled_coefficients_t), pixels * format->ptm_blocks, run->fp_tile);
+    int status = n != pixels * format->ptm_blocks;
+    if (format->blocks > format->ptm_blocks) {
+        status |= fwrite (blocks[format->ptm_blocks], RGB_COEFFICIENTS, pixels, run->fp_tile) != pixels;
+    }
+    if (status) {
+        fprintf (stderr, "%s: can't write temporary file: %s\n", run->filename_lp, strerror (errno));
+    }
+    return status;
+}
+
+/** What get_mosaic_row() needs to know. */
+typedef struct {
+    const ptm_header_t *ptm_header;
+    const run_t *runs;
+    int n_runs;
+    ptm_unscaled_coefficients_t *scratch;  /**< One row of a tile. */
+} mosaic_t;
+
+/**
+ * Assemble one row of a block of the mosaic from the tiles.
+ *
+ * Where the tiles overlap, the tile listed last wins.  Pixels not covered by
+ * any tile are black.
+ */
+int get_mosaic_row (int block, size_t y, JSAMPLE *row, void *user_data) {
+    const mosaic_t *mosaic = user_data;
+    const ptm_header_t *ptm_header = mosaic->ptm_header;
+    const ptm_format_t *format = ptm_header->format;
+    const size_t width = ptm_header->dimen[0];
+    const int is_color = block >= format->ptm_blocks;
+
+    if (is_color) {
+        memset (row, 0, width * RGB_COEFFICIENTS);
+    } else {
+        // a coefficient of 0
+        ptm_coefficients_t zero;
+        JSAMPLE *z = (JSAMPLE *) &zero;
+        for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+            z[i] = CLIP (ptm_header->bias[i]);
+        }
+        for (size_t x = 0; x < width; ++x) {
+            ((ptm_coefficients_t *) row)[x] = zero;
+        }
+    }
+
+    // the PTM is stored bottom row first
+    const size_t image_y = ptm_header->dimen[1] - 1 - y;
+
+    for (int t = 0; t < mosaic->n_runs; ++t) {
+        const run_t *run = &mosaic->runs[t];
+        const size_t w = run->info.width;
+        const size_t h = run->info.height;
+        if (image_y < run->y || image_y >= run->y + h)
+            continue;
+        const size_t tile_row = h - 1 - (image_y - run->y);
+
+        off_t offset;
+        size_t n;
+        if (is_color) {
+            offset = (off_t) run->info.pixels * format->ptm_blocks * sizeof (ptm_unscaled_coefficients_t)
+                + (off_t) tile_row * w * RGB_COEFFICIENTS;
+            n = fseeko (run->fp_tile, offset, SEEK_SET) ? 0 :
+                fread (row + run->x * RGB_COEFFICIENTS, RGB_COEFFICIENTS, w, run->fp_tile);
+        } else {
+            offset = ((off_t) block * run->info.pixels + (off_t) tile_row * w) * sizeof (ptm_unscaled_coefficients_t);
+            n = fseeko (run->fp_tile, offset, SEEK_SET) ? 0 :
+                fread (mosaic->scratch, sizeof (ptm_unscaled_coefficients_t), w, run->fp_tile);
+            ptm_quantize_coefficients (ptm_header, mosaic->scratch, n, row + run->x * PTM_COEFFICIENTS);
+        }
+        if (n != w) {
+            fprintf (stderr, "can't read temporary file of tile %d\n", t + 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stitch the fitted tiles into one PTM.
+ *
+ * The PTM is written one row at a time, so the mosaic is never held in memory.
+ *
+ * @returns 0 on success.
+ */
+int write_mosaic (const struct arguments *arguments, run_t *runs, int n_runs) {
+    double start = ptm_wall_time ();
+
+    ptm_header_t *ptm_header = ptm_alloc_header ();
+    ptm_header->format      = arguments->format;
+    ptm_header->progressive = arguments->progressive;
+    ptm_header->restart_rows = arguments->index ? PTM_INDEX_TILE_ROWS : 0;
+
+    // the size of the mosaic and the range of the coefficients of all tiles
+    ptm_unscaled_coefficients_t min, max;
+    float *mn = (float *) &min;
+    float *mx = (float *) &max;
+    for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+        mn[i] =  FLT_MAX;
+        mx[i] = -FLT_MAX;
+    }
+    size_t max_width = 0;
+    for (int t = 0; t < n_runs; ++t) {
+        const run_t *run = &runs[t];
+        const float *tmn = (const float *) &run->min;
+        const float *tmx = (const float *) &run->max;
+        for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+            mn[i] = fminf (mn[i], tmn[i]);
+            mx[i] = fmaxf (mx[i], tmx[i]);
+        }
+        if (run->x + run->info.width > ptm_header->dimen[0])
+            ptm_header->dimen[0] = run->x + run->info.width;
+        if (run->y + run->info.height > ptm_header->dimen[1])
+            ptm_header->dimen[1] = run->y + run->info.height;
+        if (run->info.width > max_width)
+            max_width = run->info.width;
+    }
+    ptm_set_scale_bias (ptm_header, &min, &max);
+
+    if (arguments->verbose) {
+        fprintf (stderr, "mosaic of %d tiles: %lux%lu\n", n_runs, ptm_header->dimen[0], ptm_header->dimen[1]);
+        fflush (stderr);
+    }
+
+    FILE *fp;
+    if (!strcmp (arguments->filename_ptm, "-")) {
+        fp = stdout;
+    } else if ((fp = fopen (arguments->filename_ptm, "wb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", arguments->filename_ptm);
+        free (ptm_header);
+        return 1;
+    }
+
+    mosaic_t mosaic = { ptm_header, runs, n_runs, NULL };
+    mosaic.scratch = malloc (max_width * sizeof (ptm_unscaled_coefficients_t));
+    int status = ptm_write_ptm_rows (NULL, fp, ptm_header, get_mosaic_row, &mosaic) ? 1 : 0;
+    if (fp != stdout)
+        fclose (fp);
+    if (status == 0 && arguments->index)
+        status = ptm_write_index (NULL, arguments->filename_ptm) ? 1 : 0;
+    free (mosaic.scratch);
+    free (ptm_header);
+
+    if (arguments->verbose) {
+        fprintf (stderr, "time for mosaic = %.0fms\n", (ptm_wall_time () - start) * 1000);
+        fflush (stderr);
+    }
+    return status;
+}
+
+/**
+ * Estimate the normals and the albedo by photometric stereo.
+ *
+ * Does not fit a PTM.
+ *
+ * @returns 0 on success.
+ */
+int encode_run_lambert (const struct arguments *arguments, run_t *run) {
+    ptm_stats_start (&run->stats);
+    ptm_stage_t *stage;
+    const ptm_calibration_t *calibration = fit_calibration (arguments);
+
+    const ptm_image_info_t *info = &run->info;
+
+    float *M = NULL;
+    uint64_t key = ptm_light_hash (run->decoders, info->n_decoders, PTM_BASIS_LAMBERT);
+    if (arguments->cache_dir)
+        M = ptm_cache_read_matrix (arguments->cache_dir, key, LAMBERT_COEFFICIENTS, info->n_decoders);
+    if (M == NULL) {
+        M = ptm_svd_lambert (run->decoders, info->n_decoders);
+        if (M == NULL) {
+            fprintf (stderr, "Error in Singular Value Decomposition\n");
+            return 1;
+        }
+        if (arguments->cache_dir &&
+            ptm_cache_write_matrix (arguments->cache_dir, key, M, LAMBERT_COEFFICIENTS, info->n_decoders)) {
+            fprintf (stderr, "can't write SVD cache in %s\n", arguments->cache_dir);
+        }
+    }
+
+    report_stage (arguments, ptm_stats_stop (&run->stats, "svd"));
+
+    JSAMPLE *normals = ptm_arena_alloc (run->arena, info->pixels * RGB_COEFFICIENTS);
+    JSAMPLE *albedo  = arguments->albedo ? ptm_arena_alloc (run->arena, info->pixels * RGB_COEFFICIENTS) : NULL;
+    if (normals == NULL || (arguments->albedo && albedo == NULL)) {
+        fprintf (stderr, "%s: out of memory\n", run->filename_lp);
+        free (M);
+        return 1;
+    }
+    ptm_fit_lambert (info, run->buffer, M, calibration, normals, albedo);
+    free (M);
+
+    stage = ptm_stats_stop (&run->stats, "fit");
+    if (stage)
+        stage->mpixel_lights = info->pixels * info->n_decoders / 1e6;
+    report_stage (arguments, stage);
+
+    int status = write_png_for_run (run, "-normals.png", normals);
+    if (albedo)
+        status |= write_png_for_run (run, "-albedo.png", albedo);
+
+    report_stage (arguments, ptm_stats_stop (&run->stats, "write"));
+    return status;
+}
+
+/**
+ * Allocate blocks of unscaled coefficients from the arena of a run.
+ *
+ * The rows are first touched by the threads that will fit and scale them.
+ */
+ptm_unscaled_coefficients_t *alloc_coeffs (const run_t *run, int n_blocks) {
+    const ptm_image_info_t *info = &run->info;
+    const size_t row_size = info->width * sizeof (ptm_unscaled_coefficients_t);
+    ptm_unscaled_coefficients_t *coeffs = ptm_arena_alloc (run->arena, n_blocks * info->height * row_size);
+    if (coeffs)
+        ptm_first_touch (coeffs, n_blocks, info->height, row_size);
+    return coeffs;
+}
+
+/**
+ * Fit the polynomials and write the PTM file.
+ *
+ * The big buffers come from the arena of the run and are freed when it is
+ * reset.
+ *
+ * @returns 0 on success.
+ */
+int encode_run (const struct arguments *arguments, run_t *run) {
+    ptm_stats_start (&run->stats);
+    ptm_stage_t *stage;
+
+    const ptm_image_info_t *info = &run->info;
+    void * const buffer = run->buffer;
+    const ptm_calibration_t *calibration = fit_calibration (arguments);
+
+    /* Do the SVD, unless we already did it for the same lights.  With the
+       near-field correction there is one matrix per tile. */
+    float *M = NULL;
+    uint64_t key;
+    size_t tile_size = 0;
+    int n_rows = PTM_COEFFICIENTS;
+    ptm_near_field_t near_field;
+    if (arguments->near_field_radius > 0.0f) {
+        near_field_for_run (arguments, run, &near_field);
+        tile_size = near_field.tile_size;
+        n_rows *= ((info->width + tile_size - 1) / tile_size) * ((info->height + tile_size - 1) / tile_size);
+        key = ptm_light_hash (run->decoders, info->n_decoders, PTM_BASIS_PTM_NEAR_FIELD);
+        key = ptm_fnv1a (key, &near_field.radius,   sizeof (float));
+        key = ptm_fnv1a (key, &near_field.center_x, sizeof (float));
+        key = ptm_fnv1a (key, &near_field.center_y, sizeof (float));
+        key = ptm_fnv1a (key, &near_field.tile_size, sizeof (size_t));
+        key = ptm_fnv1a (key, &info->width,  sizeof (size_t));
+        key = ptm_fnv1a (key, &info->height, sizeof (size_t));
+    } else {
+        key = ptm_light_hash (run->decoders, info->n_decoders, PTM_BASIS_PTM);
+    }
+    if (arguments->cache_dir) {
+        M = ptm_cache_read_matrix (arguments->cache_dir, key, n_rows, info->n_decoders);
+        if (M && arguments->verbose) {
+            fprintf (stderr, "using cached SVD %016llx\n", (unsigned long long) key);
+            fflush (stderr);
+        }
+    }
+    if (M == NULL) {
+        M = tile_size ?
+            ptm_svd_near_field (run->decoders, info->n_decoders, &near_field, info->width, info->height) :
+            ptm_svd (run->decoders, info->n_decoders);
+        if (M == NULL) {
+            fprintf (stderr, "Error in Singular Value Decomposition\n");
+            return 1;
+        }
+
+        if (arguments->cache_dir &&
+            ptm_cache_write_matrix (arguments->cache_dir, key, M, n_rows, info->n_decoders)) {
+            fprintf (stderr, "can't write SVD cache in %s\n", arguments->cache_dir);
+        }
+    }
+
+    report_stage (arguments, ptm_stats_stop (&run->stats, "svd"));
+
+    ptm_header_t * const ptm_header = ptm_alloc_header ();
+    ptm_header->format   = arguments->format;
+    ptm_header->progressive = arguments->progressive;
+    ptm_header->restart_rows = arguments->index ? PTM_INDEX_TILE_ROWS : 0;
+    ptm_header->dimen[0] = info->width;
+    ptm_header->dimen[1] = info->height;
 
     // float[rgb][y][x][coeffs]
-    ptm_unscaled_coefficients_t *coeffs = NULL;
-    ptm_block_t *blocks = ptm_alloc_blocks (ptm_header);
+    ptm_unscaled_coefficients_t *coeffs =
+        alloc_coeffs (run, ptm_header->format->color_components == 0 ? RGB_COEFFICIENTS : 1);
+    ptm_block_t *blocks = ptm_arena_alloc_blocks (run->arena, ptm_header);
+    if (coeffs == NULL || blocks == NULL) {
+        fprintf (stderr, "%s: out of memory\n", run->filename_lp);
+        free (M);
+        free (ptm_header);
+        return 1;
+    }
 
     if (ptm_header->format->color_components == 0) {
         // a PTM_RGB format
-        coeffs = calloc (RGB_COEFFICIENTS * info.pixels, sizeof (ptm_unscaled_coefficients_t));
-
         // fit each of the color channels to the polynomes
         for (int r = 0; r < ptm_header->format->ptm_blocks; ++r) {
-            ptm_fit_poly_jsample (&info,
-                                  buffer + r,
-                                  RGB_COEFFICIENTS,
-                                  M,
-                                  coeffs + (r * info.pixels));
+            fit_poly (info,
+                      buffer,
+                      r,
+                      RGB_COEFFICIENTS,
+                      M,
+                      tile_size,
+                      calibration,
+                      coeffs + (r * info->pixels));
         }
     }
 
@@ -289,19 +1370,22 @@ int main (int argc, char *argv[]) {
         // N.B. the PTM_LUM formats are largely undocumented.  The following is
         // based on some educated guess but is probably not quite correct.
 
-        coeffs = calloc (info.pixels, sizeof (ptm_unscaled_coefficients_t));
-
         // fit polynomes to the Y (of YCbCr)
-        ptm_fit_poly_jsample (&info,
-                              buffer,
-                              3,
-                              M,
-                              coeffs);
+        fit_poly (info,
+                  buffer,
+                  0,
+                  3,
+                  M,
+                  tile_size,
+                  calibration,
+                  coeffs);
 
         // then average Cb and Cr over all images
-        ptm_cbcr_avg (&info,
-                      (const ycbcr_coefficients_t *) buffer,
-                      (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks]);
+        ycbcr_coefficients_t *ycbcr = (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks];
+        if (calibration)
+            ptm_cbcr_calibrated (info, buffer, arguments->chroma, calibration, ycbcr, NULL);
+        else
+            cbcr_avg (info, buffer, arguments->chroma, ycbcr, NULL);
     }
 
     if (ptm_header->format->color_components == 3) {
@@ -310,129 +1394,342 @@ int main (int argc, char *argv[]) {
         // N.B. the LRGB formats are largely undocumented.  The following is
         // based on some educated guess but is probably not quite correct.
 
-        coeffs = calloc (info.pixels, sizeof (ptm_unscaled_coefficients_t));
-
         // fit polynomes to the Y (of YCbCr)
-        ptm_fit_poly_jsample (&info,
-                              buffer,
-                              3,
-                              M,
-                              coeffs);
-
-        // then average Cb and Cr over all images
-        ptm_cbcr_avg (&info,
-                      (const ycbcr_coefficients_t *) buffer,
-                      (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks]);
-
-        const ycbcr_coefficients_t *ycbcr = (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks];
-        rgb_coefficients_t *rgb = (rgb_coefficients_t *) blocks[ptm_header->format->ptm_blocks];
-        ptm_unscaled_coefficients_t *cfs = coeffs;
-
-        for (size_t i = 0; i < info.pixels; ++i) {
-            float y  = ycbcr->y;
-            float cb = ycbcr->cb - CENTERJSAMPLE;
-            float cr = ycbcr->cr - CENTERJSAMPLE;
-            // See: https://github.com/libjpeg-turbo/libjpeg-turbo/blob/master/jdcolor.c
-            // See: https://en.wikipedia.org/wiki/YCbCr#JPEG_conversion
-            rgb->r = CLIP (y                 + 1.40200f * cr);
-            rgb->g = CLIP (y - 0.34414f * cb - 0.71414f * cr);
-            rgb->b = CLIP (y + 1.77200f * cb);
-
-            // finally fix the polynome factors so that Y * R' ~ R
-            float norm = 256.0f / y;
-            cfs->cu2 *= norm;
-            cfs->cv2 *= norm;
-            cfs->cuv *= norm;
-            cfs->cu  *= norm;
-            cfs->cv  *= norm;
-            cfs->c1  *= norm;
-
-            ++rgb;
-            ++ycbcr;
-            ++cfs;
-        }
-    }
-
-    if (ptm_header->format->color_components == 666) {
-        // an LRGB format
-        //
-        // The algorithm alluded to in [Zhang2012]_ uses the median, which is a
-        // bear to compute.
-
-        coeffs = calloc (info.pixels, sizeof (ptm_unscaled_coefficients_t));
+        fit_poly (info,
+                  buffer,
+                  0,
+                  3,
+                  M,
+                  tile_size,
+                  calibration,
+                  coeffs);
+
+        // then average Cb and Cr over all images and convert to LRGB
+        ycbcr_coefficients_t *ycbcr = (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks];
+        if (calibration)
+            // the Y must be calibrated like the one we fitted
+            ptm_cbcr_calibrated (info, buffer, arguments->chroma, calibration, ycbcr, coeffs);
+        else
+            cbcr_avg (info, buffer, arguments->chroma, ycbcr, coeffs);
+    }
 
-        // calculate L = R + G + B for all pixels in all images
-        unsigned int *L = calloc (info.n_decoders * info.pixels, sizeof (int));
-        {
-            const rgb_coefficients_t *rgb = (rgb_coefficients_t *) buffer;
-            unsigned int *l = L;
-            for (size_t i = 0; i < info.n_decoders * info.pixels; ++i) {
-                *l = rgb->r + rgb->g + rgb->b;
-                ++rgb;
-                ++l;
-            }
+    stage = ptm_stats_stop (&run->stats, "fit");
+    if (stage)
+        stage->mpixel_lights = info->pixels * info->n_decoders / 1e6;
+    report_stage (arguments, stage);
+
+    /* Derive the normals and the albedo from the unscaled coefficients */
+    if (arguments->normals || arguments->albedo) {
+        JSAMPLE *normals = arguments->normals ? ptm_arena_alloc (run->arena, info->pixels * RGB_COEFFICIENTS) : NULL;
+        JSAMPLE *albedo  = arguments->albedo  ? ptm_arena_alloc (run->arena, info->pixels * RGB_COEFFICIENTS) : NULL;
+        if ((arguments->normals && normals == NULL) || (arguments->albedo && albedo == NULL)) {
+            fprintf (stderr, "%s: out of memory\n", run->filename_lp);
+            free (M);
+            free (ptm_header);
+            return 1;
         }
-        // fit polynomes to the L
-        ptm_fit_poly_uint (&info,
-                           L,
-                           1,
-                           M,
-                           coeffs);
-
-        // then average RGB over all images
-        // FIXME should use median here!
-        ptm_cbcr_avg (&info,
-                      (const ycbcr_coefficients_t *) buffer,
-                      (ycbcr_coefficients_t *) blocks[ptm_header->format->ptm_blocks]);
-
-        // scale RGB according to L
-        rgb_coefficients_t *rgb = (rgb_coefficients_t *) blocks[ptm_header->format->ptm_blocks];
-        const unsigned int *l = L;
-        for (size_t i = 0; i < info.pixels; ++i) {
-            rgb->r = 256 * (int) rgb->r / *l;
-            rgb->g = 256 * (int) rgb->g / *l;
-            rgb->b = 256 * (int) rgb->b / *l;
-            ++rgb;
-            ++l;
+        ptm_normal_albedo_map (ptm_header, coeffs, blocks, normals, albedo);
+        int status = 0;
+        if (normals)
+            status |= write_png_for_run (run, "-normals.png", normals);
+        if (albedo)
+            status |= write_png_for_run (run, "-albedo.png", albedo);
+        if (status) {
+            free (M);
+            free (ptm_header);
+            return 1;
         }
-
-        free (L);
+        report_stage (arguments, ptm_stats_stop (&run->stats, "maps"));
     }
 
-    free (buffer);
-
-    TIME ("time for ptm_fit_poly_jsample = %lums\n");
+    /* A tile of a mosaic is written later together with the other tiles */
+    if (arguments->filename_mosaic) {
+        int status = spill_tile (ptm_header, run, coeffs, blocks);
+        free (M);
+        free (ptm_header);
+        report_stage (arguments, ptm_stats_stop (&run->stats, "spill"));
+        return status;
+    }
 
     ptm_scale_coefficients (ptm_header, coeffs, blocks);
 
-    TIME ("time for ptm_scale_coefficients = %lums\n");
+    report_stage (arguments, ptm_stats_stop (&run->stats, "scale"));
 
     /* Write the PTM file */
     FILE *fp_ptm;
-    if (!strcmp (arguments.filename_ptm, "-")) {
+    if (!strcmp (run->filename_ptm, "-")) {
         fp_ptm = stdout;
     } else {
-        if ((fp_ptm = fopen (arguments.filename_ptm, "wb")) == NULL) {
-            fprintf (stderr, "can't open %s\n", arguments.filename_ptm);
+        if ((fp_ptm = fopen (run->filename_ptm, "wb")) == NULL) {
+            fprintf (stderr, "can't open %s\n", run->filename_ptm);
+            free (M);
+            free (ptm_header);
             return 1;
         }
     }
 
-    ptm_write_ptm (fp_ptm, ptm_header, blocks);
+    // ftell fails if the output is a pipe, then we don't know the size
+    long pos = ftell (fp_ptm);
+    int status = ptm_write_ptm (NULL, fp_ptm, ptm_header, blocks);
+    fflush (fp_ptm);
+    long end = ftell (fp_ptm);
+    fclose (fp_ptm);
+    if (status) {
+        free (M);
+        free (ptm_header);
+        return 1;
+    }
 
-    TIME ("time for ptm_write_ptm = %lums\n");
+    stage = ptm_stats_stop (&run->stats, "write");
+    if (stage && pos >= 0 && end >= pos)
+        stage->bytes_written = end - pos;
+    report_stage (arguments, stage);
 
-    fclose (fp_ptm);
+    if (arguments->index) {
+        if (ptm_write_index (NULL, run->filename_ptm)) {
+            free (M);
+            free (ptm_header);
+            return 1;
+        }
+        report_stage (arguments, ptm_stats_stop (&run->stats, "index"));
+    }
 
     /* Cleanup */
 
     free (M);
-    ptm_free_blocks (ptm_header, blocks);
-    for (size_t i = 0; i < info.n_decoders; ++i) {
-        decoder_t *decoder = decoders[i];
+    free (ptm_header);
+    return 0;
+}
+
+/**
+ * Write the statistics of a run as one line of JSON.
+ */
+void write_stats (FILE *fp, const struct arguments *arguments, const run_t *run) {
+    fprintf (fp, "{\"lp\": ");
+    ptm_write_json_string (fp, run->filename_lp);
+    fprintf (fp, ", \"ptm\": ");
+    ptm_write_json_string (fp, run->filename_ptm);
+    fprintf (fp, ", \"format\": \"%s\", \"width\": %lu, \"height\": %lu, \"images\": %u, ",
+             arguments->format->name, run->info.width, run->info.height, run->info.n_decoders);
+    fprintf (fp, "\"threads\": %d, \"status\": %d, \"stats\": ", omp_get_max_threads (), run->status);
+    ptm_stats_write_json (fp, &run->stats);
+    fprintf (fp, "}\n");
+    fflush (fp);
+}
+
+/**
+ * Free all memory held by a run, except the arena.
+ */
+void free_run (run_t *run) {
+    for (size_t i = 0; i < run->info.n_decoders; ++i) {
+        decoder_t *decoder = run->decoders[i];
         free (decoder->filename);
         free (decoder);
     }
-    free (decoders);
-    free (ptm_header);
+    free (run->decoders);
+    free (run->filename_lp);
+    free (run->filename_ptm);
+    run->decoders = NULL;
+    run->buffer = NULL;
+    run->info.n_decoders = 0;
+}
+
+/**
+ * Pin the OpenMP threads to cores.
+ *
+ * The OpenMP runtime reads its environment when the program starts, so set
+ * the environment and start over.  If the user already chose a binding with
+ * OMP_PROC_BIND, keep it and warn unless it is the one we would set, as it is
+ * after we started over.
+ *
+ * @returns 0 if the threads are pinned or the user's binding is kept, else 1.
+ */
+int pin_threads (char *argv[]) {
+    const char *bind = getenv ("OMP_PROC_BIND");
+    if (bind) {
+        if (strcmp (bind, "close") != 0)
+            fprintf (stderr, "warning: OMP_PROC_BIND=%s overrides --pin\n", bind);
+        return 0;
+    }
+    setenv ("OMP_PROC_BIND", "close", 1);
+    if (getenv ("OMP_PLACES") == NULL)
+        setenv ("OMP_PLACES", "cores", 1);
+    execv ("/proc/self/exe", argv);
+    fprintf (stderr, "can't pin threads: %s\n", strerror (errno));
+    return 1;
+}
+
+int main (int argc, char *argv[]) {
+    struct arguments arguments;
+
+    arguments.verbose           = 0;
+    arguments.format            = ptm_get_format ("PTM_FORMAT_JPEG_RGB");
+    arguments.filenames_lp      = calloc (argc, sizeof (char *));
+    arguments.n_filenames_lp    = 0;
+    arguments.filename_manifest = NULL;
+    arguments.filename_mosaic   = NULL;
+    arguments.filename_ptm      = NULL;
+    arguments.cache_dir         = NULL;
+    arguments.filename_stats    = NULL;
+    memset (&arguments.transform, 0, sizeof (ptm_transform_t));
+    arguments.transform.shrink  = 1;
+    arguments.normals           = 0;
+    arguments.albedo            = 0;
+    arguments.photometric_stereo = 0;
+    arguments.progressive       = 0;
+    arguments.index             = 0;
+    arguments.near_field_radius = 0.0f;
+    arguments.filename_calibration = NULL;
+    memset (&arguments.calibration, 0, sizeof (calibration_t));
+    arguments.chroma            = PTM_CHROMA_MEAN;
+    arguments.io_threads        = 4;
+    arguments.jobs              = 0;
+    arguments.pin               = 0;
+
+    argp_parse (&argp, argc, argv, 0, 0, &arguments);
+
+    if (arguments.pin && pin_threads (argv))
+        return 1;
+
+    if (arguments.photometric_stereo && arguments.near_field_radius > 0.0f) {
+        fprintf (stderr, "--near-field cannot be used with --photometric-stereo\n");
+        return 1;
+    }
+
+    if (arguments.filename_calibration && (read_calibration (arguments.filename_calibration,
+                                                             &arguments.calibration) ||
+                                           load_flat_fields (&arguments)))
+        return 1;
+
+    /* Make the list of runs. */
+
+    int max_runs = arguments.n_filenames_lp + 16;
+    int n_runs = 0;
+    run_t *runs = calloc (max_runs, sizeof (run_t));
+
+    for (int i = 0; i < arguments.n_filenames_lp; ++i) {
+        runs[n_runs].filename_lp = strdup (arguments.filenames_lp[i]);
+        ++n_runs;
+    }
+    if (arguments.filename_manifest) {
+        n_runs = read_manifest (arguments.filename_manifest, &runs, &max_runs, n_runs);
+        if (n_runs < 0)
+            return 1;
+    }
+    if (arguments.filename_mosaic) {
+        if (n_runs > 0 || arguments.photometric_stereo) {
+            fprintf (stderr, "--mosaic cannot be used with other runs or --photometric-stereo\n");
+            return 1;
+        }
+        n_runs = read_mosaic (arguments.filename_mosaic, &runs, &max_runs, n_runs);
+        if (n_runs < 0)
+            return 1;
+    }
+    free (arguments.filenames_lp);
+
+    if (n_runs == 0) {
+        fprintf (stderr, "nothing to do\n");
+        return 1;
+    }
+    if (arguments.filename_mosaic) {
+        // the tiles are named after their .lp files, the mosaic after --output
+        if (arguments.filename_ptm == NULL)
+            arguments.filename_ptm = "-";
+    } else if (n_runs == 1 && arguments.filename_manifest == NULL) {
+        runs[0].filename_ptm = strdup (arguments.filename_ptm ? arguments.filename_ptm : "-");
+    } else if (arguments.filename_ptm) {
+        fprintf (stderr, "--output can only be used with one run\n");
+        return 1;
+    }
+    for (int i = 0; i < n_runs; ++i) {
+        if (runs[i].filename_ptm == NULL)
+            runs[i].filename_ptm = default_filename_ptm (runs[i].filename_lp);
+    }
+    if (arguments.index && ((arguments.filename_mosaic && !strcmp (arguments.filename_ptm, "-")) ||
+                            (!arguments.filename_mosaic && !strcmp (runs[0].filename_ptm, "-")))) {
+        fprintf (stderr, "--index needs an output file\n");
+        return 1;
+    }
+
+    /* Encode the runs.  While one run is being encoded the next one is loaded.
+       The nested parallel regions in the sections draw their threads from the
+       same OpenMP pool. */
+
+    omp_set_max_active_levels (2);
+
+    FILE *fp_stats = NULL;
+    if (arguments.filename_stats && (fp_stats = fopen (arguments.filename_stats, "a")) == NULL) {
+        fprintf (stderr, "can't open %s\n", arguments.filename_stats);
+        return 1;
+    }
+
+    /* The big buffers of a run come from an arena that is reset for the
+       run after the next.  Two arenas, because two runs are alive at a time. */
+
+    ptm_arena_t *arenas[2] = { ptm_arena_create (), ptm_arena_create () };
+    if (arenas[0] == NULL || arenas[1] == NULL) {
+        fprintf (stderr, "out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < n_runs; ++i) {
+        runs[i].arena = arenas[i % 2];
+    }
+
+    int failed = 0;
+    load_run (&arguments, &runs[0]);
+
+    for (int i = 0; i < n_runs; ++i) {
+        run_t *run = &runs[i];
+        double start = ptm_wall_time ();
+
+        #pragma omp parallel sections num_threads (2)
+        {
+            #pragma omp section
+            {
+                if (i + 1 < n_runs) {
+                    ptm_arena_reset (runs[i + 1].arena);
+                    load_run (&arguments, &runs[i + 1]);
+                }
+            }
+            #pragma omp section
+            {
+                if (run->status == 0)
+                    run->status = arguments.photometric_stereo ?
+                        encode_run_lambert (&arguments, run) : encode_run (&arguments, run);
+            }
+        }
+
+        if (run->status != 0)
+            ++failed;
+        if (n_runs > 1) {
+            fprintf (stderr, "[%d/%d] %s -> %s: %s (%.0fms)\n",
+                     i + 1, n_runs, run->filename_lp,
+                     arguments.filename_mosaic ? "tile" : run->filename_ptm,
+                     run->status ? "failed" : "done", (ptm_wall_time () - start) * 1000);
+            fflush (stderr);
+        }
+        if (fp_stats) {
+            // the process CPU time counts the loading of the next run too
+            run->stats.shared_cpu = n_runs > 1;
+            write_stats (fp_stats, &arguments, run);
+        }
+        free_run (run);
+    }
+
+    if (arguments.filename_mosaic) {
+        if (failed == 0 && write_mosaic (&arguments, runs, n_runs))
+            ++failed;
+        for (int i = 0; i < n_runs; ++i) {
+            if (runs[i].fp_tile)
+                fclose (runs[i].fp_tile);
+        }
+    }
+
+    if (fp_stats)
+        fclose (fp_stats);
+    ptm_arena_destroy (arenas[0]);
+    ptm_arena_destroy (arenas[1]);
+    free_calibration (&arguments.calibration);
+    free (runs);
+    return failed > 0;
 }
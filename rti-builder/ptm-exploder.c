@@ -1,13 +1,33 @@
 /*
  * Explodes one PTM into multiple JPEGs lighted from different angles.
  *
- * Usage: ptm-exploder filename.ptm filename.lp filename.out
+ * Usage: ptm-exploder [OPTION] filename.ptm filename.lp filename.out
+ *        ptm-exploder [OPTION] --y4m filename.ptm filename.lp > filename.y4m
  *
  * filename.lp should be of the same format used by the PTMFitter utility, ie. a
  * list of "filename u v w\n" strings.  The filename and the w part are not
  * used.  The filename is provided by the 3rd argument and is changed into into
  * filename-NNN.jpeg for each image.
  *
+ * The options are the same as for ptm-decoder: --diffuse-gain[=GAIN],
+ * --specular[=KD,KS,EXPONENT] and --normals.  The surface normals are computed
+ * only once for all images.
+ *
+ * Instead of filename.lp the lights can follow a path: --circle=N[,RADIUS]
+ * puts N lights on a circle around the zenith (default radius: 0.7),
+ * --spiral=N[,TURNS] puts N lights on a spiral that winds from the zenith
+ * towards the horizon (default: 3 turns).
+ *
+ * With --y4m the images go to stdout as the frames of a YUV4MPEG2 stream,
+ * ready to be piped into a video encoder, eg.:
+ *
+ *   ptm-exploder --y4m --circle=100 filename.ptm | ffmpeg -i - sweep.mp4
+ *
+ * --fps=FPS sets the frame rate of the stream (default: 25).  Each frame is
+ * rendered in parallel.
+ *
+ * Like ptm-decoder it uses the index of the PTM if there is one.
+ *
  * It reads PTMs in the following formats:
  *
  *   - PTM_FORMAT_RGB
@@ -15,30 +35,166 @@
  *   - PTM_FORMAT_LUM (not tested for want of test images)
  *   - PTM_FORMAT_JPEG_RGB
  *   - PTM_FORMAT_JPEG_LRGB
+ *   - PTM_FORMAT_ZLIB_RGB (lossless, not in the PTM specification)
+ *   - PTM_FORMAT_ZLIB_LRGB (lossless, not in the PTM specification)
  *
  * Author: Marcello Perathoner <marcello@perathoner.de>
  *
  * License: GPL3
  */
 
-#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700  // M_PI
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "ptmlib.h"
 
+/** The position of one light. */
+typedef struct {
+    float u;
+    float v;
+} light_t;
+
+/** The paths the lights can follow. */
+typedef enum {
+    PATH_LP,                   /**< Read from a .lp file. */
+    PATH_CIRCLE,
+    PATH_SPIRAL
+} path_enum_t;
+
+/**
+ * Read the light positions from a .lp file.
+ *
+ * @param filename_lp The .lp file.
+ * @param lights      [out] The lights.  Free them with free().
+ *
+ * @returns The no. of lights or -1 on error.
+ */
+int read_lights (const char *filename_lp, light_t **lights) {
+    FILE *fp_lp;
+    if ((fp_lp = fopen (filename_lp, "rb")) == NULL) {
+        fprintf (stderr, "can't open %s\n", filename_lp);
+        return -1;
+    }
+
+    int n = 0;
+    int max_lights = 0;
+    *lights = NULL;
+    char *line = NULL;
+    size_t len = 0;
+    while (n >= 0 && getline (&line, &len, fp_lp) != -1) {
+        char *buffer = malloc (len + 1);
+        float u, v;
+        if (buffer == NULL) {
+            n = -1;
+        } else if (sscanf (line, "%s %f %f", buffer, &u, &v) == 3) {
+            if (n == max_lights) {
+                max_lights = max_lights ? 2 * max_lights : 64;
+                light_t *grown = realloc (*lights, max_lights * sizeof (light_t));
+                if (grown == NULL)
+                    n = -1;
+                else
+                    *lights = grown;
+            }
+            if (n >= 0)
+                (*lights)[n++] = (light_t) { u, v };
+        }
+        free (buffer);
+    }
+    if (n < 0) {
+        fprintf (stderr, "%s: out of memory\n", filename_lp);
+        free (*lights);
+        *lights = NULL;
+    }
+    free (line);
+    fclose (fp_lp);
+    return n;
+}
+
+/**
+ * Put the lights on a path.
+ *
+ * The circle has the radius param around the zenith.  The spiral winds param
+ * times from the zenith towards the horizon.  The first light of the circle
+ * is at the right, so that the animation loops without a repeated frame.
+ *
+ * @returns The lights.  Free them with free().
+ */
+light_t *path_lights (path_enum_t path, int n, float param) {
+    light_t *lights = malloc (n * sizeof (light_t));
+    for (int i = 0; i < n; ++i) {
+        const float t = (float) i / n;
+        const float r = path == PATH_CIRCLE ? param : t;
+        const float phi = 2.0f * (float) M_PI * (path == PATH_CIRCLE ? t : param * t);
+        lights[i].u = r * cosf (phi);
+        lights[i].v = r * sinf (phi);
+    }
+    return lights;
+}
+
 int main (int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf (stderr, "Usage: %s filename.ptm filename.lp filename.out\n", argv[0]);
-        fprintf (stderr, "       Explodes a PTM into JPEGs\n");
+    ptm_render_params_t params;
+    ptm_render_defaults (&params);
+
+    path_enum_t path = PATH_LP;
+    int n_lights = 0;
+    float path_param = 0.0f;
+    int y4m = 0;
+    int fps = 25;
+
+    const char *args[3];
+    int n_args = 0;
+    int bad = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp (argv[i], "--y4m")) {
+            y4m = 1;
+        } else if (!strncmp (argv[i], "--fps=", 6)) {
+            fps = atoi (argv[i] + 6);
+            bad |= fps < 1;
+        } else if (!strncmp (argv[i], "--circle=", 9)) {
+            path = PATH_CIRCLE;
+            path_param = 0.7f;
+            bad |= sscanf (argv[i] + 9, "%d,%f", &n_lights, &path_param) < 1 ||
+                path_param <= 0.0f || path_param > 1.0f;
+        } else if (!strncmp (argv[i], "--spiral=", 9)) {
+            path = PATH_SPIRAL;
+            path_param = 3.0f;
+            bad |= sscanf (argv[i] + 9, "%d,%f", &n_lights, &path_param) < 1;
+        } else if (!strncmp (argv[i], "--", 2)) {
+            if (ptm_parse_render_option (argv[i], &params) != 1)
+                bad = 1;
+        } else if (n_args < 3) {
+            args[n_args++] = argv[i];
+        } else {
+            bad = 1;
+        }
+    }
+    if (path != PATH_LP && n_lights < 1)
+        bad = 1;
+    if (bad || n_args != 1 + (path == PATH_LP) + !y4m) {
+        fprintf (stderr, "Usage: %s [OPTION] filename.ptm filename.lp filename.out\n", argv[0]);
+        fprintf (stderr, "       %s [OPTION] --y4m [--fps=FPS] filename.ptm filename.lp > filename.y4m\n", argv[0]);
+        fprintf (stderr, "       Explodes a PTM into JPEGs or the frames of a video\n");
+        fprintf (stderr, "       Options: --diffuse-gain[=GAIN] | --specular[=KD,KS,EXPONENT] | --normals\n");
+        fprintf (stderr, "                --circle=N[,RADIUS] | --spiral=N[,TURNS] instead of filename.lp\n");
         return 1;
     }
 
-    const char *filename_ptm = argv[1];
-    const char *filename_lp  = argv[2];
-    const char *filename_out = argv[3];
+    const char *filename_ptm = args[0];
+    const char *filename_lp  = path == PATH_LP ? args[1] : NULL;
+    const char *filename_out = y4m ? NULL : args[n_args - 1];
+
+    /* Get the light positions. */
+    light_t *lights;
+    if (path == PATH_LP) {
+        if ((n_lights = read_lights (filename_lp, &lights)) < 0)
+            return 1;
+    } else {
+        lights = path_lights (path, n_lights, path_param);
+    }
 
     /* Open the PTM file and read the header. */
     FILE *fp;
@@ -48,60 +204,105 @@ int main (int argc, char *argv[]) {
     }
 
     /* Read the PTM header. */
-    ptm_header_t *ptm = ptm_read_header (fp);
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    ptm_header_t *ptm = ptm_read_header (&ctx, fp);
     if (ptm == NULL) {
+        fprintf (stderr, "%s: %s\n", filename_ptm, ctx.message);
+        fclose (fp);
         return 1; /* not a PTM */
     }
 
-    /* Read the PTM data. */
+    /* Read the PTM data, with the index if there is one. */
+    ptm_index_t *index = ptm_index_open (&ctx, filename_ptm);
+    if (index == NULL && ctx.error) {
+        fprintf (stderr, "%s\n", ctx.message);
+        ptm_ctx_init (&ctx);
+    }
+    if (index && !ptm_index_matches (index, fp, ptm)) {
+        fprintf (stderr, "%s: ignoring stale index\n", filename_ptm);
+        ptm_index_close (index);
+        index = NULL;
+    }
+    // we only relight, which is fastest from planar blocks
+    ptm->planar = 1;
     ptm_block_t *blocks = ptm_alloc_blocks (ptm);
-    ptm_read_ptm (fp, ptm, blocks);
-    fclose (fp);
-
-    /* Open the light points file */
-    FILE *fp_lp;
-    if ((fp_lp = fopen (filename_lp, "rb")) == NULL) {
-        fprintf (stderr, "can't open %s\n", filename_lp);
+    int err = blocks == NULL || (index ? ptm_read_ptm_indexed (&ctx, fp, ptm, blocks, index)
+                                       : ptm_read_ptm (&ctx, fp, ptm, blocks));
+    ptm_index_close (index);
+    if (err) {
+        fprintf (stderr, "%s: %s\n", filename_ptm, blocks ? ctx.message : "out of memory");
+        ptm_free_blocks (ptm, blocks);
+        free (ptm);
+        fclose (fp);
         return 1;
     }
+    fclose (fp);
 
-    float u = 0.0;
-    float v = 0.0;
-    int n = 0;
-    char *filename = malloc (strlen (filename_out) + 20);
-    strcpy (filename, filename_out);
-    char *ext = strrchr (filename, '.');
-    if (!ext)
-        ext = filename + strlen (filename_out);
+    /* Compute the normals once for all images. */
+    ptm_normal_t *normals = NULL;
+    if (params.mode != PTM_RENDER_DEFAULT)
+        normals = ptm_normal_map (ptm, blocks);
 
-    char *line = NULL;
-    size_t len = 0;
-    while (getline (&line, &len, fp_lp) != -1) {
-        char *buffer = malloc (len + 1);
-        if (sscanf (line, "%s %f %f", buffer, &u, &v) == 3) {
-            ++n;
-            sprintf (ext, "%03d.jpeg", n);
+    int status = 0;
+    if (y4m) {
+        /* Render the frames and write them to stdout. */
+        const size_t width  = ptm->dimen[0];
+        const size_t height = ptm->dimen[1];
+        const J_COLOR_SPACE color_space = ptm_render_color_space (ptm, &params);
+        JSAMPLE *frame = malloc (width * height * 3);
+        if (frame == NULL) {
+            fprintf (stderr, "out of memory\n");
+            status = 1;
+        } else {
+            ptm_write_y4m_header (stdout, width, height, fps);
+        }
+        for (int i = 0; i < n_lights && status == 0; ++i) {
+            fprintf (stderr, "rendering frame %d %f %f ...\n", i + 1, (double) lights[i].u, (double) lights[i].v);
+            fflush (stderr);
+            if (ptm_render (&ctx, ptm, blocks, normals, &params, lights[i].u, lights[i].v, frame) ||
+                ptm_write_y4m_frame (&ctx, stdout, width, height, frame, color_space)) {
+                fprintf (stderr, "%s\n", ctx.message);
+                status = 1;
+            }
+        }
+        free (frame);
+    } else {
+        char *filename = malloc (strlen (filename_out) + 20);
+        strcpy (filename, filename_out);
+        char *ext = strrchr (filename, '.');
+        if (!ext)
+            ext = filename + strlen (filename_out);
+
+        for (int i = 0; i < n_lights && status == 0; ++i) {
+            sprintf (ext, "%03d.jpeg", i + 1);
 
-            fprintf (stderr, "writing %s %f %f ...\n", filename, (double) u, (double) v);
+            fprintf (stderr, "writing %s %f %f ...\n", filename, (double) lights[i].u, (double) lights[i].v);
             fflush (stderr);
 
             FILE *fp_out;
             if ((fp_out = fopen (filename, "wb")) == NULL) {
                 fprintf (stderr, "can't open %s\n", filename);
-                return 1;
+                status = 1;
+                break;
             }
 
             /* Create output jpeg. */
-            ptm_write_jpeg (fp_out, ptm, blocks, u, v);
+            if (ptm_write_jpeg_enhanced (&ctx, fp_out, ptm, blocks, normals, &params,
+                                         lights[i].u, lights[i].v)) {
+                fprintf (stderr, "%s: %s\n", filename, ctx.message);
+                status = 1;
+            }
 
             fclose (fp_out);
         }
-        free (buffer);
+        free (filename);
     }
-    fclose (fp_lp);
-    free (filename);
 
     /* Cleanup */
+    free (lights);
+    free (normals);
     ptm_free_blocks (ptm, blocks);
     free (ptm);
+    return status;
 }
@@ -8,11 +8,14 @@
  *   - PTM_FORMAT_LUM (not tested for want of test images)
  *   - PTM_FORMAT_JPEG_RGB
  *   - PTM_FORMAT_JPEG_LRGB
+ *   - PTM_FORMAT_ZLIB_RGB (lossless, not in the PTM specification)
+ *   - PTM_FORMAT_ZLIB_LRGB (lossless, not in the PTM specification)
  *
  * Prediction using motion compensation is not supported.
  *
- * TODO: Add specular enhancement and diffuse enhancement.
- *       Add JPEG2000 if we find PTMs using it in the wild.
+ * It relights PTMs with diffuse gain and specular enhancement.
+ *
+ * TODO: Add JPEG2000 if we find PTMs using it in the wild.
  *
  * Author: Marcello Perathoner <marcello@perathoner.de>
  *
@@ -24,46 +27,51 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS, madvise ()
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
 #include <float.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #include "ptmlib.h"
 
 #include <cblas.h>
 #include <lapacke.h>
+#include <png.h>
+#include <jerror.h>
+#include <tiffio.h>
+#include <zlib.h>
 
 /** Parameters of the supported formats.
-    id, blocks, ptm_blocks, color_components, jpeg_streams, name
+    id, blocks, ptm_blocks, color_components, jpeg_streams, zlib_streams, name
 */
 const ptm_format_t ptm_formats[] = {
-    { PTM_FORMAT_RGB,       3, 3, 0,  0, "PTM_FORMAT_RGB"       },
-    { PTM_FORMAT_JPEG_RGB,  3, 3, 0, 18, "PTM_FORMAT_JPEG_RGB"  },
-    { PTM_FORMAT_LRGB,      2, 1, 3,  0, "PTM_FORMAT_LRGB"      },
-    { PTM_FORMAT_JPEG_LRGB, 2, 1, 3,  9, "PTM_FORMAT_JPEG_LRGB" },
-    { PTM_FORMAT_LUM,       2, 1, 2,  0, "PTM_FORMAT_LUM"       },
-    { 0,                    0, 0, 0,  0, NULL },
+    { PTM_FORMAT_RGB,       3, 3, 0,  0,  0, "PTM_FORMAT_RGB"       },
+    { PTM_FORMAT_JPEG_RGB,  3, 3, 0, 18,  0, "PTM_FORMAT_JPEG_RGB"  },
+    { PTM_FORMAT_LRGB,      2, 1, 3,  0,  0, "PTM_FORMAT_LRGB"      },
+    { PTM_FORMAT_JPEG_LRGB, 2, 1, 3,  9,  0, "PTM_FORMAT_JPEG_LRGB" },
+    { PTM_FORMAT_LUM,       2, 1, 2,  0,  0, "PTM_FORMAT_LUM"       },
+    { PTM_FORMAT_ZLIB_RGB,  3, 3, 0,  0, 18, "PTM_FORMAT_ZLIB_RGB"  },
+    { PTM_FORMAT_ZLIB_LRGB, 2, 1, 3,  0,  9, "PTM_FORMAT_ZLIB_LRGB" },
+    { 0,                    0, 0, 0,  0,  0, NULL },
 };
 
-/** Decode the PTM coefficients from bytes to floats. */
-#define UNSCALE(coeff,n) (ptm_header->scale[n] * (coeff - ptm_header->bias[n]))
-
-/** Evaluate the polynomial. */
-// FIXME use blas sdot ?
-#define POLY(p) (UNSCALE (p->cu2, 0) * light.cu2 + \
-                 UNSCALE (p->cv2, 1) * light.cv2 + \
-                 UNSCALE (p->cuv, 2) * light.cuv + \
-                 UNSCALE (p->cu,  3) * light.cu  + \
-                 UNSCALE (p->cv,  4) * light.cv  + \
-                 UNSCALE (p->c1,  5))
-
 // This is gray only but at least it works.
-float COLOR_MATRIX[] = {
+static const float COLOR_MATRIX[] = {
     0,  1,  0,  0,
     0,  1,  0,  0,
     0,  1,  0,  0,
@@ -72,7 +80,7 @@ float COLOR_MATRIX[] = {
 
 // FIXME: does not work.  If we could find just *one* example of a LUM PTM we
 // could fix this.
-float COLOR_MATRIX_[] = {
+static const float COLOR_MATRIX_[] __attribute__ ((unused)) = {
 //   Cr       Y   Cb
      1.40200f, 1,  0,          0,   // R
     -0.71414f, 1, -0.34414f,   0,   // G
@@ -103,6 +111,82 @@ void max_coeffs (ptm_unscaled_coefficients_t *a, const ptm_unscaled_coefficients
     }
 }
 
+void ptm_ctx_init (ptm_ctx_t *ctx) {
+    ctx->error = PTM_OK;
+    ctx->message[0] = '\0';
+}
+
+const char *ptm_strerror (ptm_error_t error) {
+    switch (error) {
+    case PTM_OK:           return "no error";
+    case PTM_ERROR_IO:     return "read or write error";
+    case PTM_ERROR_FORMAT: return "bad or unsupported PTM file";
+    case PTM_ERROR_JPEG:   return "error in JPEG stream";
+    case PTM_ERROR_MEMORY: return "out of memory";
+    case PTM_STOPPED:      return "stopped by callback";
+    }
+    return "unknown error";
+}
+
+/**
+ * Record an error in the context.
+ *
+ * Only the first error is kept.  Without a context the message goes to
+ * stderr.  May be called from many threads.
+ *
+ * @returns The error code.
+ */
+int ptm_set_error (ptm_ctx_t *ctx, ptm_error_t error, const char *format, ...) {
+    va_list ap;
+    va_start (ap, format);
+    if (ctx == NULL) {
+        vfprintf (stderr, format, ap);
+        fputc ('\n', stderr);
+    } else {
+        #pragma omp critical (ptm_set_error)
+        if (ctx->error == PTM_OK) {
+            ctx->error = error;
+            vsnprintf (ctx->message, sizeof (ctx->message), format, ap);
+        }
+    }
+    va_end (ap);
+    return error;
+}
+
+/** A libjpeg error manager that jumps back to the caller instead of calling
+    exit(). */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;    /**< Where to go on error. */
+} ptm_jpeg_error_t;
+
+void ptm_jpeg_error_exit (j_common_ptr cinfo) {
+    longjmp (((ptm_jpeg_error_t *) cinfo->err)->jmp, 1);
+}
+
+/**
+ * Set up a libjpeg error manager.
+ *
+ * Call setjmp() on err->jmp before calling into libjpeg.  After the jump the
+ * libjpeg object can only be destroyed.
+ */
+struct jpeg_error_mgr *ptm_jpeg_error_init (ptm_jpeg_error_t *err) {
+    jpeg_std_error (&err->pub);
+    err->pub.error_exit = ptm_jpeg_error_exit;
+    return &err->pub;
+}
+
+/**
+ * Record the error libjpeg found in the context.
+ *
+ * @returns PTM_ERROR_JPEG.
+ */
+int ptm_jpeg_error (ptm_ctx_t *ctx, j_common_ptr cinfo, const char *what) {
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message) (cinfo, message);
+    return ptm_set_error (ctx, PTM_ERROR_JPEG, "%s: %s", what, message);
+}
+
 size_t getline_trim (char **lineptr, size_t* n, FILE* fp) {
     int read = getline (lineptr, n, fp);
     if (read == -1)
@@ -117,22 +201,43 @@ size_t getline_trim (char **lineptr, size_t* n, FILE* fp) {
     return line - end;
 }
 
-void read_ints (FILE *fp, int n, int *buf) {
+int read_ints (FILE *fp, int n, int *buf) {
     for (int i = 0; i < n; ++i) {
-        fscanf (fp, "%d ", buf + i);
+        if (fscanf (fp, "%d", buf + i) != 1)
+            return -1;
     }
+    return 0;
 }
 
-void read_sizes (FILE *fp, int n, size_t *buf) {
+int read_sizes (FILE *fp, int n, size_t *buf) {
     for (int i = 0; i < n; ++i) {
-        fscanf (fp, "%lu ", buf + i);
+        if (fscanf (fp, "%lu", buf + i) != 1)
+            return -1;
     }
+    return 0;
 }
 
-void read_floats (FILE *fp, int n, float *buf) {
+int read_floats (FILE *fp, int n, float *buf) {
     for (int i = 0; i < n; ++i) {
-        fscanf (fp, "%f ", buf + i);
+        if (fscanf (fp, "%f", buf + i) != 1)
+            return -1;
     }
+    return 0;
+}
+
+/**
+ * Skip the rest of the last header line.
+ *
+ * Reads up to and including the newline, but not further: the binary data
+ * that follows may start with bytes that look like whitespace.
+ *
+ * @returns 0 on success, -1 if the line holds anything but blanks.
+ */
+int read_eol (FILE *fp) {
+    int c;
+    while ((c = getc (fp)) == ' ' || c == '\t' || c == '\r')
+        ;
+    return c == '\n' ? 0 : -1;
 }
 
 void write_ints (FILE *fp, int n, const int *buf) {
@@ -173,13 +278,16 @@ const ptm_format_t *ptm_get_format (const char *format_name) {
     return NULL;
 }
 
-ptm_header_t *ptm_read_header (FILE *fp) {
+/** The largest width or height of a PTM we accept. */
+#define PTM_MAX_DIMENSION (1 << 20)
+
+ptm_header_t *ptm_read_header (ptm_ctx_t *ctx, FILE *fp) {
     char *line = NULL;
     size_t len = 0;
 
-    getline_trim (&line, &len, fp);
-    if (!line || strcmp (line, "PTM_1.2")) {
-        fprintf (stderr, "not a PTM file\n");
+    if (getline_trim (&line, &len, fp) == (size_t) -1 || strcmp (line, "PTM_1.2")) {
+        ptm_set_error (ctx, PTM_ERROR_FORMAT, "not a PTM file");
+        free (line);
         return NULL;
     }
 
@@ -189,29 +297,52 @@ ptm_header_t *ptm_read_header (FILE *fp) {
     ptm->format = ptm_get_format (line);
 
     if (ptm->format == NULL) {
-        fprintf (stderr, "unsupported PTM format: %s\n", line);
+        ptm_set_error (ctx, PTM_ERROR_FORMAT, "unsupported PTM format: %s", line);
+        free (line);
+        free (ptm);
         return NULL;
     }
+    free (line);
+
+    int err = read_sizes (fp, 2, ptm->dimen) ||
+        read_floats (fp, PTM_COEFFICIENTS, ptm->scale) ||
+        read_ints   (fp, PTM_COEFFICIENTS, ptm->bias);
 
-    read_sizes  (fp, 2, ptm->dimen);
-    read_floats (fp, PTM_COEFFICIENTS, ptm->scale);
-    read_ints   (fp, PTM_COEFFICIENTS, ptm->bias);
+    if (ptm->format->id == PTM_FORMAT_LUM) {
+        float color_matrix[16];
+        err = err || read_floats (fp, 16, color_matrix);
+    }
 
     if (ptm->format->jpeg_streams) {
         int n = ptm->format->jpeg_streams;
-        read_ints  (fp, 1, ptm->compression_param);
-        read_ints  (fp, n, ptm->transforms);
-        read_ints  (fp, n, ptm->motion_vector_x);
-        read_ints  (fp, n, ptm->motion_vector_y);
-        read_ints  (fp, n, ptm->order);
-        read_ints  (fp, n, ptm->reference_planes);
-        read_sizes (fp, n, ptm->compressed_size);
-        read_sizes (fp, n, ptm->side_info_sizes);
+        err = err ||
+            read_ints  (fp, 1, ptm->compression_param) ||
+            read_ints  (fp, n, ptm->transforms) ||
+            read_ints  (fp, n, ptm->motion_vector_x) ||
+            read_ints  (fp, n, ptm->motion_vector_y) ||
+            read_ints  (fp, n, ptm->order) ||
+            read_ints  (fp, n, ptm->reference_planes) ||
+            read_sizes (fp, n, ptm->compressed_size) ||
+            read_sizes (fp, n, ptm->side_info_sizes);
     } else {
         ptm->compression_param[0] = 90;
     }
+    if (ptm->format->zlib_streams) {
+        err = err || read_sizes (fp, ptm->format->zlib_streams, ptm->compressed_size);
+    }
+    err = err || read_eol (fp);
 
-    free (line);
+    if (err) {
+        ptm_set_error (ctx, PTM_ERROR_FORMAT, "bad PTM header");
+        free (ptm);
+        return NULL;
+    }
+    if (ptm->dimen[0] == 0 || ptm->dimen[0] > PTM_MAX_DIMENSION ||
+        ptm->dimen[1] == 0 || ptm->dimen[1] > PTM_MAX_DIMENSION) {
+        ptm_set_error (ctx, PTM_ERROR_FORMAT, "bad PTM size: %lux%lu", ptm->dimen[0], ptm->dimen[1]);
+        free (ptm);
+        return NULL;
+    }
     return ptm;
 }
 
@@ -236,6 +367,9 @@ void ptm_write_header (FILE *fp, const ptm_header_t *ptm_header) {
         write_sizes (fp, n, ptm_header->compressed_size);
         write_sizes (fp, n, ptm_header->side_info_sizes);
     }
+    if (ptm_header->format->zlib_streams) {
+        write_sizes (fp, ptm_header->format->zlib_streams, ptm_header->compressed_size);
+    }
 }
 
 int order_to_component (int ord, const int *order, size_t size) {
@@ -289,20 +423,111 @@ int get_sample_size (const ptm_header_t *ptm_header, int n_block) {
     return (n_block < ptm_header->format->ptm_blocks) ? PTM_COEFFICIENTS : RGB_COEFFICIENTS;
 }
 
+/** The distance between two pixels of a block. */
+size_t get_pixel_stride (const ptm_header_t *ptm_header, int n_block) {
+    return ptm_header->planar ? 1 : get_sample_size (ptm_header, n_block);
+}
+
+/** The distance between two planes of a block. */
+size_t get_plane_stride (const ptm_header_t *ptm_header) {
+    return ptm_header->planar ? ptm_header->dimen[0] * ptm_header->dimen[1] : 1;
+}
+
+/**
+ * Copy interleaved pixels into the planes of a planar block.
+ *
+ * @param src          The first pixel.
+ * @param src_stride   The distance between two pixels in src.
+ * @param n_pixels     The no. of pixels.
+ * @param n_planes     The no. of bytes to copy from each pixel.
+ * @param dest         Where to put the first byte of the first plane.
+ * @param plane_stride The distance between two planes in dest.
+ */
+void deinterleave (const JSAMPLE *src, size_t src_stride, size_t n_pixels, int n_planes,
+                   JSAMPLE *dest, size_t plane_stride) {
+    for (int c = 0; c < n_planes; ++c) {
+        JSAMPLE *plane = dest + c * plane_stride;
+        for (size_t i = 0; i < n_pixels; ++i) {
+            plane[i] = src[i * src_stride + c];
+        }
+    }
+}
+
+/** The reverse of deinterleave(). */
+void interleave (const JSAMPLE *src, size_t plane_stride, size_t n_pixels, int n_planes,
+                 JSAMPLE *dest, size_t dest_stride) {
+    for (int c = 0; c < n_planes; ++c) {
+        const JSAMPLE *plane = src + c * plane_stride;
+        for (size_t i = 0; i < n_pixels; ++i) {
+            dest[i * dest_stride + c] = plane[i];
+        }
+    }
+}
+
+/**
+ * Copy one row of an uncompressed PTM into planar blocks.
+ *
+ * In PTM_FORMAT_LUM the coefficients are followed by Cr and Cb, which go into
+ * the Cr and Cb planes of the color block.
+ *
+ * @param row The row as stored in the file.
+ * @param b   The block.  Ignored for PTM_FORMAT_LUM.
+ * @param y   The row no.
+ */
+void deinterleave_row (const ptm_header_t *ptm_header, const JSAMPLE *row, ptm_block_t *blocks,
+                       int b, size_t y) {
+    const size_t width = ptm_header->dimen[0];
+    const size_t plane_stride = get_plane_stride (ptm_header);
+    if (ptm_header->format->id == PTM_FORMAT_LUM) {
+        const size_t pixel_size = PTM_COEFFICIENTS + CBCR_COEFFICIENTS;
+        deinterleave (row, pixel_size, width, PTM_COEFFICIENTS, blocks[0] + y * width, plane_stride);
+        JSAMPLE *color = blocks[1] + y * width;
+        for (size_t x = 0; x < width; ++x) {
+            color[2 * plane_stride + x] = row[x * pixel_size + PTM_COEFFICIENTS];
+            color[plane_stride + x]     = row[x * pixel_size + PTM_COEFFICIENTS + 1];
+        }
+        return;
+    }
+    const int sample_size = get_sample_size (ptm_header, b);
+    deinterleave (row, sample_size, width, sample_size, blocks[b] + y * width, plane_stride);
+}
+
 ptm_header_t *ptm_alloc_header () {
     return (ptm_header_t *) calloc (sizeof (ptm_header_t), 1);
 }
 
 ptm_block_t *ptm_alloc_blocks (const ptm_header_t *ptm_header) {
     ptm_block_t *blocks = calloc (ptm_header->format->blocks, sizeof (void *));
+    if (blocks == NULL)
+        return NULL;
     size_t image_size = ptm_header->dimen[0] * ptm_header->dimen[1];
     for (int i = 0; i < ptm_header->format->blocks; ++i) {
         blocks[i] = malloc (get_sample_size (ptm_header, i) * image_size);
+        if (blocks[i] == NULL) {
+            ptm_free_blocks (ptm_header, blocks);
+            return NULL;
+        }
+    }
+    return blocks;
+}
+
+ptm_block_t *ptm_arena_alloc_blocks (ptm_arena_t *arena, const ptm_header_t *ptm_header) {
+    ptm_block_t *blocks = ptm_arena_alloc (arena, ptm_header->format->blocks * sizeof (void *));
+    if (blocks == NULL)
+        return NULL;
+    for (int i = 0; i < ptm_header->format->blocks; ++i) {
+        const size_t row_size = get_sample_size (ptm_header, i) * ptm_header->dimen[0];
+        blocks[i] = ptm_arena_alloc (arena, row_size * ptm_header->dimen[1]);
+        if (blocks[i] == NULL)
+            return NULL;
+        ptm_first_touch (blocks[i], 1, ptm_header->dimen[1], row_size);
     }
     return blocks;
 }
 
 void ptm_free_blocks (const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    if (blocks == NULL)
+        return;
     for (int i = 0; i < ptm_header->format->blocks; ++i) {
         free (blocks[i]);
     }
@@ -312,15 +537,52 @@ void ptm_free_blocks (const ptm_header_t *ptm_header, ptm_block_t *blocks) {
 /**
  * Read the blocks from an uncompressed PTM file.
  *
+ * @param ctx        The context or NULL.
  * @param fp         File pointer.
  * @param ptm_header A pointer to an initialized ptm_header_t struct.
  * @param blocks     A pointer to an allocated ptm_block_t struct.
+ *
+ * @returns 0 on success or an error code.
  */
-void ptm_read_uncompressed_blocks (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+int ptm_read_uncompressed_blocks (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
     size_t image_size = ptm_header->dimen[0] * ptm_header->dimen[1];
+    if (ptm_header->planar) {
+        // read one row at a time and split it into the planes
+        const int lum = ptm_header->format->id == PTM_FORMAT_LUM;
+        const size_t row_size = ptm_header->dimen[0] *
+            (lum ? PTM_COEFFICIENTS + CBCR_COEFFICIENTS : PTM_COEFFICIENTS);
+        JSAMPLE *row = malloc (row_size);
+        if (row == NULL)
+            return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        int err = 0;
+        for (int b = 0; b < (lum ? 1 : ptm_header->format->blocks) && !err; ++b) {
+            const size_t size = lum ? row_size : ptm_header->dimen[0] * get_sample_size (ptm_header, b);
+            for (size_t y = 0; y < ptm_header->dimen[1] && !err; ++y) {
+                if (fread (row, 1, size, fp) != size)
+                    err = ptm_set_error (ctx, PTM_ERROR_IO, "unexpected end of PTM file");
+                else
+                    deinterleave_row (ptm_header, row, blocks, b, y);
+            }
+        }
+        free (row);
+        return err;
+    }
+    if (ptm_header->format->id == PTM_FORMAT_LUM) {
+        // the coefficients and CrCb are interleaved
+        ptm_coefficients_t  *coeffs = (ptm_coefficients_t *)  blocks[0];
+        crcb_coefficients_t *crcb   = (crcb_coefficients_t *) blocks[1];
+        for (size_t i = 0; i < image_size; ++i) {
+            if (fread (coeffs++, sizeof (ptm_coefficients_t), 1, fp) != 1 ||
+                fread (crcb++, sizeof (crcb_coefficients_t), 1, fp) != 1)
+                return ptm_set_error (ctx, PTM_ERROR_IO, "unexpected end of PTM file");
+        }
+        return 0;
+    }
     for (int i = 0; i < ptm_header->format->blocks; ++i) {
-        fread (blocks[i], get_sample_size (ptm_header, i), image_size, fp);
+        if (fread (blocks[i], get_sample_size (ptm_header, i), image_size, fp) != image_size)
+            return ptm_set_error (ctx, PTM_ERROR_IO, "unexpected end of PTM file");
     }
+    return 0;
 }
 
 /**
@@ -356,39 +618,188 @@ void ptm_write_uncompressed_blocks (FILE *fp, const ptm_header_t *ptm_header, pt
 }
 
 /**
- * Read the blocks from a compressed PTM file.
+ * A libjpeg source manager that reads one JPEG stream out of a PTM file.
+ *
+ * Reads the stream in small chunks, so that decoding can start before the
+ * whole stream has arrived, and never reads past the end of the stream.
+ */
+typedef struct {
+    struct jpeg_source_mgr pub;
+    FILE *fp;
+    size_t remaining;           /**< The bytes of the stream not yet read. */
+    int truncated;              /**< Non-zero if the file ended too soon. */
+    JOCTET buffer[4096];
+} ptm_stream_source_t;
+
+static const JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+
+void stream_init_source (j_decompress_ptr dinfo) {
+    (void) dinfo;
+}
+
+boolean stream_fill_input_buffer (j_decompress_ptr dinfo) {
+    ptm_stream_source_t *src = (ptm_stream_source_t *) dinfo->src;
+    size_t want = src->remaining < sizeof (src->buffer) ? src->remaining : sizeof (src->buffer);
+    size_t n = fread (src->buffer, 1, want, src->fp);
+    src->remaining -= n;
+    if (n == 0) {
+        // premature end of stream: insert a fake EOI like libjpeg does
+        if (want > 0)
+            src->truncated = 1;
+        WARNMS (dinfo, JWRN_JPEG_EOF);
+        src->pub.next_input_byte = fake_eoi;
+        src->pub.bytes_in_buffer = 2;
+        return TRUE;
+    }
+    src->pub.next_input_byte = src->buffer;
+    src->pub.bytes_in_buffer = n;
+    return TRUE;
+}
+
+void stream_skip_input_data (j_decompress_ptr dinfo, long n) {
+    struct jpeg_source_mgr *src = dinfo->src;
+    while (n > (long) src->bytes_in_buffer) {
+        n -= (long) src->bytes_in_buffer;
+        (void) (*src->fill_input_buffer) (dinfo);
+    }
+    src->next_input_byte += n;
+    src->bytes_in_buffer -= n;
+}
+
+void stream_term_source (j_decompress_ptr dinfo) {
+    (void) dinfo;
+}
+
+/** Skip whatever is left of the stream after the EOI marker. */
+void stream_skip_rest (ptm_stream_source_t *src) {
+    src->pub.bytes_in_buffer = 0;
+    while (src->remaining > 0) {
+        size_t n = src->remaining < sizeof (src->buffer) ? src->remaining : sizeof (src->buffer);
+        if (fread (src->buffer, 1, n, src->fp) != n)
+            break;
+        src->remaining -= n;
+    }
+}
+
+/**
+ * Copy one decoded JPEG stream into the PTM blocks.
  *
- * This function does automatic JPEG decoding.
+ * The compressed PTM has a completely different layout than the uncompressed
+ * PTM.  Uncompressed PTMs store all coefficients in one block, but compressed
+ * PTMs store each coefficient in a separate grayscale JFIF stream.  Planar
+ * blocks have the same layout, so the stream is just copied.
+ */
+void copy_stream_to_block (const ptm_header_t *ptm_header, JSAMPARRAY component,
+                           ptm_block_t block, int b, int coeff) {
+    const size_t width = ptm_header->dimen[0];
+    const size_t pixel_stride = get_pixel_stride (ptm_header, b);
+    JSAMPLE *plane = block + coeff * get_plane_stride (ptm_header);
+    for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
+        JSAMPLE *row = plane + y * width * pixel_stride;
+        if (pixel_stride == 1) {
+            memcpy (row, component[y], width);
+            continue;
+        }
+        for (size_t x = 0; x < width; ++x) {
+            row[x * pixel_stride] = component[y][x];
+        }
+    }
+}
+
+/**
+ * Show the partially decoded PTM to the callback.
  *
- * @param fp         File pointer.
- * @param ptm_header A pointer to an initialized ptm_header_t struct.
- * @param blocks     A pointer to an allocated ptm_block_t struct.
+ * Copies the stream into its block.  While the green and blue streams of an
+ * RGB PTM have not arrived, the red stream stands in for them.
  */
-void ptm_read_compressed_blocks (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+int report_progress (const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                     JSAMPARRAY component, const ptm_progress_t *progress,
+                     ptm_progress_callback_t callback, void *user_data) {
+    int b = progress->stream / PTM_COEFFICIENTS;
+    int coeff = progress->stream % PTM_COEFFICIENTS;
+    copy_stream_to_block (ptm_header, component, blocks[b], b, coeff);
+    if (b == 0) {
+        for (int i = 1; i < ptm_header->format->ptm_blocks; ++i) {
+            copy_stream_to_block (ptm_header, component, blocks[i], i, coeff);
+        }
+    }
+    return callback (ptm_header, blocks, progress, user_data);
+}
+
+int ptm_read_compressed_blocks (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    return ptm_read_compressed_blocks_progressive (ctx, fp, ptm_header, blocks, NULL, NULL);
+}
+
+int ptm_read_compressed_blocks_progressive (ptm_ctx_t *ctx, FILE *fp,
+                                            const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                                            ptm_progress_callback_t callback, void *user_data) {
     JSAMPARRAY components[MAX_JPEG_STREAMS];
     void *side_infos[MAX_JPEG_STREAMS];
+    volatile int stopped = 0;  // the callback's return value
+    volatile int err = 0;
+    volatile int stream = 0;
 
-    struct jpeg_error_mgr jerr;
+    ptm_jpeg_error_t jerr;
     struct jpeg_decompress_struct dinfo;
-    dinfo.err = jpeg_std_error (&jerr);
+    dinfo.err = ptm_jpeg_error_init (&jerr);
+    if (setjmp (jerr.jmp)) {
+        char what[32];
+        snprintf (what, sizeof (what), "JPEG stream %d", stream);
+        err = ptm_jpeg_error (ctx, (j_common_ptr) &dinfo, what);
+        jpeg_destroy_decompress (&dinfo);
+        return err;
+    }
 
     jpeg_create_decompress (&dinfo);
 
-    for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
-        JOCTET *compressed_buffer = malloc (ptm_header->compressed_size[i]);
-        fread (compressed_buffer, 1, ptm_header->compressed_size[i], fp);
+    ptm_stream_source_t *src = (ptm_stream_source_t *) (*dinfo.mem->alloc_small)
+        ((j_common_ptr) &dinfo, JPOOL_PERMANENT, sizeof (ptm_stream_source_t));
+    src->pub.init_source       = stream_init_source;
+    src->pub.fill_input_buffer = stream_fill_input_buffer;
+    src->pub.skip_input_data   = stream_skip_input_data;
+    src->pub.resync_to_restart = jpeg_resync_to_restart;
+    src->pub.term_source       = stream_term_source;
+    src->fp = fp;
+    src->truncated = 0;
+    dinfo.src = &src->pub;
+
+    ptm_progress_t progress = { 0, 0, 0, 0 };
+
+    /* Before the streams arrive the coefficients are 0. */
+    if (callback) {
+        const size_t pixel_stride = get_pixel_stride (ptm_header, 0);
+        for (int b = 0; b < ptm_header->format->ptm_blocks; ++b) {
+            for (int c = 0; c < PTM_COEFFICIENTS; ++c) {
+                JSAMPLE *plane = blocks[b] + c * get_plane_stride (ptm_header);
+                const JSAMPLE bias = CLIP (ptm_header->bias[c]);
+                for (size_t i = 0; i < ptm_header->dimen[0] * ptm_header->dimen[1]; ++i) {
+                    plane[i * pixel_stride] = bias;
+                }
+            }
+        }
+    }
 
-        jpeg_mem_src (&dinfo, compressed_buffer, ptm_header->compressed_size[i]);
+    for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
+        stream = i;
+        src->remaining = ptm_header->compressed_size[i];
+        src->pub.bytes_in_buffer = 0;
+        src->pub.next_input_byte = NULL;
 
         (void) jpeg_read_header (&dinfo, TRUE);
-        assert (dinfo.image_width  == ptm_header->dimen[0]);
-        assert (dinfo.image_height == ptm_header->dimen[1]);
-        assert (dinfo.num_components == 1);
+        if (dinfo.image_width  != ptm_header->dimen[0] ||
+            dinfo.image_height != ptm_header->dimen[1] ||
+            dinfo.num_components != 1) {
+            err = ptm_set_error (ctx, PTM_ERROR_FORMAT, "JPEG stream %d: wrong size", i);
+            break;
+        }
 
         /* fprintf (stderr, "at %08x found jpeg stream: %d %d %d\n",
                  ftell (fp), dinfo.image_width, dinfo.image_height, dinfo.num_components);
            fflush (stderr); */
 
+        // show each scan of a progressive stream as soon as it arrives
+        dinfo.buffered_image = callback != NULL && jpeg_has_multiple_scans (&dinfo);
+
         jpeg_calc_output_dimensions (&dinfo);
 
         /* Make buffer for uncompressed jpeg stream. */
@@ -396,31 +807,69 @@ void ptm_read_compressed_blocks (FILE *fp, const ptm_header_t *ptm_header, ptm_b
         components[i] = (*dinfo.mem->alloc_sarray)
             ((j_common_ptr) &dinfo, JPOOL_PERMANENT, row_stride, dinfo.output_height);
 
-        /* Eventually make buffer for side information. */
+        /* Uncompress into buffer */
+        (void) jpeg_start_decompress (&dinfo);
+        progress.stream = i;
+        progress.scan   = 0;
+        if (dinfo.buffered_image) {
+            while (!jpeg_input_complete (&dinfo)) {
+                (void) jpeg_start_output (&dinfo, dinfo.input_scan_number);
+                while (dinfo.output_scanline < dinfo.output_height) {
+                    jpeg_read_scanlines (&dinfo, components[i] + dinfo.output_scanline, dinfo.output_height);
+                }
+                (void) jpeg_finish_output (&dinfo);
+                ++progress.scan;
+                if (!jpeg_input_complete (&dinfo) &&
+                    (stopped = report_progress (ptm_header, blocks, components[i], &progress, callback, user_data)))
+                    break;
+            }
+            if (stopped)
+                break;
+        } else {
+            while (dinfo.output_scanline < dinfo.output_height) {
+                jpeg_read_scanlines (&dinfo, components[i] + dinfo.output_scanline, dinfo.output_height);
+            }
+            ++progress.scan;
+        }
+        (void) jpeg_finish_decompress (&dinfo);
+
+        stream_skip_rest (src);
+        if (src->truncated || src->remaining) {
+            err = ptm_set_error (ctx, PTM_ERROR_IO, "JPEG stream %d: unexpected end of PTM file", i);
+            break;
+        }
+
+        /* Eventually read the side information. */
         side_infos[i] = NULL;
         if (ptm_header->side_info_sizes[i] > 0) {
             side_infos[i] = (*dinfo.mem->alloc_large)
                 ((j_common_ptr) &dinfo, JPOOL_PERMANENT, ptm_header->side_info_sizes[i]);
-            fread (side_infos[i], 1, ptm_header->side_info_sizes[i], fp);
+            if (fread (side_infos[i], 1, ptm_header->side_info_sizes[i], fp) != ptm_header->side_info_sizes[i]) {
+                err = ptm_set_error (ctx, PTM_ERROR_IO, "side information %d: unexpected end of PTM file", i);
+                break;
+            }
         }
 
-        /* Uncompress into buffer */
-        (void) jpeg_start_decompress (&dinfo);
-        while (dinfo.output_scanline < dinfo.output_height) {
-            jpeg_read_scanlines (&dinfo, components[i] + dinfo.output_scanline, dinfo.output_height);
-        }
-        (void) jpeg_finish_decompress (&dinfo);
+        progress.streams_done = i + 1;
+        if (callback && i + 1 < ptm_header->format->jpeg_streams &&
+            (stopped = report_progress (ptm_header, blocks, components[i], &progress, callback, user_data)))
+            break;
+    }
 
-        free (compressed_buffer); /* jpeg_finish still reads from the buffer ! */
+    if (stopped || err) {
+        jpeg_destroy_decompress (&dinfo);
+        return stopped ? PTM_STOPPED : err;
     }
 
     /* Apply corrections to components */
 
     for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
         int component_index = order_to_component (i, ptm_header->order, ptm_header->format->jpeg_streams);
-        assert (0 <= component_index && component_index < ptm_header->format->jpeg_streams);
-        int reference_index = ptm_header->reference_planes[component_index];
-        assert (-1 <= reference_index && reference_index < ptm_header->format->jpeg_streams);
+        int reference_index = component_index < 0 ? -2 : ptm_header->reference_planes[component_index];
+        if (reference_index < -1 || reference_index >= ptm_header->format->jpeg_streams) {
+            jpeg_destroy_decompress (&dinfo);
+            return ptm_set_error (ctx, PTM_ERROR_FORMAT, "bad order or reference planes in PTM header");
+        }
         if (reference_index > -1) {
             /* this component was 'predicted' from another component */
             combine (&dinfo, components[component_index],
@@ -434,45 +883,59 @@ void ptm_read_compressed_blocks (FILE *fp, const ptm_header_t *ptm_header, ptm_b
         }
     }
 
-    /* Copy into blocks.  The compressed PTM has a completely different layout
-       than the uncompressed PTM.  Uncompressed PTMs store all coefficients in
-       one block, but compressed PTMs store each coefficient in a separate
-       grayscale JFIF stream.  We now transform from the compressed into the
-       uncompressed layout. */
+    /* Copy into blocks. */
 
     for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
         int b = i / PTM_COEFFICIENTS;
-        int coeff = i % PTM_COEFFICIENTS;
-        JSAMPLE *block = blocks[b];
-        int sample_size = get_sample_size (ptm_header, b);
-        size_t row_stride = ptm_header->dimen[0] * sample_size;
-        for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
-            JSAMPLE *row = block + y * row_stride + coeff;
-            for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
-                row[x * sample_size] = components[i][y][x];
-            }
-        }
+        copy_stream_to_block (ptm_header, components[i], blocks[b], b, i % PTM_COEFFICIENTS);
     }
 
     jpeg_destroy_decompress (&dinfo);
+
+    if (callback) {
+        progress.done = 1;
+        if (callback (ptm_header, blocks, &progress, user_data))
+            return PTM_STOPPED;
+    }
+    return 0;
 }
 
 
 /**
  * JPEG encode the blocks.
  *
+ * On success the caller must free() the streams.
+ *
+ * @param ctx        The context or NULL.
  * @param ptm_header An initialized header struct.
  * @param blocks     An initialized block struct.
  * @param streams    Pointers to JPEG streams.
+ *
+ * @returns 0 on success or an error code.
  */
-void ptm_compress_blocks (ptm_header_t *ptm_header, ptm_block_t *blocks, JOCTET **streams) {
+int ptm_compress_blocks (ptm_ctx_t *ctx, ptm_header_t *ptm_header, ptm_block_t *blocks, JOCTET **streams) {
+    const int n_streams = ptm_header->format->jpeg_streams;
+    unsigned long *outsizes = calloc (n_streams, sizeof (unsigned long));
+    if (outsizes == NULL)
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    int err = 0;
 
     #pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
+    for (int i = 0; i < n_streams; ++i) {
 
-        struct jpeg_error_mgr jerr;
+        ptm_jpeg_error_t jerr;
         struct jpeg_compress_struct cinfo;
-        cinfo.err = jpeg_std_error (&jerr);
+        cinfo.err = ptm_jpeg_error_init (&jerr);
+        streams[i] = NULL;
+        if (setjmp (jerr.jmp)) {
+            ptm_jpeg_error (ctx, (j_common_ptr) &cinfo, "JPEG compressor");
+            #pragma omp atomic write
+            err = PTM_ERROR_JPEG;
+            // jpeg_mem_dest () updates the stream pointer only when finished
+            streams[i] = NULL;
+            jpeg_destroy_compress (&cinfo);
+            continue;
+        }
 
         jpeg_create_compress (&cinfo);
 
@@ -484,56 +947,247 @@ void ptm_compress_blocks (ptm_header_t *ptm_header, ptm_block_t *blocks, JOCTET
 
         jpeg_set_quality (&cinfo, ptm_header->compression_param[0],
                           TRUE /* limit to baseline-JPEG values */);
+        if (ptm_header->progressive)
+            jpeg_simple_progression (&cinfo);
+        cinfo.restart_in_rows = ptm_header->restart_rows / DCTSIZE;
 
         int b = i / PTM_COEFFICIENTS;
         int coeff = i % PTM_COEFFICIENTS;
-        const JSAMPLE *block = blocks[b];
-        int sample_size = get_sample_size (ptm_header, b);
-        size_t row_stride = ptm_header->dimen[0] * sample_size;
+        const size_t pixel_stride = get_pixel_stride (ptm_header, b);
+        const JSAMPLE *plane = blocks[b] + coeff * get_plane_stride (ptm_header);
+        size_t row_stride = ptm_header->dimen[0] * pixel_stride;
 
         /* Make temporary buffer for one line of uncompressed jpeg stream,
-           because we have to de-interleave bytes. */
+           because we have to de-interleave bytes.  Planar blocks need
+           none. */
         JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)
             ((j_common_ptr) &cinfo, JPOOL_IMAGE, cinfo.image_width, 1);
 
-        unsigned long outsize = 0;
-        unsigned char *outbuffer = NULL;
-        jpeg_mem_dest (&cinfo, &outbuffer, &outsize);
+        jpeg_mem_dest (&cinfo, &streams[i], &outsizes[i]);
 
         jpeg_start_compress (&cinfo, TRUE);
 
         while (cinfo.next_scanline < cinfo.image_height) {
-            const JSAMPLE *src = block + cinfo.next_scanline * row_stride + coeff;
+            const JSAMPLE *src = plane + cinfo.next_scanline * row_stride;
+            if (pixel_stride == 1) {
+                JSAMPROW row = (JSAMPROW) src;
+                (void) jpeg_write_scanlines (&cinfo, &row, 1);
+                continue;
+            }
             JSAMPLE *dest = buffer[0];
             for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
                 *dest++ = *src;
-                src += sample_size;
+                src += pixel_stride;
             }
             (void) jpeg_write_scanlines (&cinfo, &buffer[0], 1);
         }
         jpeg_finish_compress (&cinfo);
-
-        streams[i] = malloc (outsize);
-        memcpy (streams[i], outbuffer, outsize);
-        ptm_header->compressed_size[i] = outsize;
+        ptm_header->compressed_size[i] = outsizes[i];
 
         jpeg_destroy_compress (&cinfo);
     }
+
+    free (outsizes);
+    if (err) {
+        for (int i = 0; i < n_streams; ++i) {
+            free (streams[i]);
+            streams[i] = NULL;
+        }
+    }
+    return err;
+}
+
+/** The no. of rows compressed or decompressed at once. */
+#define ROWS_STRIP 16
+
+/** The zlib compression level of the lossless formats.  The residuals are
+    compressed with the Z_RLE strategy: it compresses them better than the
+    default strategy at level 1 and about as fast. */
+#define ZLIB_LEVEL 1
+
+/**
+ * Predict a sample from its left, upper and upper left neighbours.
+ *
+ * The median edge detector of LOCO-I: picks the left or the upper neighbour
+ * at an edge, else assumes a plane.  Written as a clamp of the plane to the
+ * range of the neighbours, which compiles without branches.
+ */
+static inline int med_predict (int a, int b, int c) {
+    const int mn = a < b ? a : b;
+    const int mx = a < b ? b : a;
+    const int p = a + b - c;
+    return p < mn ? mn : (p > mx ? mx : p);
+}
+
+/**
+ * Turn one row of a byte plane into residuals.
+ *
+ * @param row      The row.
+ * @param stride   The distance between two samples of the row.
+ * @param prev     The row below, packed, or NULL for the bottom row.
+ * @param width    The no. of samples.
+ * @param residual [out] The residuals.
+ */
+void predict_row (const JSAMPLE *row, size_t stride, const JSAMPLE *prev, size_t width,
+                  JSAMPLE *residual) {
+    int a = 0;
+    int c = 0;
+    for (size_t x = 0; x < width; ++x) {
+        const int b = prev ? prev[x] : 0;
+        const int sample = row[x * stride];
+        residual[x] = (JSAMPLE) (sample - med_predict (a, b, c));
+        a = sample;
+        c = b;
+    }
+}
+
+/**
+ * Turn residuals back into one row of a byte plane.
+ *
+ * @param residual The residuals.
+ * @param row      [out] The row.
+ * @param prev     The row below, or NULL for the bottom row.
+ * @param stride   The distance between two samples of row and prev.
+ * @param width    The no. of samples.
+ */
+void unpredict_row (const JSAMPLE *residual, JSAMPLE *row, const JSAMPLE *prev,
+                    size_t stride, size_t width) {
+    int a = 0;
+    int c = 0;
+    for (size_t x = 0; x < width; ++x) {
+        const int b = prev ? prev[x * stride] : 0;
+        a = (JSAMPLE) (residual[x] + med_predict (a, b, c));
+        row[x * stride] = a;
+        c = b;
+    }
+}
+
+/**
+ * Decode one zlib stream from memory into a byte plane.
+ *
+ * @param dest         Where to put the first sample of the bottom row.
+ * @param pixel_stride The distance between two samples in dest.
+ */
+int decode_zlib_stream (ptm_ctx_t *ctx, const ptm_header_t *ptm_header, const unsigned char *data,
+                        size_t size, int i, JSAMPLE *dest, size_t pixel_stride) {
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    JSAMPLE *residual = malloc (ROWS_STRIP * width);
+    z_stream zs;
+    memset (&zs, 0, sizeof (zs));
+    if (residual == NULL || inflateInit (&zs) != Z_OK) {
+        free (residual);
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    }
+    zs.next_in  = (Bytef *) data;
+    zs.avail_in = size;
+
+    int ret = Z_OK;
+    for (size_t y0 = 0; y0 < height; y0 += ROWS_STRIP) {
+        const size_t n_rows = height - y0 < ROWS_STRIP ? height - y0 : ROWS_STRIP;
+        zs.next_out  = residual;
+        zs.avail_out = n_rows * width;
+        while (zs.avail_out > 0 && ret == Z_OK)
+            ret = inflate (&zs, Z_NO_FLUSH);
+        if (zs.avail_out > 0)
+            break;
+        for (size_t y = y0; y < y0 + n_rows; ++y) {
+            JSAMPLE *row = dest + y * width * pixel_stride;
+            unpredict_row (residual + (y - y0) * width, row, y ? row - width * pixel_stride : NULL,
+                           pixel_stride, width);
+        }
+    }
+    int complete = ret == Z_STREAM_END && zs.avail_out == 0 && zs.avail_in == 0;
+    inflateEnd (&zs);
+    free (residual);
+    if (!complete)
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "zlib stream %d: corrupt data", i);
+    return 0;
+}
+
+/**
+ * Read the blocks from a losslessly compressed PTM file.
+ *
+ * Reads all streams into memory and decodes them in parallel.
+ */
+int ptm_read_zlib_blocks (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    const int n_streams = ptm_header->format->zlib_streams;
+    size_t offsets[MAX_JPEG_STREAMS + 1];
+    offsets[0] = 0;
+    for (int i = 0; i < n_streams; ++i) {
+        offsets[i + 1] = offsets[i] + ptm_header->compressed_size[i];
+    }
+    unsigned char *data = malloc (offsets[n_streams]);
+    if (data == NULL)
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    if (fread (data, 1, offsets[n_streams], fp) != offsets[n_streams]) {
+        free (data);
+        return ptm_set_error (ctx, PTM_ERROR_IO, "unexpected end of PTM file");
+    }
+
+    int err = 0;
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n_streams; ++i) {
+        const int b = i / PTM_COEFFICIENTS;
+        JSAMPLE *dest = blocks[b] + i % PTM_COEFFICIENTS * get_plane_stride (ptm_header);
+        if (decode_zlib_stream (ctx, ptm_header, data + offsets[i], ptm_header->compressed_size[i], i,
+                                dest, get_pixel_stride (ptm_header, b))) {
+            #pragma omp atomic write
+            err = PTM_ERROR_FORMAT;
+        }
+    }
+    free (data);
+    if (err && ctx)
+        err = ctx->error;
+    return err;
 }
 
-void ptm_read_ptm (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+int ptm_read_ptm (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks) {
     if (ptm_header->format->jpeg_streams > 0) {
-        ptm_read_compressed_blocks (fp, ptm_header, blocks);
-    } else {
-        ptm_read_uncompressed_blocks (fp, ptm_header, blocks);
+        return ptm_read_compressed_blocks (ctx, fp, ptm_header, blocks);
+    }
+    if (ptm_header->format->zlib_streams > 0) {
+        return ptm_read_zlib_blocks (ctx, fp, ptm_header, blocks);
     }
+    return ptm_read_uncompressed_blocks (ctx, fp, ptm_header, blocks);
+}
+
+/** The blocks that get_block_row() reads. */
+typedef struct {
+    const ptm_header_t *ptm_header;
+    ptm_block_t *blocks;
+} ptm_block_row_t;
+
+/** Gets the rows from the blocks for ptm_write_ptm().  Interleaves the rows
+    of planar blocks. */
+int get_block_row (int b, size_t y, JSAMPLE *row, void *user_data) {
+    const ptm_block_row_t *br = user_data;
+    const size_t width = br->ptm_header->dimen[0];
+    const int sample_size = get_sample_size (br->ptm_header, b);
+    if (br->ptm_header->planar)
+        interleave (br->blocks[b] + y * width, get_plane_stride (br->ptm_header), width, sample_size,
+                    row, sample_size);
+    else
+        memcpy (row, br->blocks[b] + y * width * sample_size, width * sample_size);
+    return 0;
 }
 
-void ptm_write_ptm (FILE *fp, ptm_header_t *ptm_header, ptm_block_t *blocks) {
+int ptm_write_ptm (ptm_ctx_t *ctx, FILE *fp, ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    if (ptm_header->format->zlib_streams > 0 ||
+        (ptm_header->planar && ptm_header->format->jpeg_streams == 0)) {
+        ptm_block_row_t br = { ptm_header, blocks };
+        return ptm_write_ptm_rows (ctx, fp, ptm_header, get_block_row, &br);
+    }
     if (ptm_header->format->jpeg_streams > 0) {
         ptm_header->compression_param[0] = 90; // quality
         JOCTET **streams = malloc (sizeof (JOCTET *) * ptm_header->format->jpeg_streams);
-        ptm_compress_blocks (ptm_header, blocks, streams);
+        if (streams == NULL)
+            return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        int err = ptm_compress_blocks (ctx, ptm_header, blocks, streams);
+        if (err) {
+            free (streams);
+            return err;
+        }
         for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
             ptm_header->order[i] = i;
             ptm_header->reference_planes[i] = -1;
@@ -541,107 +1195,2456 @@ void ptm_write_ptm (FILE *fp, ptm_header_t *ptm_header, ptm_block_t *blocks) {
         ptm_write_header (fp, ptm_header);
         for (int i = 0; i < ptm_header->format->jpeg_streams; ++i) {
             fwrite (streams[i], ptm_header->compressed_size[i], 1, fp);
+            free (streams[i]);
         }
         free (streams);
     } else {
         ptm_write_header (fp, ptm_header);
         ptm_write_uncompressed_blocks (fp, ptm_header, blocks);
     }
+    if (ferror (fp))
+        return ptm_set_error (ctx, PTM_ERROR_IO, "error writing PTM file");
+    return 0;
 }
 
 
-void ptm_write_jpeg (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks, float u, float v) {
-
-    /* Lighting setup */
-    ptm_unscaled_coefficients_t light;
-    light.cu2 = u * u;
-    light.cv2 = v * v;
-    light.cuv = u * v;
-    light.cu  = u;
-    light.cv  = v;
-    light.c1  = 1.0;
-
-    /* compress */
-    struct jpeg_error_mgr jerr;
-    struct jpeg_compress_struct cinfo;
-    cinfo.err = jpeg_std_error (&jerr);
-    jpeg_create_compress (&cinfo);
-    jpeg_stdio_dest (&cinfo, fp);
-    cinfo.image_width  = ptm_header->dimen[0];      /* image width and height, in pixels */
-    cinfo.image_height = ptm_header->dimen[1];
-    cinfo.input_components = 3;             /* # of color components per pixel */
-    // use YCbCr color space for PTM_LUM files
-    // use RGB color space for PTM_RGB and PTM_LRGB files
-    cinfo.in_color_space = (ptm_header->format->color_components == 2) ? JCS_YCbCr : JCS_RGB;  /* colorspace of input image */
-    jpeg_set_defaults (&cinfo);
-    jpeg_set_quality (&cinfo, ptm_header->compression_param[0], TRUE /* limit to baseline-JPEG values */);
-
-    JSAMPARRAY out_samples = (*cinfo.mem->alloc_sarray)
-        ((j_common_ptr) &cinfo, JPOOL_IMAGE, ptm_header->dimen[0] * RGB_COEFFICIENTS, 1);
+/** Compress one strip of rows of one stream. */
+int write_strip (ptm_ctx_t *ctx, ptm_jpeg_error_t *jerr, struct jpeg_compress_struct *cinfo,
+                 JSAMPARRAY rows, size_t n_rows) {
+    if (setjmp (jerr->jmp))
+        return ptm_jpeg_error (ctx, (j_common_ptr) cinfo, "JPEG compressor");
+    (void) jpeg_write_scanlines (cinfo, rows, n_rows);
+    return 0;
+}
 
-    jpeg_start_compress (&cinfo, TRUE);
+/** Make room for more output of a zlib stream.  Returns 0 on success. */
+int grow_zlib_output (z_stream *zs, unsigned char **out, size_t *capacity) {
+    const size_t used = *capacity - zs->avail_out;
+    unsigned char *tmp = realloc (*out, 2 * *capacity);
+    if (tmp == NULL)
+        return -1;
+    *out = tmp;
+    zs->next_out  = tmp + used;
+    zs->avail_out = 2 * *capacity - used;
+    *capacity *= 2;
+    return 0;
+}
 
-    /* Compute the polynomial and put the result into an RGB interleaved buffer.
-       Flip the picture vertically.  Encode the buffer.  Write the JPEG. */
+/**
+ * Write a losslessly compressed PTM whose rows come from a callback.
+ *
+ * Runs one zlib compressor per byte plane and feeds them one strip of rows
+ * at a time.
+ *
+ * @param rows One strip of rows of each block.
+ */
+int write_zlib_streams (ptm_ctx_t *ctx, FILE *fp, ptm_header_t *ptm_header,
+                        ptm_row_callback_t get_row, void *user_data, JSAMPLE **rows) {
+    const ptm_format_t *format = ptm_header->format;
+    const int n_streams = format->zlib_streams;
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    z_stream zs[MAX_JPEG_STREAMS];
+    unsigned char *out[MAX_JPEG_STREAMS];
+    size_t capacity[MAX_JPEG_STREAMS];
+    JSAMPLE *prev[MAX_JPEG_STREAMS];     // the row below, packed
+    JSAMPLE *residual[MAX_JPEG_STREAMS];
+    int status = 0;
+
+    memset (zs, 0, sizeof (zs));
+    for (int i = 0; i < n_streams; ++i) {
+        capacity[i] = width * height / 4 + 4096;
+        out[i]      = malloc (capacity[i]);
+        prev[i]     = malloc (width);
+        residual[i] = malloc (ROWS_STRIP * width);
+        if (deflateInit2 (&zs[i], ZLIB_LEVEL, Z_DEFLATED, 15, 8, Z_RLE) != Z_OK ||
+            !out[i] || !prev[i] || !residual[i])
+            status = ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        zs[i].next_out  = out[i];
+        zs[i].avail_out = capacity[i];
+    }
 
-    size_t yoffs = ptm_header->dimen[1] * ptm_header->dimen[0];
-    for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
-        yoffs -= ptm_header->dimen[0];
-        JSAMPLE *p_out = out_samples[0];
-        if (ptm_header->format->color_components == 3) {  /* PTM_FORMAT_*_LRGB */
-            const ptm_coefficients_t *l   = (ptm_coefficients_t *) blocks[0] + yoffs;
-            const rgb_coefficients_t *rgb = (rgb_coefficients_t *) blocks[1] + yoffs;
-            for (size_t x = 0; x < ptm_header->dimen[0]; ++x, ++l, ++rgb) {
-                float L = POLY (l) / 255.0f;
-                *p_out++ = CLIP (L * rgb->r);
-                *p_out++ = CLIP (L * rgb->g);
-                *p_out++ = CLIP (L * rgb->b);
-            }
-        }
-        if (ptm_header->format->color_components == 2) {  /* PTM_FORMAT_LUM not tested !*/
-            const ptm_coefficients_t  *l    = (ptm_coefficients_t *)  blocks[0] + yoffs;
-            const crcb_coefficients_t *crcb = (crcb_coefficients_t *) blocks[1] + yoffs;
-            for (size_t x = 0; x < ptm_header->dimen[0]; ++x, ++l, ++crcb) {
-                *p_out++ = CLIP (POLY (l));
-                *p_out++ = CLIP (crcb->cb);
-                *p_out++ = CLIP (crcb->cr);
+    for (size_t y0 = 0; y0 < height && status == 0; y0 += ROWS_STRIP) {
+        const size_t n_rows = height - y0 < ROWS_STRIP ? height - y0 : ROWS_STRIP;
+        for (int b = 0; b < format->blocks && status == 0; ++b) {
+            const size_t row_size = width * get_sample_size (ptm_header, b);
+            for (size_t y = 0; y < n_rows && status == 0; ++y) {
+                status = get_row (b, y0 + y, rows[b] + y * row_size, user_data) ? PTM_STOPPED : 0;
             }
         }
-        if (ptm_header->format->color_components == 0) {  /* PTM_FORMAT_*_RGB */
-            const ptm_coefficients_t *r = (ptm_coefficients_t *) blocks[0] + yoffs;
-            const ptm_coefficients_t *g = (ptm_coefficients_t *) blocks[1] + yoffs;
-            const ptm_coefficients_t *b = (ptm_coefficients_t *) blocks[2] + yoffs;
-            for (size_t x = 0; x < ptm_header->dimen[0]; ++x, ++r, ++g, ++b) {
-                *p_out++ = CLIP (POLY (r));
-                *p_out++ = CLIP (POLY (g));
-                *p_out++ = CLIP (POLY (b));
+        if (status)
+            break;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < n_streams; ++i) {
+            const int b = i / PTM_COEFFICIENTS;
+            const int sample_size = get_sample_size (ptm_header, b);
+            for (size_t y = 0; y < n_rows; ++y) {
+                const JSAMPLE *row = rows[b] + y * width * sample_size + i % PTM_COEFFICIENTS;
+                predict_row (row, sample_size, y0 + y ? prev[i] : NULL, width, residual[i] + y * width);
+                for (size_t x = 0; x < width; ++x) {
+                    prev[i][x] = row[x * sample_size];
+                }
+            }
+            zs[i].next_in  = residual[i];
+            zs[i].avail_in = n_rows * width;
+            int ret = Z_OK;
+            while (ret == Z_OK && zs[i].avail_in > 0) {
+                if (zs[i].avail_out == 0 && grow_zlib_output (&zs[i], &out[i], &capacity[i]))
+                    ret = Z_MEM_ERROR;
+                else
+                    ret = deflate (&zs[i], Z_NO_FLUSH);
+            }
+            if (ret != Z_OK) {
+                ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+                #pragma omp atomic write
+                status = PTM_ERROR_MEMORY;
             }
         }
-        (void) jpeg_write_scanlines (&cinfo, out_samples, 1);
     }
 
-    jpeg_finish_compress (&cinfo);
-
-    /* cleanup */
-
-    jpeg_destroy_compress (&cinfo);
+    for (int i = 0; i < n_streams && status == 0; ++i) {
+        int ret = Z_OK;
+        while (ret == Z_OK || ret == Z_BUF_ERROR) {
+            if (zs[i].avail_out == 0 && grow_zlib_output (&zs[i], &out[i], &capacity[i]))
+                break;
+            ret = deflate (&zs[i], Z_FINISH);
+        }
+        if (ret != Z_STREAM_END)
+            status = ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        ptm_header->compressed_size[i] = zs[i].total_out;
+    }
+    if (status == 0) {
+        ptm_write_header (fp, ptm_header);
+        for (int i = 0; i < n_streams; ++i) {
+            fwrite (out[i], ptm_header->compressed_size[i], 1, fp);
+        }
+    }
+    for (int i = 0; i < n_streams; ++i) {
+        deflateEnd (&zs[i]);
+        free (out[i]);
+        free (prev[i]);
+        free (residual[i]);
+    }
+    return status;
 }
 
-float *ptm_svd (decoder_t **decoders, int n_decoders) {
-    lapack_int n_lights = n_decoders;
-    lapack_int n_coeffs = PTM_COEFFICIENTS;
-
-    ptm_unscaled_coefficients_t *A = calloc (n_lights, sizeof (ptm_unscaled_coefficients_t));
+int ptm_write_ptm_rows (ptm_ctx_t *ctx, FILE *fp, ptm_header_t *ptm_header,
+                        ptm_row_callback_t get_row, void *user_data) {
+    const ptm_format_t *format = ptm_header->format;
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    volatile int status = 0;
+
+    /* one strip of rows of each block */
+    JSAMPLE *rows[MAX_PTM_BLOCKS + 1];
+    for (int b = 0; b < format->blocks; ++b) {
+        rows[b] = malloc (ROWS_STRIP * width * get_sample_size (ptm_header, b));
+        if (rows[b] == NULL) {
+            for (int c = 0; c < b; ++c)
+                free (rows[c]);
+            return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        }
+    }
+
+    if (format->zlib_streams) {
+        status = write_zlib_streams (ctx, fp, ptm_header, get_row, user_data, rows);
+    } else if (format->jpeg_streams == 0) {
+        ptm_write_header (fp, ptm_header);
+        if (format->id == PTM_FORMAT_LUM) {
+            // the coefficients and CrCb are interleaved
+            for (size_t y = 0; y < height && status == 0; ++y) {
+                if (get_row (0, y, rows[0], user_data) || get_row (1, y, rows[1], user_data)) {
+                    status = PTM_STOPPED;
+                    break;
+                }
+                const ptm_coefficients_t   *coeffs = (ptm_coefficients_t *)   rows[0];
+                const ycbcr_coefficients_t *ycbcr  = (ycbcr_coefficients_t *) rows[1];
+                for (size_t x = 0; x < width; ++x, ++coeffs, ++ycbcr) {
+                    fwrite (coeffs, sizeof (ptm_coefficients_t), 1, fp);
+                    fputc (ycbcr->cr, fp);
+                    fputc (ycbcr->cb, fp);
+                }
+            }
+        } else {
+            for (int b = 0; b < format->blocks; ++b) {
+                for (size_t y = 0; y < height && status == 0; ++y) {
+                    if (get_row (b, y, rows[b], user_data)) {
+                        status = PTM_STOPPED;
+                        break;
+                    }
+                    fwrite (rows[b], get_sample_size (ptm_header, b), width, fp);
+                }
+            }
+        }
+    } else {
+        /* Run one JPEG compressor per stream and feed them one strip of rows
+           at a time. */
+        const int n_streams = format->jpeg_streams;
+        ptm_jpeg_error_t jerr[MAX_JPEG_STREAMS];
+        struct jpeg_compress_struct cinfo[MAX_JPEG_STREAMS];
+        unsigned char *outbuffer[MAX_JPEG_STREAMS];
+        unsigned long outsize[MAX_JPEG_STREAMS];
+        JSAMPARRAY buffer[MAX_JPEG_STREAMS];
+
+        // jpeg_destroy_compress () is a no-op on a zeroed struct
+        memset (cinfo, 0, sizeof (cinfo));
+        ptm_header->compression_param[0] = 90; // quality
+        for (volatile int i = 0; i < n_streams; ++i) {
+            cinfo[i].err = ptm_jpeg_error_init (&jerr[i]);
+            outbuffer[i] = NULL;
+            outsize[i] = 0;
+            if (setjmp (jerr[i].jmp)) {
+                status = ptm_jpeg_error (ctx, (j_common_ptr) &cinfo[i], "JPEG compressor");
+                break;
+            }
+            jpeg_create_compress (&cinfo[i]);
+            cinfo[i].image_width  = width;
+            cinfo[i].image_height = height;
+            cinfo[i].input_components = 1;
+            cinfo[i].in_color_space = JCS_GRAYSCALE;
+            jpeg_set_defaults (&cinfo[i]);
+            jpeg_set_quality (&cinfo[i], ptm_header->compression_param[0],
+                              TRUE /* limit to baseline-JPEG values */);
+            if (ptm_header->progressive)
+                jpeg_simple_progression (&cinfo[i]);
+            cinfo[i].restart_in_rows = ptm_header->restart_rows / DCTSIZE;
+            jpeg_mem_dest (&cinfo[i], &outbuffer[i], &outsize[i]);
+            buffer[i] = (*cinfo[i].mem->alloc_sarray)
+                ((j_common_ptr) &cinfo[i], JPOOL_IMAGE, width, ROWS_STRIP);
+            jpeg_start_compress (&cinfo[i], TRUE);
+        }
+
+        for (size_t y0 = 0; y0 < height && status == 0; y0 += ROWS_STRIP) {
+            const size_t n_rows = height - y0 < ROWS_STRIP ? height - y0 : ROWS_STRIP;
+            for (int b = 0; b < format->blocks && status == 0; ++b) {
+                const size_t row_size = width * get_sample_size (ptm_header, b);
+                for (size_t y = 0; y < n_rows && status == 0; ++y) {
+                    status = get_row (b, y0 + y, rows[b] + y * row_size, user_data) ? PTM_STOPPED : 0;
+                }
+            }
+            if (status)
+                break;
+
+            #pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < n_streams; ++i) {
+                int b = i / PTM_COEFFICIENTS;
+                int coeff = i % PTM_COEFFICIENTS;
+                int sample_size = get_sample_size (ptm_header, b);
+                for (size_t y = 0; y < n_rows; ++y) {
+                    const JSAMPLE *src = rows[b] + y * width * sample_size + coeff;
+                    JSAMPLE *dest = buffer[i][y];
+                    for (size_t x = 0; x < width; ++x) {
+                        *dest++ = *src;
+                        src += sample_size;
+                    }
+                }
+                if (write_strip (ctx, &jerr[i], &cinfo[i], buffer[i], n_rows)) {
+                    #pragma omp atomic write
+                    status = PTM_ERROR_JPEG;
+                }
+            }
+        }
+
+        for (volatile int i = 0; i < n_streams && status == 0; ++i) {
+            if (setjmp (jerr[i].jmp)) {
+                status = ptm_jpeg_error (ctx, (j_common_ptr) &cinfo[i], "JPEG compressor");
+                break;
+            }
+            jpeg_finish_compress (&cinfo[i]);
+            ptm_header->compressed_size[i] = outsize[i];
+            ptm_header->order[i] = i;
+            ptm_header->reference_planes[i] = -1;
+        }
+        if (status == 0) {
+            ptm_write_header (fp, ptm_header);
+            for (int i = 0; i < n_streams; ++i) {
+                fwrite (outbuffer[i], outsize[i], 1, fp);
+            }
+        }
+        for (int i = 0; i < n_streams; ++i) {
+            jpeg_destroy_compress (&cinfo[i]);
+            // jpeg_mem_dest () updates the buffer pointer only when finished
+            if (status == 0)
+                free (outbuffer[i]);
+        }
+    }
+
+    for (int b = 0; b < format->blocks; ++b) {
+        free (rows[b]);
+    }
+    if (status == 0 && ferror (fp))
+        status = ptm_set_error (ctx, PTM_ERROR_IO, "error writing PTM file");
+    return status;
+}
+
+/** Round up to a multiple of 8 bytes. */
+#define ALIGN8(n) (((n) + 7) & ~((size_t) 7))
+
+/** Where a stream is in a PTM file, how to decode it, and where to put it. */
+typedef struct {
+    size_t offset;          /**< The offset of the stream in the file. */
+    size_t size;            /**< The size of the stream. */
+    int b;                  /**< The block the stream goes into. */
+    int coeff;              /**< The first byte of a pixel of the block. */
+    int planes;             /**< The no. of bytes of a pixel of the stream. */
+} stream_t;
+
+/**
+ * List the streams of a PTM file.
+ *
+ * @returns The no. of streams.
+ */
+int list_streams (const ptm_header_t *ptm_header, size_t data_offset, stream_t *streams) {
+    const ptm_format_t *format = ptm_header->format;
+    const size_t image_size = ptm_header->dimen[0] * ptm_header->dimen[1];
+    size_t offset = data_offset;
+    const int n_streams = format->jpeg_streams + format->zlib_streams;
+    if (n_streams) {
+        for (int i = 0; i < n_streams; ++i) {
+            streams[i] = (stream_t) { offset, ptm_header->compressed_size[i],
+                                      i / PTM_COEFFICIENTS, i % PTM_COEFFICIENTS, 1 };
+            offset += ptm_header->compressed_size[i];
+            if (format->jpeg_streams)
+                offset += ptm_header->side_info_sizes[i];
+        }
+        return n_streams;
+    }
+    if (format->id == PTM_FORMAT_LUM) {
+        // the coefficients and CrCb are interleaved
+        streams[0] = (stream_t) { offset, image_size * (PTM_COEFFICIENTS + CBCR_COEFFICIENTS),
+                                  0, 0, PTM_COEFFICIENTS + CBCR_COEFFICIENTS };
+        return 1;
+    }
+    for (int b = 0; b < format->blocks; ++b) {
+        int sample_size = get_sample_size (ptm_header, b);
+        streams[b] = (stream_t) { offset, image_size * sample_size, b, 0, sample_size };
+        offset += image_size * sample_size;
+    }
+    return format->blocks;
+}
+
+/**
+ * Decode one JPEG stream from memory.
+ *
+ * Uses its own decompressor, so many streams can be decoded at once.
+ *
+ * @param dest         Where to put the first pixel of the bottom row.
+ * @param pixel_stride The distance between two pixels in dest.
+ */
+int decode_jpeg_stream (ptm_ctx_t *ctx, const ptm_header_t *ptm_header, const unsigned char *data,
+                   size_t size, int i, JSAMPLE *dest, size_t pixel_stride) {
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    ptm_jpeg_error_t jerr;
+    struct jpeg_decompress_struct dinfo;
+    dinfo.err = ptm_jpeg_error_init (&jerr);
+    if (setjmp (jerr.jmp)) {
+        char what[32];
+        snprintf (what, sizeof (what), "JPEG stream %d", i);
+        int err = ptm_jpeg_error (ctx, (j_common_ptr) &dinfo, what);
+        jpeg_destroy_decompress (&dinfo);
+        return err;
+    }
+    jpeg_create_decompress (&dinfo);
+    jpeg_mem_src (&dinfo, data, size);
+    (void) jpeg_read_header (&dinfo, TRUE);
+    if (dinfo.image_width != width || dinfo.image_height != height || dinfo.num_components != 1) {
+        jpeg_destroy_decompress (&dinfo);
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "JPEG stream %d: wrong size", i);
+    }
+    (void) jpeg_start_decompress (&dinfo);
+    JSAMPARRAY row = (*dinfo.mem->alloc_sarray) ((j_common_ptr) &dinfo, JPOOL_IMAGE, width, 1);
+    while (dinfo.output_scanline < height) {
+        JSAMPLE *d = dest + dinfo.output_scanline * width * pixel_stride;
+        (void) jpeg_read_scanlines (&dinfo, row, 1);
+        for (size_t x = 0; x < width; ++x) {
+            d[x * pixel_stride] = row[0][x];
+        }
+    }
+    (void) jpeg_finish_decompress (&dinfo);
+    jpeg_destroy_decompress (&dinfo);
+    return 0;
+}
+
+/** Decode one JPEG or zlib stream from memory.  See decode_jpeg_stream(). */
+int decode_stream (ptm_ctx_t *ctx, const ptm_header_t *ptm_header, const unsigned char *data,
+                   size_t size, int i, JSAMPLE *dest, size_t pixel_stride) {
+    if (ptm_header->format->zlib_streams)
+        return decode_zlib_stream (ctx, ptm_header, data, size, i, dest, pixel_stride);
+    return decode_jpeg_stream (ctx, ptm_header, data, size, i, dest, pixel_stride);
+}
+
+/**
+ * Find the restart intervals of a baseline JPEG stream.
+ *
+ * @param tiles      [out] The offsets of the restart intervals in the
+ *                   stream, or NULL to just count them.
+ * @param tile_rows  [out] The no. of rows in a restart interval.
+ *
+ * @returns The no. of restart intervals, 0 if the stream is progressive.
+ */
+size_t jpeg_restart_intervals (const unsigned char *p, size_t size, size_t width, size_t height,
+                               uint64_t *tiles, uint32_t *tile_rows) {
+    if (size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return 0;
+    size_t interval = 0;  // in MCUs
+    size_t i = 2;
+    for (;;) {
+        while (i + 1 < size && p[i] == 0xFF && p[i + 1] == 0xFF)
+            ++i;  // fill bytes
+        if (i + 4 > size || p[i] != 0xFF)
+            return 0;
+        const int marker = p[i + 1];
+        const size_t length = (p[i + 2] << 8) | p[i + 3];
+        if (marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE)
+            return 0;  // progressive
+        if (marker == 0xDD && i + 6 <= size)
+            interval = (p[i + 4] << 8) | p[i + 5];
+        i += 2 + length;
+        if (marker == 0xDA)
+            break;  // SOS
+    }
+    if (i > size)
+        return 0;
+
+    // a grayscale MCU is one block of 8 x 8
+    const size_t mcus_per_row = (width + DCTSIZE - 1) / DCTSIZE;
+    size_t n = 0;
+    if (tiles)
+        tiles[n] = i;
+    ++n;
+    if (interval == 0 || interval % mcus_per_row) {
+        *tile_rows = height;
+        return n;
+    }
+    *tile_rows = interval / mcus_per_row * DCTSIZE;
+    for (; i + 1 < size; ++i) {
+        if (p[i] != 0xFF)
+            continue;
+        if (p[i + 1] >= JPEG_RST0 && p[i + 1] <= JPEG_RST0 + 7) {
+            if (tiles)
+                tiles[n] = i + 2;
+            ++n;
+        } else if (p[i + 1] == JPEG_EOI) {
+            break;
+        }
+        ++i;  // skip the stuffed zero or the marker
+    }
+    return n;
+}
+
+/** Map a whole file into memory. */
+const unsigned char *map_file (ptm_ctx_t *ctx, int fd, const char *what, size_t *size) {
+    struct stat st;
+    if (fstat (fd, &st) != 0 || st.st_size == 0) {
+        ptm_set_error (ctx, PTM_ERROR_IO, "can't map %s", what);
+        return NULL;
+    }
+    void *data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        ptm_set_error (ctx, PTM_ERROR_IO, "can't map %s: %s", what, strerror (errno));
+        return NULL;
+    }
+    *size = st.st_size;
+    return data;
+}
+
+/** The file name of the index of a PTM. */
+char *index_path (const char *ptm_path) {
+    char *path = malloc (strlen (ptm_path) + 5);
+    if (path)
+        sprintf (path, "%s.idx", ptm_path);
+    return path;
+}
+
+/** Find the range of each plane of a stream of an uncompressed PTM. */
+void plane_range (const unsigned char *data, size_t n_pixels, int planes, ptm_index_plane_t *range) {
+    unsigned char mn[PTM_COEFFICIENTS + CBCR_COEFFICIENTS];
+    unsigned char mx[PTM_COEFFICIENTS + CBCR_COEFFICIENTS];
+    for (int c = 0; c < planes; ++c) {
+        mn[c] = 255;
+        mx[c] = 0;
+    }
+    #pragma omp parallel for schedule(static) reduction(min:mn[:planes]) reduction(max:mx[:planes])
+    for (size_t i = 0; i < n_pixels; ++i) {
+        const unsigned char *pixel = data + i * planes;
+        for (int c = 0; c < planes; ++c) {
+            if (pixel[c] < mn[c])
+                mn[c] = pixel[c];
+            if (pixel[c] > mx[c])
+                mx[c] = pixel[c];
+        }
+    }
+    for (int c = 0; c < planes; ++c) {
+        range[c].min = mn[c];
+        range[c].max = mx[c];
+    }
+}
+
+/**
+ * Build the index of a PTM file in memory.
+ *
+ * @returns The index file contents, to be freed, or NULL.
+ */
+unsigned char *build_index (ptm_ctx_t *ctx, const ptm_header_t *ptm_header,
+                            const unsigned char *data, size_t size, size_t data_offset,
+                            size_t *index_size) {
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    stream_t streams[MAX_JPEG_STREAMS];
+    const int n_streams = list_streams (ptm_header, data_offset, streams);
+    const int jpeg = ptm_header->format->jpeg_streams > 0;
+    const int compressed = jpeg || ptm_header->format->zlib_streams > 0;
+
+    size_t n_planes = 0;
+    size_t n_tiles  = 0;
+    for (int i = 0; i < n_streams; ++i) {
+        if (streams[i].offset + streams[i].size > size) {
+            ptm_set_error (ctx, PTM_ERROR_IO, "unexpected end of PTM file");
+            return NULL;
+        }
+        uint32_t tile_rows;
+        n_planes += streams[i].planes;
+        if (jpeg)
+            n_tiles += jpeg_restart_intervals (data + streams[i].offset, streams[i].size,
+                                               width, height, NULL, &tile_rows);
+        else if (!compressed)
+            n_tiles += (height + PTM_INDEX_TILE_ROWS - 1) / PTM_INDEX_TILE_ROWS;
+    }
+
+    const size_t streams_offset = ALIGN8 (sizeof (ptm_index_header_t));
+    const size_t planes_offset  = streams_offset + n_streams * sizeof (ptm_index_stream_t);
+    const size_t tiles_offset   = ALIGN8 (planes_offset + n_planes * sizeof (ptm_index_plane_t));
+    *index_size = tiles_offset + n_tiles * sizeof (uint64_t);
+
+    unsigned char *index = calloc (*index_size, 1);
+    if (index == NULL) {
+        ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        return NULL;
+    }
+    ptm_index_header_t *header = (ptm_index_header_t *) index;
+    ptm_index_stream_t *entries = (ptm_index_stream_t *) (index + streams_offset);
+    ptm_index_plane_t  *planes  = (ptm_index_plane_t *)  (index + planes_offset);
+    uint64_t           *tiles   = (uint64_t *)           (index + tiles_offset);
+
+    memcpy (header->magic, PTM_INDEX_MAGIC, sizeof (header->magic));
+    header->byte_order  = PTM_INDEX_BYTE_ORDER;
+    header->header_size = sizeof (ptm_index_header_t);
+    header->format      = ptm_header->format->id;
+    header->n_streams   = n_streams;
+    header->n_planes    = n_planes;
+    header->n_tiles     = n_tiles;
+    header->width       = width;
+    header->height      = height;
+    header->ptm_size    = size;
+    header->streams     = streams_offset;
+    header->planes      = planes_offset;
+    header->tiles       = tiles_offset;
+
+    size_t tile = 0;
+    for (int i = 0; i < n_streams; ++i) {
+        ptm_index_stream_t *e = &entries[i];
+        e->offset         = streams[i].offset;
+        e->size           = streams[i].size;
+        e->side_info_size = jpeg ? ptm_header->side_info_sizes[i] : 0;
+        e->first_tile     = tile;
+        e->planes         = streams[i].planes;
+        if (jpeg) {
+            e->n_tiles = jpeg_restart_intervals (data + e->offset, e->size, width, height,
+                                                 tiles + tile, &e->tile_rows);
+            for (size_t t = tile; t < tile + e->n_tiles; ++t)
+                tiles[t] += e->offset;
+        } else if (!compressed) {
+            const size_t row_size = width * streams[i].planes;
+            e->n_tiles   = (height + PTM_INDEX_TILE_ROWS - 1) / PTM_INDEX_TILE_ROWS;
+            e->tile_rows = PTM_INDEX_TILE_ROWS;
+            for (size_t t = 0; t < e->n_tiles; ++t)
+                tiles[tile + t] = e->offset + t * PTM_INDEX_TILE_ROWS * row_size;
+        }
+        tile += e->n_tiles;
+    }
+
+    // the range of the planes
+    if (compressed) {
+        int err = 0;
+        #pragma omp parallel
+        {
+            JSAMPLE *plane = malloc (width * height);
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n_streams; ++i) {
+                if (plane == NULL)
+                    ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+                if (plane == NULL ||
+                    decode_stream (ctx, ptm_header, data + streams[i].offset, streams[i].size, i, plane, 1)) {
+                    #pragma omp atomic write
+                    err = 1;
+                    continue;
+                }
+                plane_range (plane, width * height, 1, &planes[i]);
+            }
+            free (plane);
+        }
+        if (err) {
+            free (index);
+            return NULL;
+        }
+    } else {
+        ptm_index_plane_t *range = planes;
+        for (int i = 0; i < n_streams; ++i) {
+            plane_range (data + streams[i].offset, width * height, streams[i].planes, range);
+            range += streams[i].planes;
+        }
+    }
+
+    header->checksum = ptm_fnv1a (PTM_FNV1A_INIT, data, size);
+    return index;
+}
+
+int ptm_write_index (ptm_ctx_t *ctx, const char *ptm_path) {
+    int fd = open (ptm_path, O_RDONLY);
+    if (fd < 0)
+        return ptm_set_error (ctx, PTM_ERROR_IO, "can't open %s: %s", ptm_path, strerror (errno));
+    size_t size;
+    const unsigned char *data = map_file (ctx, fd, ptm_path, &size);
+    close (fd);
+    if (data == NULL)
+        return ctx ? (int) ctx->error : PTM_ERROR_IO;
+
+    int err = PTM_ERROR_FORMAT;
+    unsigned char *index = NULL;
+    size_t index_size = 0;
+    FILE *fp = fmemopen ((void *) data, size, "rb");
+    ptm_header_t *ptm_header = fp ? ptm_read_header (ctx, fp) : NULL;
+    if (ptm_header) {
+        index = build_index (ctx, ptm_header, data, size, ftell (fp), &index_size);
+        free (ptm_header);
+    }
+    if (fp)
+        fclose (fp);
+    munmap ((void *) data, size);
+    if (index == NULL)
+        return ctx && ctx->error ? (int) ctx->error : err;
+
+    // write to a temporary file, so that readers never see half an index
+    char *path = index_path (ptm_path);
+    char *tmp_path = path ? malloc (strlen (path) + 32) : NULL;
+    if (tmp_path == NULL) {
+        free (path);
+        free (index);
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    }
+    sprintf (tmp_path, "%s.tmp%ld", path, (long) getpid ());
+    err = 0;
+    FILE *fp_index = fopen (tmp_path, "wb");
+    if (fp_index == NULL) {
+        err = ptm_set_error (ctx, PTM_ERROR_IO, "can't open %s: %s", tmp_path, strerror (errno));
+    } else {
+        int ok = fwrite (index, index_size, 1, fp_index) == 1;
+        if (fclose (fp_index) != 0 || !ok || rename (tmp_path, path) != 0) {
+            err = ptm_set_error (ctx, PTM_ERROR_IO, "error writing %s", path);
+            remove (tmp_path);
+        }
+    }
+    free (tmp_path);
+    free (path);
+    free (index);
+    return err;
+}
+
+ptm_index_t *ptm_index_open (ptm_ctx_t *ctx, const char *ptm_path) {
+    char *path = index_path (ptm_path);
+    if (path == NULL) {
+        ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        return NULL;
+    }
+    int fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            ptm_set_error (ctx, PTM_ERROR_IO, "can't open %s: %s", path, strerror (errno));
+        free (path);
+        return NULL;
+    }
+    size_t size;
+    const unsigned char *data = map_file (ctx, fd, path, &size);
+    close (fd);
+    if (data == NULL) {
+        free (path);
+        return NULL;
+    }
+
+    const ptm_index_header_t *header = (const ptm_index_header_t *) data;
+    int ok = size >= sizeof (ptm_index_header_t) &&
+        !memcmp (header->magic, PTM_INDEX_MAGIC, sizeof (header->magic)) &&
+        header->byte_order == PTM_INDEX_BYTE_ORDER &&
+        header->header_size >= sizeof (ptm_index_header_t) &&
+        header->n_streams <= MAX_JPEG_STREAMS &&
+        header->streams % 8 == 0 && header->tiles % 8 == 0 &&
+        header->streams <= size && (size - header->streams) / sizeof (ptm_index_stream_t) >= header->n_streams &&
+        header->planes  <= size && (size - header->planes)  / sizeof (ptm_index_plane_t)  >= header->n_planes &&
+        header->tiles   <= size && (size - header->tiles)   / sizeof (uint64_t)           >= header->n_tiles;
+    const ptm_index_stream_t *streams = (const ptm_index_stream_t *) (data + (ok ? header->streams : 0));
+    for (uint32_t i = 0; ok && i < header->n_streams; ++i) {
+        ok = (uint64_t) streams[i].first_tile + streams[i].n_tiles <= header->n_tiles;
+    }
+    if (!ok) {
+        ptm_set_error (ctx, PTM_ERROR_FORMAT, "%s: not a PTM index", path);
+        munmap ((void *) data, size);
+        free (path);
+        return NULL;
+    }
+    free (path);
+
+    ptm_index_t *index = malloc (sizeof (ptm_index_t));
+    if (index == NULL) {
+        ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+        munmap ((void *) data, size);
+        return NULL;
+    }
+    index->header  = header;
+    index->streams = streams;
+    index->planes  = (const ptm_index_plane_t *) (data + header->planes);
+    index->tiles   = (const uint64_t *) (data + header->tiles);
+    index->size    = size;
+    return index;
+}
+
+void ptm_index_close (ptm_index_t *index) {
+    if (index == NULL)
+        return;
+    munmap ((void *) index->header, index->size);
+    free (index);
+}
+
+int ptm_index_matches (const ptm_index_t *index, FILE *fp, const ptm_header_t *ptm_header) {
+    const ptm_index_header_t *header = index->header;
+    struct stat st;
+    long data_offset = ftell (fp);
+    if (data_offset < 0 || fstat (fileno (fp), &st) != 0)
+        return 0;
+
+    stream_t streams[MAX_JPEG_STREAMS];
+    const int n_streams = list_streams (ptm_header, data_offset, streams);
+    if (header->ptm_size != (uint64_t) st.st_size ||
+        header->format != (uint32_t) ptm_header->format->id ||
+        header->width  != ptm_header->dimen[0] ||
+        header->height != ptm_header->dimen[1] ||
+        header->n_streams != (uint32_t) n_streams)
+        return 0;
+    for (int i = 0; i < n_streams; ++i) {
+        if (index->streams[i].offset != streams[i].offset ||
+            index->streams[i].size   != streams[i].size ||
+            streams[i].offset + streams[i].size > (uint64_t) st.st_size)
+            return 0;
+    }
+    return 1;
+}
+
+int ptm_read_ptm_indexed (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header,
+                          ptm_block_t *blocks, const ptm_index_t *index) {
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    const int jpeg = ptm_header->format->jpeg_streams > 0;
+    const int compressed = jpeg || ptm_header->format->zlib_streams > 0;
+
+    if (!ptm_index_matches (index, fp, ptm_header))
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "the PTM index is stale");
+
+    stream_t streams[MAX_JPEG_STREAMS];
+    const int n_streams = list_streams (ptm_header, ftell (fp), streams);
+
+    size_t size;
+    const unsigned char *data = map_file (ctx, fileno (fp), "PTM file", &size);
+    if (data == NULL)
+        return ctx ? (int) ctx->error : PTM_ERROR_IO;
+
+    int err = 0;
+    if (compressed) {
+        // predicted streams must be decoded in order
+        int predicted = 0;
+        for (int i = 0; jpeg && i < n_streams; ++i) {
+            predicted |= ptm_header->order[i] != i || ptm_header->reference_planes[i] != -1 ||
+                ptm_header->side_info_sizes[i] > 0;
+        }
+        if (predicted) {
+            munmap ((void *) data, size);
+            return ptm_read_compressed_blocks (ctx, fp, ptm_header, blocks);
+        }
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < n_streams; ++i) {
+            const stream_t *s = &streams[i];
+            JSAMPLE *dest = blocks[s->b] + s->coeff * get_plane_stride (ptm_header);
+            if (decode_stream (ctx, ptm_header, data + s->offset, s->size, i,
+                               dest, get_pixel_stride (ptm_header, s->b))) {
+                #pragma omp atomic write
+                err = jpeg ? PTM_ERROR_JPEG : PTM_ERROR_FORMAT;
+            }
+        }
+        if (err && ctx)
+            err = ctx->error;
+    } else if (ptm_header->planar) {
+        const int lum = ptm_header->format->id == PTM_FORMAT_LUM;
+        for (int i = 0; i < n_streams; ++i) {
+            const size_t row_size = streams[i].size / height;
+            #pragma omp parallel for schedule(static)
+            for (size_t y = 0; y < height; ++y) {
+                deinterleave_row (ptm_header, data + streams[i].offset + y * row_size, blocks,
+                                  lum ? 0 : streams[i].b, y);
+            }
+        }
+    } else if (ptm_header->format->id == PTM_FORMAT_LUM) {
+        const unsigned char *src = data + streams[0].offset;
+        const size_t pixel_size = PTM_COEFFICIENTS + CBCR_COEFFICIENTS;
+        ptm_coefficients_t  *coeffs = (ptm_coefficients_t *)  blocks[0];
+        crcb_coefficients_t *crcb   = (crcb_coefficients_t *) blocks[1];
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < width * height; ++i) {
+            memcpy (&coeffs[i], src + i * pixel_size, sizeof (ptm_coefficients_t));
+            memcpy (&crcb[i], src + i * pixel_size + sizeof (ptm_coefficients_t), sizeof (crcb_coefficients_t));
+        }
+    } else {
+        for (int i = 0; i < n_streams; ++i) {
+            memcpy (blocks[streams[i].b], data + streams[i].offset, streams[i].size);
+        }
+    }
+    munmap ((void *) data, size);
+    return err;
+}
+
+void ptm_render_defaults (ptm_render_params_t *params) {
+    params->mode     = PTM_RENDER_DEFAULT;
+    params->gain     = 2.0f;
+    params->kd       = 0.8f;
+    params->ks       = 0.4f;
+    params->exponent = 20.0f;
+}
+
+int ptm_parse_render_option (const char *arg, ptm_render_params_t *params) {
+    if (!strcmp (arg, "--normals")) {
+        params->mode = PTM_RENDER_NORMALS;
+        return 1;
+    }
+    if (!strncmp (arg, "--diffuse-gain", 14) && (arg[14] == '\0' || arg[14] == '=')) {
+        params->mode = PTM_RENDER_DIFFUSE_GAIN;
+        if (arg[14] == '=' && sscanf (arg + 15, "%f", &params->gain) != 1)
+            return -1;
+        return 1;
+    }
+    if (!strncmp (arg, "--specular", 10) && (arg[10] == '\0' || arg[10] == '=')) {
+        params->mode = PTM_RENDER_SPECULAR;
+        if (arg[10] == '=' &&
+            sscanf (arg + 11, "%f,%f,%f", &params->kd, &params->ks, &params->exponent) != 3)
+            return -1;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Find the surface normal from the unscaled PTM coefficients.
+ *
+ * The maximum of the polynomial is where both partial derivatives are 0.
+ */
+static inline void normal_from_coeffs (float a0, float a1, float a2, float a3, float a4,
+                                       float *nu, float *nv, float *nw) {
+    float divisor = 4 * a0 * a1 - a2 * a2;
+    // no maximum if the paraboloid opens upwards or is degenerate
+    int valid = (divisor > 1e-12f) && (a0 < 0.0f);
+    float u = valid ? (a2 * a4 - 2 * a1 * a3) / divisor : 0.0f;
+    float v = valid ? (a2 * a3 - 2 * a0 * a4) / divisor : 0.0f;
+    float uv2 = u * u + v * v;
+    // clamp to the horizon
+    float norm = uv2 > 1.0f ? 1.0f / sqrtf (uv2) : 1.0f;
+    *nu = u * norm;
+    *nv = v * norm;
+    *nw = sqrtf (fmaxf (0.0f, 1.0f - *nu * *nu - *nv * *nv));
+}
+
+/**
+ * Find the normals of one row of pixels.
+ *
+ * Gets inlined once for each block layout, so that the compiler sees the
+ * constant pixel stride.
+ *
+ * @param offs         The first pixel of the row.
+ * @param pixel_stride The distance between two pixels of a block.
+ * @param plane_stride The distance between two coefficients of a pixel.
+ */
+static inline void normal_row (const ptm_header_t *ptm_header, ptm_block_t *blocks, size_t offs,
+                               size_t pixel_stride, size_t plane_stride,
+                               const float *scale, const float *bias, ptm_normal_t *n) {
+    // RGB formats: use the luma of the three polynomials
+    const int n_blocks = ptm_header->format->ptm_blocks;
+    const float weights[3] = { 0.299f, 0.587f, 0.114f };
+
+    #pragma omp simd
+    for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
+        float a[PTM_COEFFICIENTS] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int b = 0; b < n_blocks; ++b) {
+            const JSAMPLE *p = blocks[b] + (offs + x) * pixel_stride;
+            const float w = n_blocks == 1 ? 1.0f : weights[b];
+            for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+                a[i] += w * scale[i] * (p[i * plane_stride] - bias[i]);
+            }
+        }
+        float nu, nv, nw;
+        normal_from_coeffs (a[0], a[1], a[2], a[3], a[4], &nu, &nv, &nw);
+        n[x].nu = (int8_t) lrintf (nu * 127.0f);
+        n[x].nv = (int8_t) lrintf (nv * 127.0f);
+        n[x].nw = (int8_t) lrintf (nw * 127.0f);
+    }
+}
+
+ptm_normal_t *ptm_normal_map (const ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    const size_t width  = ptm_header->dimen[0];
+    const size_t height = ptm_header->dimen[1];
+    ptm_normal_t *normals = malloc (width * height * sizeof (ptm_normal_t));
+    if (normals == NULL)
+        return NULL;
+
+    float scale[PTM_COEFFICIENTS];
+    float bias[PTM_COEFFICIENTS];
+    for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+        scale[i] = ptm_header->scale[i];
+        bias[i]  = ptm_header->bias[i];
+    }
+
+    const size_t plane_stride = get_plane_stride (ptm_header);
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < height; ++y) {
+        const size_t offs = y * width;
+        if (ptm_header->planar)
+            normal_row (ptm_header, blocks, offs, 1, plane_stride, scale, bias, normals + offs);
+        else
+            normal_row (ptm_header, blocks, offs, PTM_COEFFICIENTS, 1, scale, bias, normals + offs);
+    }
+    return normals;
+}
+
+/**
+ * Evaluate the polynomial with diffuse gain.
+ *
+ * Multiplies the curvature of the polynomial by gain while keeping its
+ * maximum at the normal.
+ *
+ * @param a The unscaled coefficients.
+ */
+static inline float poly_gain (const float *a, float u, float v, float nu, float nv, float gain) {
+    const float g1 = 1.0f - gain;
+    return gain * (a[0] * u * u + a[1] * v * v + a[2] * u * v)
+        + (g1 * (2 * a[0] * nu + a[2] * nv) + a[3]) * u
+        + (g1 * (2 * a[1] * nv + a[2] * nu) + a[4]) * v
+        + g1 * (a[0] * nu * nu + a[1] * nv * nv + a[2] * nu * nv) + a[5];
+}
+
+/**
+ * Evaluate the polynomials of one row of pixels of a block.
+ *
+ * Gets inlined once for each block layout, so that the compiler sees the
+ * constant pixel stride.  With planar blocks the loads are contiguous and the
+ * loop vectorizes without shuffles.
+ *
+ * @param p            The first coefficient of the first pixel of the row.
+ * @param pixel_stride The distance between two pixels.
+ * @param plane_stride The distance between two coefficients of a pixel.
+ * @param n            The normals of the row.
+ * @param n_step       1 or 0 if all pixels share one normal.
+ * @param out          [out] The values of the polynomials.
+ */
+static inline void eval_row (const ptm_header_t *ptm_header, const JSAMPLE *p,
+                             size_t pixel_stride, size_t plane_stride,
+                             const ptm_render_params_t *params, float u, float v,
+                             const ptm_normal_t *n, size_t n_step, float *out) {
+    float scale[PTM_COEFFICIENTS];
+    float bias[PTM_COEFFICIENTS];
+    for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+        scale[i] = ptm_header->scale[i];
+        bias[i]  = ptm_header->bias[i];
+    }
+    const float cu2 = u * u;
+    const float cv2 = v * v;
+    const float cuv = u * v;
+
+    if (params->mode == PTM_RENDER_DIFFUSE_GAIN) {
+        for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
+            const JSAMPLE *q = p + x * pixel_stride;
+            float a[PTM_COEFFICIENTS];
+            for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+                a[i] = scale[i] * (q[i * plane_stride] - bias[i]);
+            }
+            const ptm_normal_t *nx = n + x * n_step;
+            out[x] = poly_gain (a, u, v, nx->nu / 127.0f, nx->nv / 127.0f, params->gain);
+        }
+        return;
+    }
+
+    #pragma omp simd
+    for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
+        const JSAMPLE *q = p + x * pixel_stride;
+        out[x] = scale[0] * (q[0]                - bias[0]) * cu2 +
+                 scale[1] * (q[plane_stride]     - bias[1]) * cv2 +
+                 scale[2] * (q[2 * plane_stride] - bias[2]) * cuv +
+                 scale[3] * (q[3 * plane_stride] - bias[3]) * u   +
+                 scale[4] * (q[4 * plane_stride] - bias[4]) * v   +
+                 scale[5] * (q[5 * plane_stride] - bias[5]);
+    }
+}
+
+/**
+ * Render one row of the PTM.
+ *
+ * @param y       The no. of the row, counted from the top.
+ * @param scratch Room for the values of the polynomials of one row: width
+ *                floats for each PTM block.
+ * @param p_out   [out] The row, 3 bytes per pixel, in the color space of
+ *                ptm_render_color_space().
+ */
+void render_row (const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                 const ptm_normal_t *normals, const ptm_render_params_t *params,
+                 float u, float v, size_t y, float *scratch, JSAMPLE *p_out) {
+
+    const ptm_render_mode_t mode = params->mode;
+
+    /* The halfway vector between the light and the viewer for the
+       highlights.  The viewer is straight above. */
+    float hu = u;
+    float hv = v;
+    float hw = sqrtf (fmaxf (0.0f, 1.0f - u * u - v * v)) + 1.0f;
+    float hn = sqrtf (hu * hu + hv * hv + hw * hw) * 127.0f;
+    hu /= hn;
+    hv /= hn;
+    hw /= hn;
+
+    /** The highlight of one pixel. */
+    #define HIGHLIGHT(n) (params->ks * 255.0f * \
+                          powf (fmaxf (0.0f, n->nu * hu + n->nv * hv + n->nw * hw), params->exponent))
+
+    float *values[MAX_PTM_BLOCKS];
+    for (int b = 0; b < ptm_header->format->ptm_blocks; ++b) {
+        values[b] = scratch + b * ptm_header->dimen[0];
+    }
+
+    // a dummy for the modes that don't use normals
+    const ptm_normal_t up = { 0, 0, 127 };
+
+    const size_t plane_stride = get_plane_stride (ptm_header);
+    const size_t color_stride = get_pixel_stride (ptm_header, ptm_header->format->ptm_blocks);
+
+    // flip the picture vertically
+    const size_t yoffs = (ptm_header->dimen[1] - 1 - y) * ptm_header->dimen[0];
+    const ptm_normal_t *n = normals ? normals + yoffs : &up;
+    const size_t n_step = normals ? 1 : 0;
+    for (int b = 0; b < ptm_header->format->ptm_blocks && mode != PTM_RENDER_NORMALS; ++b) {
+        if (ptm_header->planar)
+            eval_row (ptm_header, blocks[b] + yoffs, 1, plane_stride,
+                      params, u, v, n, n_step, values[b]);
+        else
+            eval_row (ptm_header, blocks[b] + yoffs * PTM_COEFFICIENTS, PTM_COEFFICIENTS, 1,
+                      params, u, v, n, n_step, values[b]);
+    }
+    if (mode == PTM_RENDER_NORMALS) {
+        for (size_t x = 0; x < ptm_header->dimen[0]; ++x, n += n_step) {
+            *p_out++ = CLIP (128.0f + n->nu);
+            *p_out++ = CLIP (128.0f + n->nv);
+            *p_out++ = CLIP (128.0f + n->nw);
+        }
+    } else if (ptm_header->format->color_components == 3) {  /* PTM_FORMAT_*_LRGB */
+        const JSAMPLE *rgb = blocks[1] + yoffs * color_stride;
+        for (size_t x = 0; x < ptm_header->dimen[0]; ++x, rgb += color_stride, n += n_step) {
+            float L = values[0][x] / 255.0f;
+            if (mode == PTM_RENDER_SPECULAR) {
+                float s = HIGHLIGHT (n);
+                L *= params->kd;
+                *p_out++ = CLIP (L * rgb[0] + s);
+                *p_out++ = CLIP (L * rgb[plane_stride] + s);
+                *p_out++ = CLIP (L * rgb[2 * plane_stride] + s);
+            } else {
+                *p_out++ = CLIP (L * rgb[0]);
+                *p_out++ = CLIP (L * rgb[plane_stride]);
+                *p_out++ = CLIP (L * rgb[2 * plane_stride]);
+            }
+        }
+    } else if (ptm_header->format->color_components == 2) {  /* PTM_FORMAT_LUM not tested !*/
+        // interleaved blocks hold CrCb as read from the file, planar
+        // blocks hold YCbCr planes
+        const JSAMPLE *cb, *cr;
+        size_t step = 1;
+        if (ptm_header->planar) {
+            cb = blocks[1] + plane_stride + yoffs;
+            cr = blocks[1] + 2 * plane_stride + yoffs;
+        } else {
+            const crcb_coefficients_t *crcb = (crcb_coefficients_t *) blocks[1] + yoffs;
+            cb = &crcb->cb;
+            cr = &crcb->cr;
+            step = sizeof (crcb_coefficients_t);
+        }
+        for (size_t x = 0; x < ptm_header->dimen[0]; ++x, cb += step, cr += step, n += n_step) {
+            float L = values[0][x];
+            if (mode == PTM_RENDER_SPECULAR)
+                L = params->kd * L + HIGHLIGHT (n);
+            *p_out++ = CLIP (L);
+            *p_out++ = CLIP (*cb);
+            *p_out++ = CLIP (*cr);
+        }
+    } else if (ptm_header->format->color_components == 0) {  /* PTM_FORMAT_*_RGB */
+        for (size_t x = 0; x < ptm_header->dimen[0]; ++x, n += n_step) {
+            if (mode == PTM_RENDER_SPECULAR) {
+                float s = HIGHLIGHT (n);
+                *p_out++ = CLIP (params->kd * values[0][x] + s);
+                *p_out++ = CLIP (params->kd * values[1][x] + s);
+                *p_out++ = CLIP (params->kd * values[2][x] + s);
+            } else {
+                *p_out++ = CLIP (values[0][x]);
+                *p_out++ = CLIP (values[1][x]);
+                *p_out++ = CLIP (values[2][x]);
+            }
+        }
+    }
+
+    #undef HIGHLIGHT
+}
+
+J_COLOR_SPACE ptm_render_color_space (const ptm_header_t *ptm_header, const ptm_render_params_t *params) {
+    // use YCbCr color space for PTM_LUM files
+    // use RGB color space for PTM_RGB and PTM_LRGB files
+    return (ptm_header->format->color_components == 2 && params->mode != PTM_RENDER_NORMALS) ?
+        JCS_YCbCr : JCS_RGB;
+}
+
+/** Render the PTM and write it as JPEG.  Does the work for
+    ptm_write_jpeg_enhanced(). */
+int write_jpeg (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                const ptm_normal_t *normals, const ptm_render_params_t *params,
+                float u, float v) {
+
+    /* compress */
+    ptm_jpeg_error_t jerr;
+    struct jpeg_compress_struct cinfo;
+    cinfo.err = ptm_jpeg_error_init (&jerr);
+    if (setjmp (jerr.jmp)) {
+        int err = ptm_jpeg_error (ctx, (j_common_ptr) &cinfo, "JPEG compressor");
+        jpeg_destroy_compress (&cinfo);
+        return err;
+    }
+    jpeg_create_compress (&cinfo);
+    jpeg_stdio_dest (&cinfo, fp);
+    cinfo.image_width  = ptm_header->dimen[0];      /* image width and height, in pixels */
+    cinfo.image_height = ptm_header->dimen[1];
+    cinfo.input_components = 3;             /* # of color components per pixel */
+    cinfo.in_color_space = ptm_render_color_space (ptm_header, params);  /* colorspace of input image */
+    jpeg_set_defaults (&cinfo);
+    jpeg_set_quality (&cinfo, ptm_header->compression_param[0], TRUE /* limit to baseline-JPEG values */);
+
+    JSAMPARRAY out_samples = (*cinfo.mem->alloc_sarray)
+        ((j_common_ptr) &cinfo, JPOOL_IMAGE, ptm_header->dimen[0] * RGB_COEFFICIENTS, 1);
+
+    /* The values of the polynomials of one row. */
+    float *values = (*cinfo.mem->alloc_large)
+        ((j_common_ptr) &cinfo, JPOOL_IMAGE, MAX_PTM_BLOCKS * ptm_header->dimen[0] * sizeof (float));
+
+    jpeg_start_compress (&cinfo, TRUE);
+
+    /* Compute the polynomial and put the result into an RGB interleaved buffer.
+       Encode the buffer.  Write the JPEG. */
+
+    for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
+        render_row (ptm_header, blocks, normals, params, u, v, y, values, out_samples[0]);
+        (void) jpeg_write_scanlines (&cinfo, out_samples, 1);
+    }
+
+    jpeg_finish_compress (&cinfo);
+
+    /* cleanup */
+
+    jpeg_destroy_compress (&cinfo);
+    if (ferror (fp))
+        return ptm_set_error (ctx, PTM_ERROR_IO, "error writing JPEG file");
+    return 0;
+}
+
+int ptm_write_jpeg (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                    float u, float v) {
+    ptm_render_params_t params;
+    ptm_render_defaults (&params);
+    return ptm_write_jpeg_enhanced (ctx, fp, ptm_header, blocks, NULL, &params, u, v);
+}
+
+int ptm_write_jpeg_enhanced (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                             const ptm_normal_t *normals, const ptm_render_params_t *params,
+                             float u, float v) {
+    ptm_normal_t *own_normals = NULL;
+    if (params->mode != PTM_RENDER_DEFAULT && normals == NULL) {
+        normals = own_normals = ptm_normal_map (ptm_header, blocks);
+        if (own_normals == NULL)
+            return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    }
+    int err = write_jpeg (ctx, fp, ptm_header, blocks, normals, params, u, v);
+    free (own_normals);
+    return err;
+}
+
+int ptm_render (ptm_ctx_t *ctx, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                const ptm_normal_t *normals, const ptm_render_params_t *params,
+                float u, float v, JSAMPLE *out) {
+    const size_t width = ptm_header->dimen[0];
+    ptm_normal_t *own_normals = NULL;
+    if (params->mode != PTM_RENDER_DEFAULT && normals == NULL) {
+        normals = own_normals = ptm_normal_map (ptm_header, blocks);
+        if (own_normals == NULL)
+            return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    }
+
+    int err = 0;
+    #pragma omp parallel
+    {
+        float *values = malloc (MAX_PTM_BLOCKS * width * sizeof (float));
+        if (values == NULL) {
+            #pragma omp atomic write
+            err = 1;
+        }
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
+            if (values)
+                render_row (ptm_header, blocks, normals, params, u, v, y, values,
+                            out + y * width * RGB_COEFFICIENTS);
+        }
+        free (values);
+    }
+    free (own_normals);
+    if (err)
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    return 0;
+}
+
+int ptm_write_png (FILE *fp, size_t width, size_t height, const JSAMPLE *rgb) {
+    png_structp png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png == NULL)
+        return -1;
+    png_infop png_info = png_create_info_struct (png);
+    if (png_info == NULL || setjmp (png_jmpbuf (png))) {
+        png_destroy_write_struct (&png, &png_info);
+        return -1;
+    }
+    png_init_io (png, fp);
+    png_set_IHDR (png, png_info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info (png, png_info);
+    for (size_t y = 0; y < height; ++y) {
+        png_write_row (png, rgb + y * width * RGB_COEFFICIENTS);
+    }
+    png_write_end (png, NULL);
+    png_destroy_write_struct (&png, &png_info);
+    return 0;
+}
+
+/*
+ * Input image readers
+ */
+
+/** Read one sample out of a row of 8 or 16 bit samples. */
+static inline float get_sample (const void *row, size_t i, int sample_size) {
+    return sample_size == 2 ? ((const uint16_t *) row)[i] : ((const JSAMPLE *) row)[i];
+}
+
+/** Round, clip and store one sample into a row of 8 or 16 bit samples. */
+static inline void put_sample (void *row, size_t i, int sample_size, float f) {
+    if (sample_size == 2) {
+        ((uint16_t *) row)[i] = f > 65535.0f ? 65535 : (f < 0.0f ? 0 : f + 0.5f);
+    } else {
+        ((JSAMPLE *) row)[i] = f > 255.0f ? 255 : (f < 0.0f ? 0 : f + 0.5f);
+    }
+}
+
+/**
+ * Convert one decoded row of gray or RGB pixels into the requested color
+ * space.
+ *
+ * Any alpha channel is dropped.
+ *
+ * @param dest           The destination row, 1 or 3 components per pixel.
+ * @param src            The source row.  May not overlap dest.
+ * @param width          The no. of pixels in the row.
+ * @param src_components The no. of components per pixel in src: 1 to 4.
+ * @param color_space    JCS_RGB, JCS_YCbCr or JCS_GRAYSCALE.
+ * @param sample_size    1 or 2.
+ */
+void convert_row (void *dest, const void *src, size_t width, int src_components,
+                  J_COLOR_SPACE color_space, int sample_size) {
+    const float center = sample_size == 2 ? 32768.0f : CENTERJSAMPLE;
+    const int gray = src_components < 3;
+
+    if ((color_space == JCS_RGB && src_components == 3) ||
+        (color_space == JCS_GRAYSCALE && src_components == 1)) {
+        memcpy (dest, src, width * src_components * sample_size);
+        return;
+    }
+
+    for (size_t x = 0; x < width; ++x) {
+        const size_t i = x * src_components;
+        float r = get_sample (src, i, sample_size);
+        float g = gray ? r : get_sample (src, i + 1, sample_size);
+        float b = gray ? r : get_sample (src, i + 2, sample_size);
+        // See: https://en.wikipedia.org/wiki/YCbCr#JPEG_conversion
+        float y = 0.299f * r + 0.587f * g + 0.114f * b;
+        switch (color_space) {
+        case JCS_GRAYSCALE:
+            put_sample (dest, x, sample_size, y);
+            break;
+        case JCS_YCbCr:
+            put_sample (dest, 3 * x,     sample_size, y);
+            put_sample (dest, 3 * x + 1, sample_size, center - 0.168736f * r - 0.331264f * g + 0.5f * b);
+            put_sample (dest, 3 * x + 2, sample_size, center + 0.5f * r - 0.418688f * g - 0.081312f * b);
+            break;
+        default:
+            put_sample (dest, 3 * x,     sample_size, r);
+            put_sample (dest, 3 * x + 1, sample_size, g);
+            put_sample (dest, 3 * x + 2, sample_size, b);
+            break;
+        }
+    }
+}
+
+void ptm_write_y4m_header (FILE *fp, size_t width, size_t height, int fps) {
+    // the samples are full range as in JPEG
+    fprintf (fp, "YUV4MPEG2 W%zu H%zu F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", width, height, fps);
+}
+
+int ptm_write_y4m_frame (ptm_ctx_t *ctx, FILE *fp, size_t width, size_t height,
+                         const JSAMPLE *pixels, J_COLOR_SPACE color_space) {
+    const size_t image_size = width * height;
+    JSAMPLE *frame = malloc (RGB_COEFFICIENTS * image_size);
+    if (frame == NULL)
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+
+    int err = 0;
+    #pragma omp parallel
+    {
+        JSAMPLE *ycbcr = malloc (RGB_COEFFICIENTS * width);
+        if (ycbcr == NULL) {
+            #pragma omp atomic write
+            err = 1;
+        }
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < height; ++y) {
+            const JSAMPLE *row = pixels + y * width * RGB_COEFFICIENTS;
+            if (ycbcr && color_space != JCS_YCbCr) {
+                convert_row (ycbcr, row, width, RGB_COEFFICIENTS, JCS_YCbCr, 1);
+                row = ycbcr;
+            }
+            if (ycbcr)
+                deinterleave (row, RGB_COEFFICIENTS, width, RGB_COEFFICIENTS, frame + y * width, image_size);
+        }
+        free (ycbcr);
+    }
+    if (err) {
+        free (frame);
+        return ptm_set_error (ctx, PTM_ERROR_MEMORY, "out of memory");
+    }
+
+    fputs ("FRAME\n", fp);
+    fwrite (frame, RGB_COEFFICIENTS, image_size, fp);
+    free (frame);
+    if (ferror (fp))
+        return ptm_set_error (ctx, PTM_ERROR_IO, "error writing Y4M stream");
+    return 0;
+}
+
+/** The no. of components the readers decode into. */
+int color_space_components (J_COLOR_SPACE color_space) {
+    return color_space == JCS_GRAYSCALE ? 1 : 3;
+}
+
+/* JPEG via libjpeg */
+
+int input_jpeg_match (const unsigned char *magic, size_t size) {
+    return size >= 3 && magic[0] == 0xFF && magic[1] == 0xD8 && magic[2] == 0xFF;
+}
+
+int input_jpeg_probe (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space, ptm_input_info_t *info) {
+    FILE *fp;
+    if ((fp = fopen (path, "rb")) == NULL)
+        return -1;
+
+    ptm_jpeg_error_t jerr;
+    struct jpeg_decompress_struct dinfo;
+    dinfo.err = ptm_jpeg_error_init (&jerr);
+    if (setjmp (jerr.jmp)) {
+        ptm_jpeg_error (ctx, (j_common_ptr) &dinfo, path);
+        jpeg_destroy_decompress (&dinfo);
+        fclose (fp);
+        return -1;
+    }
+    jpeg_create_decompress (&dinfo);
+    jpeg_stdio_src (&dinfo, fp);
+    (void) jpeg_read_header (&dinfo, TRUE);
+    dinfo.out_color_space = color_space;
+    jpeg_calc_output_dimensions (&dinfo);
+
+    info->width       = dinfo.output_width;
+    info->height      = dinfo.output_height;
+    info->components  = dinfo.output_components;
+    info->sample_size = 1;
+
+    jpeg_destroy_decompress (&dinfo);
+    fclose (fp);
+    return 0;
+}
+
+int input_jpeg_decode (const unsigned char *data, size_t size, J_COLOR_SPACE color_space,
+                       unsigned int scale_denom, const ptm_input_info_t *info, void **rows) {
+    ptm_jpeg_error_t jerr;
+    struct jpeg_decompress_struct dinfo;
+    dinfo.err = ptm_jpeg_error_init (&jerr);
+    if (setjmp (jerr.jmp)) {
+        ptm_jpeg_error (NULL, (j_common_ptr) &dinfo, "JPEG decoder");
+        jpeg_destroy_decompress (&dinfo);
+        return -1;
+    }
+    jpeg_create_decompress (&dinfo);
+    jpeg_mem_src (&dinfo, data, size);
+    (void) jpeg_read_header (&dinfo, TRUE);
+    dinfo.out_color_space = color_space;
+    // let the IDCT do the shrinking
+    dinfo.scale_num   = 1;
+    dinfo.scale_denom = scale_denom;
+    (void) jpeg_start_decompress (&dinfo);
+
+    int ret = -1;
+    if (dinfo.output_width      == info->width &&
+        dinfo.output_height     == info->height &&
+        dinfo.output_components == info->components) {
+
+        while (dinfo.output_scanline < dinfo.output_height) {
+            (void) jpeg_read_scanlines (&dinfo, (JSAMPARRAY) rows + dinfo.output_scanline,
+                                        dinfo.output_height - dinfo.output_scanline);
+        }
+        (void) jpeg_finish_decompress (&dinfo);
+        ret = 0;
+    }
+    jpeg_destroy_decompress (&dinfo);
+    return ret;
+}
+
+/* PNG via libpng */
+
+/** State of a PNG read from memory. */
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+} png_mem_t;
+
+void png_mem_read (png_structp png, png_bytep out, png_size_t len) {
+    png_mem_t *mem = png_get_io_ptr (png);
+    if (len > mem->size - mem->pos)
+        png_error (png, "unexpected end of file");
+    memcpy (out, mem->data + mem->pos, len);
+    mem->pos += len;
+}
+
+/** Set the libpng transformations we need and fill in the info. */
+void png_setup (png_structp png, png_infop png_info, J_COLOR_SPACE color_space, ptm_input_info_t *info) {
+    png_read_info (png, png_info);
+
+    int bit_depth  = png_get_bit_depth (png, png_info);
+    int color_type = png_get_color_type (png, png_info);
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb (png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8 (png);
+    if (bit_depth == 16) {
+        uint16_t one = 1;
+        if (*(unsigned char *) &one == 1)
+            png_set_swap (png); // to little endian
+    }
+    png_read_update_info (png, png_info);
+
+    info->width       = png_get_image_width  (png, png_info);
+    info->height      = png_get_image_height (png, png_info);
+    info->components  = color_space_components (color_space);
+    info->sample_size = bit_depth == 16 ? 2 : 1;
+}
+
+int input_png_match (const unsigned char *magic, size_t size) {
+    return size >= 8 && !png_sig_cmp (magic, 0, 8);
+}
+
+int input_png_probe (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space, ptm_input_info_t *info) {
+    (void) ctx;
+    FILE *fp;
+    if ((fp = fopen (path, "rb")) == NULL)
+        return -1;
+
+    png_structp png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop png_info = png_create_info_struct (png);
+    if (setjmp (png_jmpbuf (png))) {
+        png_destroy_read_struct (&png, &png_info, NULL);
+        fclose (fp);
+        return -1;
+    }
+    png_init_io (png, fp);
+    png_setup (png, png_info, color_space, info);
+
+    png_destroy_read_struct (&png, &png_info, NULL);
+    fclose (fp);
+    return 0;
+}
+
+int input_png_decode (const unsigned char *data, size_t size, J_COLOR_SPACE color_space,
+                      unsigned int scale_denom, const ptm_input_info_t *info, void **rows) {
+    if (scale_denom != 1)
+        return -1;
+    png_mem_t mem = { data, size, 0 };
+    png_structp png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop png_info = png_create_info_struct (png);
+    unsigned char * volatile row = NULL;
+
+    if (setjmp (png_jmpbuf (png))) {
+        free (row);
+        png_destroy_read_struct (&png, &png_info, NULL);
+        return -1;
+    }
+    png_set_read_fn (png, &mem, png_mem_read);
+
+    ptm_input_info_t png_input_info;
+    png_setup (png, png_info, color_space, &png_input_info);
+    if (png_input_info.width       != info->width  ||
+        png_input_info.height      != info->height ||
+        png_input_info.sample_size != info->sample_size) {
+        png_error (png, "image size differs");
+    }
+    if (png_get_interlace_type (png, png_info) != PNG_INTERLACE_NONE)
+        png_error (png, "interlaced PNGs are not supported");
+
+    int channels = png_get_channels (png, png_info);
+    row = malloc (png_get_rowbytes (png, png_info));
+    if (row == NULL)
+        png_error (png, "out of memory");
+    for (size_t y = 0; y < info->height; ++y) {
+        png_read_row (png, row, NULL);
+        convert_row (rows[y], row, info->width, channels, color_space, info->sample_size);
+    }
+    png_read_end (png, NULL);
+
+    free (row);
+    png_destroy_read_struct (&png, &png_info, NULL);
+    return 0;
+}
+
+/* TIFF via libtiff */
+
+/** State of a TIFF read from memory. */
+typedef struct {
+    const unsigned char *data;
+    toff_t size;
+    toff_t pos;
+} tiff_mem_t;
+
+tmsize_t tiff_mem_read (thandle_t handle, void *buf, tmsize_t n) {
+    tiff_mem_t *mem = handle;
+    if (mem->pos >= mem->size)
+        return 0;
+    if ((toff_t) n > mem->size - mem->pos)
+        n = mem->size - mem->pos;
+    memcpy (buf, mem->data + mem->pos, n);
+    mem->pos += n;
+    return n;
+}
+
+tmsize_t tiff_mem_write (thandle_t handle, void *buf, tmsize_t n) {
+    (void) handle;
+    (void) buf;
+    (void) n;
+    return -1;
+}
+
+toff_t tiff_mem_seek (thandle_t handle, toff_t offset, int whence) {
+    tiff_mem_t *mem = handle;
+    switch (whence) {
+    case SEEK_SET: mem->pos = offset; break;
+    case SEEK_CUR: mem->pos += offset; break;
+    case SEEK_END: mem->pos = mem->size + offset; break;
+    }
+    return mem->pos;
+}
+
+int tiff_mem_close (thandle_t handle) {
+    (void) handle;
+    return 0;
+}
+
+toff_t tiff_mem_size (thandle_t handle) {
+    return ((tiff_mem_t *) handle)->size;
+}
+
+int tiff_mem_map (thandle_t handle, void **base, toff_t *size) {
+    tiff_mem_t *mem = handle;
+    *base = (void *) mem->data;
+    *size = mem->size;
+    return 1;
+}
+
+void tiff_mem_unmap (thandle_t handle, void *base, toff_t size) {
+    (void) handle;
+    (void) base;
+    (void) size;
+}
+
+/** Check that we can read this TIFF and fill in the info.  Returns 0 if we
+    can. */
+int tiff_setup (TIFF *tif, J_COLOR_SPACE color_space, ptm_input_info_t *info, int *channels) {
+    uint32_t width, height;
+    uint16_t bits, samples, planar, photometric;
+
+    TIFFGetField (tif, TIFFTAG_IMAGEWIDTH,  &width);
+    TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE,   &bits);
+    TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+    TIFFGetFieldDefaulted (tif, TIFFTAG_PLANARCONFIG,    &planar);
+    if (!TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric))
+        photometric = samples >= 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK;
+
+    if ((bits != 8 && bits != 16) ||
+        samples < 1 || samples > 4 ||
+        planar != PLANARCONFIG_CONTIG ||
+        (photometric != PHOTOMETRIC_MINISBLACK && photometric != PHOTOMETRIC_RGB) ||
+        TIFFIsTiled (tif)) {
+        return -1;
+    }
+
+    info->width       = width;
+    info->height      = height;
+    info->components  = color_space_components (color_space);
+    info->sample_size = bits / 8;
+    *channels = samples;
+    return 0;
+}
+
+int input_tiff_match (const unsigned char *magic, size_t size) {
+    return size >= 4 && ((magic[0] == 'I' && magic[1] == 'I' && magic[2] == 42 && magic[3] == 0) ||
+                         (magic[0] == 'M' && magic[1] == 'M' && magic[2] == 0  && magic[3] == 42));
+}
+
+int input_tiff_probe (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space, ptm_input_info_t *info) {
+    TIFF *tif = TIFFOpen (path, "r");
+    if (tif == NULL)
+        return -1;
+    int channels;
+    int ret = tiff_setup (tif, color_space, info, &channels);
+    TIFFClose (tif);
+    if (ret)
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "%s: unsupported TIFF: only 8 or 16 bit, gray or RGB, "
+                              "contiguous, stripped TIFFs are supported", path);
+    return 0;
+}
+
+int input_tiff_decode (const unsigned char *data, size_t size, J_COLOR_SPACE color_space,
+                       unsigned int scale_denom, const ptm_input_info_t *info, void **rows) {
+    if (scale_denom != 1)
+        return -1;
+    tiff_mem_t mem = { data, size, 0 };
+    TIFF *tif = TIFFClientOpen ("memory", "rm", &mem,
+                                tiff_mem_read, tiff_mem_write, tiff_mem_seek, tiff_mem_close,
+                                tiff_mem_size, tiff_mem_map, tiff_mem_unmap);
+    if (tif == NULL)
+        return -1;
+
+    ptm_input_info_t tiff_info;
+    int channels;
+    if (tiff_setup (tif, color_space, &tiff_info, &channels) ||
+        tiff_info.width       != info->width  ||
+        tiff_info.height      != info->height ||
+        tiff_info.sample_size != info->sample_size) {
+        TIFFClose (tif);
+        return -1;
+    }
+
+    int ret = 0;
+    void *row = malloc (TIFFScanlineSize (tif));
+    for (size_t y = 0; y < info->height && row; ++y) {
+        if (TIFFReadScanline (tif, row, y, 0) < 0) {
+            ret = -1;
+            break;
+        }
+        convert_row (rows[y], row, info->width, channels, color_space, info->sample_size);
+    }
+    if (row == NULL)
+        ret = -1;
+    free (row);
+    TIFFClose (tif);
+    return ret;
+}
+
+/* PGM and PPM (binary netpbm) */
+
+/**
+ * Parse the header of a binary PGM or PPM file.
+ *
+ * @returns The offset of the pixel data or 0 on error.
+ */
+size_t pnm_parse_header (const unsigned char *data, size_t size,
+                         size_t *width, size_t *height, int *channels, unsigned int *maxval) {
+    if (size < 3 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+        return 0;
+    *channels = data[1] == '6' ? 3 : 1;
+
+    size_t values[3];
+    size_t pos = 2;
+    for (int i = 0; i < 3; ++i) {
+        // skip whitespace and comments
+        while (pos < size && (isspace (data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n')
+                    ++pos;
+            } else {
+                ++pos;
+            }
+        }
+        if (pos >= size || !isdigit (data[pos]))
+            return 0;
+        values[i] = 0;
+        while (pos < size && isdigit (data[pos]))
+            values[i] = values[i] * 10 + (data[pos++] - '0');
+    }
+    // exactly one whitespace char before the pixel data
+    if (pos >= size || !isspace (data[pos]))
+        return 0;
+    ++pos;
+
+    *width  = values[0];
+    *height = values[1];
+    *maxval = values[2];
+    if (*maxval == 0 || *maxval > 65535)
+        return 0;
+    return pos;
+}
+
+int input_pnm_match (const unsigned char *magic, size_t size) {
+    return size >= 3 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6') && isspace (magic[2]);
+}
+
+int input_pnm_probe (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space, ptm_input_info_t *info) {
+    (void) ctx;
+    FILE *fp;
+    if ((fp = fopen (path, "rb")) == NULL)
+        return -1;
+    unsigned char header[4096];
+    size_t size = fread (header, 1, sizeof (header), fp);
+    fclose (fp);
+
+    int channels;
+    unsigned int maxval;
+    if (pnm_parse_header (header, size, &info->width, &info->height, &channels, &maxval) == 0)
+        return -1;
+    info->components  = color_space_components (color_space);
+    info->sample_size = maxval > 255 ? 2 : 1;
+    return 0;
+}
+
+int input_pnm_decode (const unsigned char *data, size_t size, J_COLOR_SPACE color_space,
+                      unsigned int scale_denom, const ptm_input_info_t *info, void **rows) {
+    if (scale_denom != 1)
+        return -1;
+    size_t width, height;
+    int channels;
+    unsigned int maxval;
+    size_t offset = pnm_parse_header (data, size, &width, &height, &channels, &maxval);
+    int sample_size = maxval > 255 ? 2 : 1;
+    size_t row_size = width * channels * sample_size;
+
+    if (offset == 0 ||
+        width != info->width || height != info->height ||
+        sample_size != info->sample_size ||
+        size - offset < height * row_size) {
+        return -1;
+    }
+
+    // scale to the full range of the sample type
+    const float scale = (sample_size == 2 ? 65535.0f : 255.0f) / maxval;
+    void *row = malloc (row_size);
+    if (row == NULL)
+        return -1;
+    for (size_t y = 0; y < height; ++y) {
+        const unsigned char *src = data + offset + y * row_size;
+        for (size_t i = 0; i < width * channels; ++i) {
+            // netpbm is big endian
+            float f = sample_size == 2 ? (src[2 * i] << 8) | src[2 * i + 1] : src[i];
+            put_sample (row, i, sample_size, f * scale);
+        }
+        convert_row (rows[y], row, width, channels, color_space, sample_size);
+    }
+    free (row);
+    return 0;
+}
+
+const ptm_input_format_t ptm_input_formats[] = {
+    { "JPEG", input_jpeg_match, input_jpeg_probe, input_jpeg_decode, 8 },
+    { "PNG",  input_png_match,  input_png_probe,  input_png_decode,  1 },
+    { "TIFF", input_tiff_match, input_tiff_probe, input_tiff_decode, 1 },
+    { "PNM",  input_pnm_match,  input_pnm_probe,  input_pnm_decode,  1 },
+    { NULL,   NULL,             NULL,             NULL,              0 },
+};
+
+const ptm_input_format_t *ptm_find_input_format (const unsigned char *magic, size_t size) {
+    const ptm_input_format_t *format = ptm_input_formats;
+    while (format->name) {
+        if (format->match (magic, size)) {
+            return format;
+        }
+        ++format;
+    }
+    return NULL;
+}
+
+int ptm_probe_input (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space,
+                     const ptm_input_format_t **format, ptm_input_info_t *info) {
+    FILE *fp;
+    if ((fp = fopen (path, "rb")) == NULL)
+        return ptm_set_error (ctx, PTM_ERROR_IO, "can't open %s: %s", path, strerror (errno));
+    unsigned char magic[16];
+    size_t size = fread (magic, 1, sizeof (magic), fp);
+    fclose (fp);
+
+    *format = ptm_find_input_format (magic, size);
+    if (*format == NULL)
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "%s: unsupported file format", path);
+    if ((*format)->probe (ctx, path, color_space, info))
+        return ptm_set_error (ctx, PTM_ERROR_FORMAT, "%s: can't read %s header", path, (*format)->name);
+    return 0;
+}
+
+int ptm_transform_is_identity (const ptm_transform_t *transform) {
+    return transform->crop_width == 0 && transform->crop_height == 0 &&
+        transform->shrink <= 1 && transform->rotate == 0;
+}
+
+int ptm_transform_info (const ptm_transform_t *transform, const ptm_input_info_t *in,
+                        ptm_input_info_t *out) {
+    *out = *in;
+    size_t width  = in->width;
+    size_t height = in->height;
+    if (transform->crop_width || transform->crop_height) {
+        if (transform->crop_x + transform->crop_width  > in->width ||
+            transform->crop_y + transform->crop_height > in->height)
+            return -1;
+        width  = transform->crop_width;
+        height = transform->crop_height;
+    }
+    if (transform->shrink > 1) {
+        width  /= transform->shrink;
+        height /= transform->shrink;
+    }
+    if (width == 0 || height == 0)
+        return -1;
+    if (transform->rotate == 90 || transform->rotate == 270) {
+        out->width  = height;
+        out->height = width;
+    } else {
+        out->width  = width;
+        out->height = height;
+    }
+    return 0;
+}
+
+unsigned int ptm_transform_prescale (const ptm_transform_t *transform, unsigned int max_scale_denom) {
+    const unsigned int shrink = transform->shrink > 1 ? transform->shrink : 1;
+    unsigned int denom = max_scale_denom;
+    while (denom > 1) {
+        if (shrink % denom == 0 &&
+            transform->crop_x % denom == 0 &&
+            transform->crop_y % denom == 0)
+            break;
+        denom /= 2;
+    }
+    return denom > 1 ? denom : 1;
+}
+
+void ptm_transform_prescaled_info (const ptm_input_info_t *in, unsigned int scale_denom,
+                                   ptm_input_info_t *out) {
+    // libjpeg rounds up
+    *out = *in;
+    out->width  = (in->width  + scale_denom - 1) / scale_denom;
+    out->height = (in->height + scale_denom - 1) / scale_denom;
+}
+
+void ptm_transform_image (const ptm_transform_t *transform, unsigned int scale_denom,
+                          const ptm_input_info_t *in, const void *src,
+                          const ptm_input_info_t *out, void **rows) {
+    const size_t shrink = transform->shrink > 1 ? transform->shrink / scale_denom : 1;
+    const size_t x0     = transform->crop_x / scale_denom;
+    const size_t y0     = transform->crop_y / scale_denom;
+    const int components  = in->components;
+    const int sample_size = in->sample_size;
+    const size_t stride   = in->width * components;
+    const float norm      = 1.0f / (shrink * shrink);
+
+    // the size of the shrunk but not yet rotated image
+    const int swap = (transform->rotate == 90 || transform->rotate == 270);
+    const size_t width  = swap ? out->height : out->width;
+    const size_t height = swap ? out->width  : out->height;
+
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            // where the pixel goes after rotation
+            size_t ox, oy;
+            switch (transform->rotate) {
+            case 90:  ox = height - 1 - y; oy = x;              break;
+            case 180: ox = width - 1 - x;  oy = height - 1 - y; break;
+            case 270: ox = y;              oy = width - 1 - x;  break;
+            default:  ox = x;              oy = y;              break;
+            }
+            for (int c = 0; c < components; ++c) {
+                // box filter
+                float sum = 0.0f;
+                for (size_t j = 0; j < shrink; ++j) {
+                    const size_t row = (y0 + y * shrink + j) * stride;
+                    for (size_t i = 0; i < shrink; ++i) {
+                        sum += get_sample (src, row + (x0 + x * shrink + i) * components + c, sample_size);
+                    }
+                }
+                put_sample (rows[oy], ox * components + c, sample_size, sum * norm);
+            }
+        }
+    }
+}
+
+void ptm_transform_point (const ptm_transform_t *transform, const ptm_input_info_t *in,
+                          float *x, float *y) {
+    float w = in->width;
+    float h = in->height;
+    if (transform->crop_width || transform->crop_height) {
+        *x -= transform->crop_x;
+        *y -= transform->crop_y;
+        w = transform->crop_width;
+        h = transform->crop_height;
+    }
+    if (transform->shrink > 1) {
+        *x /= transform->shrink;
+        *y /= transform->shrink;
+        w = floorf (w / transform->shrink);
+        h = floorf (h / transform->shrink);
+    }
+    const float px = *x;
+    const float py = *y;
+    switch (transform->rotate) {
+    case 90:  *x = h - py; *y = px;     break;
+    case 180: *x = w - px; *y = h - py; break;
+    case 270: *x = py;     *y = w - px; break;
+    }
+}
+
+float *ptm_flat_field (const ptm_input_info_t *info, J_COLOR_SPACE color_space, const void *image) {
+    const size_t pixels = info->width * info->height;
+    const int c = info->components;
+    float *flat = malloc (pixels * sizeof (float));
+    if (flat == NULL)
+        return NULL;
+
+    /* First store the brightness of each pixel. */
+    double sum = 0.0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < pixels; ++i) {
+        float r, g, b;
+        if (info->sample_size == 2) {
+            const uint16_t *p = (const uint16_t *) image + i * c;
+            r = p[0]; g = p[c > 1 ? 1 : 0]; b = p[c > 2 ? 2 : 0];
+        } else {
+            const JSAMPLE *p = (const JSAMPLE *) image + i * c;
+            r = p[0]; g = p[c > 1 ? 1 : 0]; b = p[c > 2 ? 2 : 0];
+        }
+        flat[i] = (color_space == JCS_RGB) ? 0.299f * r + 0.587f * g + 0.114f * b : r;
+        sum += flat[i];
+    }
+
+    const float mean = sum / pixels;
+    const float min  = mean / PTM_FLAT_FIELD_MAX;
+    #pragma omp simd
+    for (size_t i = 0; i < pixels; ++i) {
+        flat[i] = mean / fmaxf (flat[i], min);
+    }
+    return flat;
+}
+
+void ptm_transform_light (const ptm_transform_t *transform, decoder_t *decoder) {
+    // u points right and v points up in the image
+    const float u = decoder->u;
+    const float v = decoder->v;
+    switch (transform->rotate) {
+    case 90:  decoder->u =  v; decoder->v = -u; break;
+    case 180: decoder->u = -u; decoder->v = -v; break;
+    case 270: decoder->u = -v; decoder->v =  u; break;
+    }
+}
+
+double ptm_wall_time (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double ptm_cpu_time (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+size_t ptm_peak_rss (void) {
+    struct rusage usage;
+    if (getrusage (RUSAGE_SELF, &usage))
+        return 0;
+    return (size_t) usage.ru_maxrss * 1024; // linux reports kilobytes
+}
+
+void ptm_stats_init (ptm_stats_t *stats) {
+    memset (stats, 0, sizeof (ptm_stats_t));
+    stats->wall_start = stats->wall_end = stats->stage_wall = ptm_wall_time ();
+    stats->stage_cpu  = ptm_cpu_time ();
+}
+
+void ptm_stats_start (ptm_stats_t *stats) {
+    stats->stage_wall = ptm_wall_time ();
+    stats->stage_cpu  = ptm_cpu_time ();
+}
+
+ptm_stage_t *ptm_stats_stop (ptm_stats_t *stats, const char *name) {
+    double wall = ptm_wall_time ();
+    double cpu  = ptm_cpu_time ();
+    stats->wall_end = wall;
+
+    ptm_stage_t *stage = NULL;
+    if (stats->n_stages < PTM_MAX_STAGES) {
+        stage = &stats->stages[stats->n_stages++];
+        memset (stage, 0, sizeof (ptm_stage_t));
+        stage->name = name;
+        stage->wall = wall - stats->stage_wall;
+        stage->cpu  = cpu  - stats->stage_cpu;
+    }
+
+    stats->stage_wall = wall;
+    stats->stage_cpu  = cpu;
+    return stage;
+}
+
+void ptm_write_json_string (FILE *fp, const char *s) {
+    fputc ('"', fp);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf (fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf (fp, "\\u%04x", c);
+        else
+            fputc (c, fp);
+    }
+    fputc ('"', fp);
+}
+
+void ptm_stats_write_json (FILE *fp, const ptm_stats_t *stats) {
+    double cpu = 0.0;
+    size_t bytes_read = 0;
+    size_t bytes_written = 0;
+    for (int i = 0; i < stats->n_stages; ++i) {
+        cpu           += stats->stages[i].cpu;
+        bytes_read    += stats->stages[i].bytes_read;
+        bytes_written += stats->stages[i].bytes_written;
+    }
+
+    fprintf (fp, "{\"wall_s\": %.6f, ", stats->wall_end - stats->wall_start);
+    if (!stats->shared_cpu)
+        fprintf (fp, "\"cpu_s\": %.6f, ", cpu);
+    fprintf (fp, "\"bytes_read\": %zu, \"bytes_written\": %zu, ", bytes_read, bytes_written);
+    fprintf (fp, "\"peak_rss\": %zu, \"stages\": [", ptm_peak_rss ());
+    for (int i = 0; i < stats->n_stages; ++i) {
+        const ptm_stage_t *stage = &stats->stages[i];
+        fprintf (fp, "%s{\"name\": ", i ? ", " : "");
+        ptm_write_json_string (fp, stage->name);
+        fprintf (fp, ", \"wall_s\": %.6f", stage->wall);
+        if (!stats->shared_cpu)
+            fprintf (fp, ", \"cpu_s\": %.6f", stage->cpu);
+        if (stage->bytes_read)
+            fprintf (fp, ", \"bytes_read\": %zu", stage->bytes_read);
+        if (stage->bytes_written)
+            fprintf (fp, ", \"bytes_written\": %zu", stage->bytes_written);
+        if (stage->mpixel_lights > 0.0 && stage->wall > 0.0)
+            fprintf (fp, ", \"mpixel_lights_per_s\": %.3f", stage->mpixel_lights / stage->wall);
+        fprintf (fp, "}");
+    }
+    fprintf (fp, "]}");
+}
+
+/** The size of one read() when reading whole files. */
+#define READ_CHUNK_SIZE (4 * 1024 * 1024)
+
+int ptm_read_file (const char *path, unsigned char **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+
+    int fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+
+    struct stat st;
+    if (fstat (fd, &st) != 0) {
+        int err = errno;
+        close (fd);
+        return err;
+    }
+
+    // let the kernel fetch the whole file while we are busy with the first
+    // chunks
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    size_t capacity = st.st_size > 0 ? st.st_size : READ_CHUNK_SIZE;
+    unsigned char *buf = malloc (capacity);
+    size_t len = 0;
+    int err = 0;
+    while (buf != NULL) {
+        if (len == capacity) {
+            // file grew or has no size (eg. a pipe)
+            capacity *= 2;
+            unsigned char *tmp = realloc (buf, capacity);
+            if (tmp == NULL)
+                break;
+            buf = tmp;
+        }
+        size_t chunk = capacity - len;
+        if (chunk > READ_CHUNK_SIZE)
+            chunk = READ_CHUNK_SIZE;
+        ssize_t n = read (fd, buf + len, chunk);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    close (fd);
+
+    if (buf == NULL)
+        return ENOMEM;
+    if (err) {
+        free (buf);
+        return err;
+    }
+    *data = buf;
+    *size = len;
+    return 0;
+}
+
+/** The state of one file in the prefetcher. */
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int error;   /**< errno value if the read failed */
+    int done;    /**< the read is finished (successfully or not) */
+} prefetch_file_t;
+
+struct ptm_prefetcher {
+    const char * const *paths;
+    prefetch_file_t *files;
+    int n_files;
+    int n_threads;
+    int window;
+    int next;       /**< The next file to read. */
+    int in_memory;  /**< The no. of files read or being read but not released. */
+    int stop;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t  can_read;  /**< Signalled when a file is released. */
+    pthread_cond_t  file_done; /**< Signalled when a file has been read. */
+};
+
+void *prefetch_thread (void *arg) {
+    ptm_prefetcher_t *pf = arg;
+
+    pthread_mutex_lock (&pf->mutex);
+    for (;;) {
+        while (!pf->stop && pf->next < pf->n_files && pf->in_memory >= pf->window)
+            pthread_cond_wait (&pf->can_read, &pf->mutex);
+        if (pf->stop || pf->next >= pf->n_files)
+            break;
+
+        int i = pf->next++;
+        ++pf->in_memory;
+        pthread_mutex_unlock (&pf->mutex);
+
+        unsigned char *data;
+        size_t size;
+        int err = ptm_read_file (pf->paths[i], &data, &size);
+
+        pthread_mutex_lock (&pf->mutex);
+        prefetch_file_t *file = &pf->files[i];
+        file->data  = data;
+        file->size  = size;
+        file->error = err;
+        file->done  = 1;
+        pthread_cond_broadcast (&pf->file_done);
+    }
+    pthread_mutex_unlock (&pf->mutex);
+    return NULL;
+}
+
+ptm_prefetcher_t *ptm_prefetch_start (const char * const *paths, int n_files, int n_threads, int window) {
+    ptm_prefetcher_t *pf = calloc (1, sizeof (ptm_prefetcher_t));
+    pf->paths     = paths;
+    pf->files     = calloc (n_files, sizeof (prefetch_file_t));
+    pf->n_files   = n_files;
+    pf->n_threads = n_threads > 0 ? n_threads : 1;
+    pf->window    = window > 0 ? window : 1;
+    pf->threads   = calloc (pf->n_threads, sizeof (pthread_t));
+    pthread_mutex_init (&pf->mutex, NULL);
+    pthread_cond_init (&pf->can_read, NULL);
+    pthread_cond_init (&pf->file_done, NULL);
+
+    for (int i = 0; i < pf->n_threads; ++i) {
+        pthread_create (&pf->threads[i], NULL, prefetch_thread, pf);
+    }
+    return pf;
+}
+
+int ptm_prefetch_get (ptm_prefetcher_t *pf, int i, const unsigned char **data, size_t *size) {
+    pthread_mutex_lock (&pf->mutex);
+    prefetch_file_t *file = &pf->files[i];
+    while (!file->done)
+        pthread_cond_wait (&pf->file_done, &pf->mutex);
+    *data = file->data;
+    *size = file->size;
+    int err = file->error;
+    pthread_mutex_unlock (&pf->mutex);
+    return err;
+}
+
+void ptm_prefetch_release (ptm_prefetcher_t *pf, int i) {
+    pthread_mutex_lock (&pf->mutex);
+    prefetch_file_t *file = &pf->files[i];
+    free (file->data);
+    file->data = NULL;
+    file->size = 0;
+    --pf->in_memory;
+    pthread_cond_signal (&pf->can_read);
+    pthread_mutex_unlock (&pf->mutex);
+}
+
+void ptm_prefetch_stop (ptm_prefetcher_t *pf) {
+    pthread_mutex_lock (&pf->mutex);
+    pf->stop = 1;
+    pthread_cond_broadcast (&pf->can_read);
+    pthread_mutex_unlock (&pf->mutex);
+
+    for (int i = 0; i < pf->n_threads; ++i) {
+        pthread_join (pf->threads[i], NULL);
+    }
+    for (int i = 0; i < pf->n_files; ++i) {
+        free (pf->files[i].data);
+    }
+    pthread_cond_destroy (&pf->file_done);
+    pthread_cond_destroy (&pf->can_read);
+    pthread_mutex_destroy (&pf->mutex);
+    free (pf->threads);
+    free (pf->files);
+    free (pf);
+}
+
+/** The alignment of the allocations from an arena: one cache line. */
+#define ARENA_ALIGN     64
+
+/** Arena chunks are mapped in multiples of a (transparent) huge page. */
+#define ARENA_PAGE      (2 * 1024 * 1024)
+
+/** The smallest arena chunk. */
+#define ARENA_MIN_CHUNK (16 * ARENA_PAGE)
+
+/** One mapping of an arena.  The header sits at the start of the mapping. */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;   /**< the size of the mapping */
+    size_t used;   /**< the bytes used, including this header */
+} arena_chunk_t;
+
+/** The size of the chunk header, rounded up to keep the allocations aligned. */
+#define ARENA_HEADER    ((sizeof (arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct ptm_arena {
+    arena_chunk_t *chunks;  /**< the chunk being filled first */
+    size_t mapped;          /**< the size of all chunks */
+    size_t hint;            /**< the size of the chunk to map after a reset */
+    pthread_mutex_t mutex;
+};
+
+/**
+ * Map a chunk of at least size bytes.
+ *
+ * Tries explicit huge pages first, then asks for transparent huge pages.
+ * The pages are not touched here, so they are placed on the NUMA node of the
+ * thread that first writes to them.
+ */
+arena_chunk_t *arena_map_chunk (size_t size) {
+    size = (size + ARENA_PAGE - 1) & ~(size_t) (ARENA_PAGE - 1);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+        p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise (p, size, MADV_HUGEPAGE);
+#endif
+    }
+    arena_chunk_t *chunk = p;
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = ARENA_HEADER;
+    return chunk;
+}
+
+ptm_arena_t *ptm_arena_create () {
+    ptm_arena_t *arena = calloc (1, sizeof (ptm_arena_t));
+    if (arena)
+        pthread_mutex_init (&arena->mutex, NULL);
+    return arena;
+}
+
+void *ptm_arena_alloc (ptm_arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    void *p = NULL;
+
+    pthread_mutex_lock (&arena->mutex);
+    arena_chunk_t *chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // grow geometrically to keep the no. of chunks small
+        size_t want = ARENA_HEADER + size;
+        if (want < arena->hint)
+            want = arena->hint;
+        if (want < arena->mapped)
+            want = arena->mapped;
+        if (want < ARENA_MIN_CHUNK)
+            want = ARENA_MIN_CHUNK;
+        arena->hint = 0;
+        chunk = arena_map_chunk (want);
+        if (chunk) {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+            arena->mapped += chunk->size;
+        }
+    }
+    if (chunk) {
+        p = (unsigned char *) chunk + chunk->used;
+        chunk->used += size;
+    }
+    pthread_mutex_unlock (&arena->mutex);
+    return p;
+}
+
+void ptm_arena_reset (ptm_arena_t *arena) {
+    pthread_mutex_lock (&arena->mutex);
+    if (arena->chunks && arena->chunks->next) {
+        // Replace the chunks with one big enough for all of them.  It will
+        // be mapped by the next allocation.
+        arena->hint = arena->mapped;
+        while (arena->chunks) {
+            arena_chunk_t *next = arena->chunks->next;
+            munmap (arena->chunks, arena->chunks->size);
+            arena->chunks = next;
+        }
+        arena->mapped = 0;
+    } else if (arena->chunks) {
+        arena->chunks->used = ARENA_HEADER;
+    }
+    pthread_mutex_unlock (&arena->mutex);
+}
+
+void ptm_arena_destroy (ptm_arena_t *arena) {
+    if (arena == NULL)
+        return;
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        munmap (arena->chunks, arena->chunks->size);
+        arena->chunks = next;
+    }
+    pthread_mutex_destroy (&arena->mutex);
+    free (arena);
+}
+
+void ptm_first_touch (void *buffer, size_t n_images, size_t height, size_t row_size) {
+    unsigned char *p = buffer;
+
+    // the same static partition of the rows as in the fitting loops
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t n = 0; n < n_images; ++n) {
+            memset (p + (n * height + y) * row_size, 0, row_size);
+        }
+    }
+}
+
+/**
+ * Compute the pseudo-inverse of the n_lights by n_coeffs matrix A.
+ *
+ * @returns An n_coeffs by n_lights matrix of floats or NULL.
+ */
+float *pseudo_inverse (float *A, lapack_int n_lights, lapack_int n_coeffs) {
     float *U  = calloc (n_lights * n_coeffs, sizeof (float));
     float *S  = calloc (n_coeffs * n_coeffs, sizeof (float));
     float *V  = calloc (n_coeffs * n_coeffs, sizeof (float));
     float *Sv = calloc (n_coeffs,            sizeof (float));
+    float *M  = NULL;
+
+    /* 'S' = do a thin SVG */
+    lapack_int info;
+    info = LAPACKE_sgesdd (LAPACK_ROW_MAJOR, 'S', n_lights, n_coeffs,
+                           A, n_coeffs,
+                           Sv,
+                           U, n_coeffs,
+                           V, n_coeffs);
+    if (info == 0) {
+        // ptm_print_matrix ("U", U,  n_lights, n_coeffs);
+        // ptm_print_matrix ("S", Sv, 1, n_coeffs);
+        // ptm_print_matrix ("V", V,  n_coeffs, n_coeffs);
+
+        for (int i = 0; i < n_coeffs; ++i) {
+            S[i * n_coeffs + i] = 1.0f / Sv[i];
+        }
+
+        /* M = V * diag (1 ./ diag (S)) * U' */
+        float *M1 = calloc (n_coeffs * n_coeffs, sizeof (float));
+        M = calloc (n_coeffs * n_lights, sizeof (float));
+        cblas_sgemm (CblasRowMajor, CblasTrans, CblasNoTrans, n_coeffs, n_coeffs, n_coeffs,
+                     1.0, V, n_coeffs,
+                     S, n_coeffs,
+                     0.0, M1, n_coeffs);
+        cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasTrans, n_coeffs, n_lights, n_coeffs,
+                     1.0, M1, n_coeffs,
+                     U, n_coeffs,
+                     0.0, M, n_lights);
+        free (M1);
+
+        // ptm_print_matrix ("M", M, n_coeffs, n_lights);
+    }
+
+    free (U);
+    free (S);
+    free (V);
+    free (Sv);
+    return M;
+}
+
+/**
+ * Compute the pseudo-inverse of the PTM polynomial for the given lights.
+ */
+float *svd_uv (const float *us, const float *vs, int n_decoders) {
+    ptm_unscaled_coefficients_t *A = calloc (n_decoders, sizeof (ptm_unscaled_coefficients_t));
 
     ptm_unscaled_coefficients_t *a = A;
-    for (int i = 0; i < n_lights; ++i, ++a) {
-        const decoder_t *decoder = decoders[i];
-        float u = decoder->u;
-        float v = decoder->v;
+    for (int i = 0; i < n_decoders; ++i, ++a) {
+        float u = us[i];
+        float v = vs[i];
         a->cu2 = u * u;
         a->cv2 = v * v;
         a->cuv = u * v;
@@ -650,49 +3653,216 @@ float *ptm_svd (decoder_t **decoders, int n_decoders) {
         a->c1 = 1.0;
     }
 
-    // ptm_print_matrix ("A", (float *) A, n_lights, n_coeffs);
+    // ptm_print_matrix ("A", (float *) A, n_decoders, PTM_COEFFICIENTS);
 
-    /* 'S' = do a thin SVG */
-    lapack_int info;
-    info = LAPACKE_sgesdd (LAPACK_ROW_MAJOR, 'S', n_lights, n_coeffs,
-                           (float *) A, n_coeffs,
-                           Sv,
-                           U, n_coeffs,
-                           V, n_coeffs);
-    if (info > 0) {
+    float *M = pseudo_inverse ((float *) A, n_decoders, PTM_COEFFICIENTS);
+    free (A);
+    return M;
+}
+
+float *ptm_svd (decoder_t **decoders, int n_decoders) {
+    float *us = malloc (n_decoders * sizeof (float));
+    float *vs = malloc (n_decoders * sizeof (float));
+    for (int i = 0; i < n_decoders; ++i) {
+        us[i] = decoders[i]->u;
+        vs[i] = decoders[i]->v;
+    }
+    float *M = svd_uv (us, vs, n_decoders);
+    free (us);
+    free (vs);
+    return M;
+}
+
+float *ptm_svd_near_field (decoder_t **decoders, int n_decoders,
+                           const ptm_near_field_t *near_field, size_t width, size_t height) {
+    const size_t tile_size   = near_field->tile_size;
+    const size_t tiles_x     = (width  + tile_size - 1) / tile_size;
+    const size_t tiles_y     = (height + tile_size - 1) / tile_size;
+    const size_t matrix_size = PTM_COEFFICIENTS * n_decoders;
+    float *Ms = malloc (tiles_x * tiles_y * matrix_size * sizeof (float));
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t t = 0; t < tiles_x * tiles_y; ++t) {
+        const size_t tx = t % tiles_x;
+        const size_t ty = t / tiles_x;
+        // the center of the tile relative to the center of the dome, the
+        // tiles count from the bottom row like the image buffer
+        const size_t tile_w = (tx + 1) * tile_size > width  ? width  - tx * tile_size : tile_size;
+        const size_t tile_h = (ty + 1) * tile_size > height ? height - ty * tile_size : tile_size;
+        const float x = tx * tile_size + tile_w / 2.0f - near_field->center_x;
+        const float y = near_field->center_y - (height - (ty * tile_size + tile_h / 2.0f));
+
+        float *us = malloc (n_decoders * sizeof (float));
+        float *vs = malloc (n_decoders * sizeof (float));
+        for (int i = 0; i < n_decoders; ++i) {
+            // the vector from the point to the LED, v points up
+            const decoder_t *decoder = decoders[i];
+            const float r  = near_field->radius;
+            const float lu = r * decoder->u - x;
+            const float lv = r * decoder->v - y;
+            const float lw = r * sqrtf (fmaxf (0.0f, 1.0f - decoder->u * decoder->u - decoder->v * decoder->v));
+            const float norm = sqrtf (lu * lu + lv * lv + lw * lw);
+            us[i] = lu / norm;
+            vs[i] = lv / norm;
+        }
+        float *M = svd_uv (us, vs, n_decoders);
+        if (M) {
+            memcpy (Ms + t * matrix_size, M, matrix_size * sizeof (float));
+        } else {
+            #pragma omp atomic write
+            failed = 1;
+        }
+        free (M);
+        free (us);
+        free (vs);
+    }
+
+    if (failed) {
+        free (Ms);
         return NULL;
     }
+    return Ms;
+}
+
+float *ptm_svd_lambert (decoder_t **decoders, int n_decoders) {
+    float *A = calloc (n_decoders * LAMBERT_COEFFICIENTS, sizeof (float));
+
+    float *a = A;
+    for (int i = 0; i < n_decoders; ++i) {
+        const decoder_t *decoder = decoders[i];
+        float u = decoder->u;
+        float v = decoder->v;
+        // w is optional in the .lp file
+        *a++ = u;
+        *a++ = v;
+        *a++ = sqrtf (fmaxf (0.0f, 1.0f - u * u - v * v));
+    }
+
+    float *M = pseudo_inverse (A, n_decoders, LAMBERT_COEFFICIENTS);
+    free (A);
+    return M;
+}
 
-    // ptm_print_matrix ("U", U,  n_lights, n_coeffs);
-    // ptm_print_matrix ("S", Sv, 1, n_coeffs);
-    // ptm_print_matrix ("V", V,  n_coeffs, n_coeffs);
+uint64_t ptm_fnv1a (uint64_t hash, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    for (int i = 0; i < n_coeffs; ++i) {
-        S[i * n_coeffs + i] = 1.0f / Sv[i];
+uint64_t ptm_light_hash (decoder_t **decoders, int n_decoders, ptm_basis_enum_t basis) {
+    uint64_t hash = PTM_FNV1A_INIT;
+    int b = basis;
+    hash = ptm_fnv1a (hash, &b, sizeof (b));
+    hash = ptm_fnv1a (hash, &n_decoders, sizeof (n_decoders));
+    for (int i = 0; i < n_decoders; ++i) {
+        // the SVD only looks at u and v
+        hash = ptm_fnv1a (hash, &decoders[i]->u, sizeof (float));
+        hash = ptm_fnv1a (hash, &decoders[i]->v, sizeof (float));
     }
+    return hash;
+}
 
-    /* M = V * diag (1 ./ diag (S)) * U' */
-    float *M1 = calloc (n_coeffs * n_coeffs, sizeof (float));
-    float *M  = calloc (n_coeffs * n_lights, sizeof (float));
-    cblas_sgemm (CblasRowMajor, CblasTrans, CblasNoTrans, n_coeffs, n_coeffs, n_coeffs,
-                 1.0, V, n_coeffs,
-                 S, n_coeffs,
-                 0.0, M1, n_coeffs);
-    cblas_sgemm (CblasRowMajor, CblasNoTrans, CblasTrans, n_coeffs, n_lights, n_coeffs,
-                 1.0, M1, n_coeffs,
-                 U, n_coeffs,
-                 0.0, M, n_lights);
+/** The header of a cached matrix file. */
+typedef struct {
+    char     magic[4];  /**< "PTMM" */
+    uint32_t version;   /**< The file version, currently 1. */
+    uint32_t m;         /**< The no. of rows. */
+    uint32_t n;         /**< The no. of columns. */
+    uint64_t key;       /**< The key, repeated to detect a truncated, corrupt
+                             or misnamed file.  Two light sets with the
+                             same hash share the file. */
+} cache_header_t;
+
+char *cache_path (const char *cache_dir, uint64_t key, const char *suffix) {
+    size_t len = strlen (cache_dir) + 32 + strlen (suffix);
+    char *path = malloc (len);
+    snprintf (path, len, "%s/%016llx%s", cache_dir, (unsigned long long) key, suffix);
+    return path;
+}
 
-    // ptm_print_matrix ("M", M, n_coeffs, n_lights);
+float *ptm_cache_read_matrix (const char *cache_dir, uint64_t key, int m, int n) {
+    char *path = cache_path (cache_dir, key, ".mat");
+    FILE *fp = fopen (path, "rb");
+    free (path);
+    if (fp == NULL)
+        return NULL;
 
+    cache_header_t header;
+    float *M = NULL;
+    if (fread (&header, sizeof (header), 1, fp) == 1 &&
+        !memcmp (header.magic, "PTMM", 4) &&
+        header.version == 1 &&
+        header.m == (uint32_t) m &&
+        header.n == (uint32_t) n &&
+        header.key == key) {
+
+        M = malloc (m * n * sizeof (float));
+        if (fread (M, sizeof (float), m * n, fp) != (size_t) (m * n)) {
+            free (M);
+            M = NULL;
+        }
+    }
+    fclose (fp);
     return M;
 }
 
+int ptm_cache_write_matrix (const char *cache_dir, uint64_t key, const float *M, int m, int n) {
+    if (mkdir (cache_dir, 0777) != 0 && errno != EEXIST)
+        return -1;
+
+    char suffix[32];
+    snprintf (suffix, sizeof (suffix), ".tmp%ld", (long) getpid ());
+    char *tmp_path = cache_path (cache_dir, key, suffix);
+    char *path     = cache_path (cache_dir, key, ".mat");
+
+    cache_header_t header;
+    memcpy (header.magic, "PTMM", 4);
+    header.version = 1;
+    header.m = m;
+    header.n = n;
+    header.key = key;
+
+    int ret = -1;
+    FILE *fp = fopen (tmp_path, "wb");
+    if (fp != NULL) {
+        int ok = fwrite (&header, sizeof (header), 1, fp) == 1 &&
+            fwrite (M, sizeof (float), m * n, fp) == (size_t) (m * n);
+        if (fclose (fp) == 0 && ok && rename (tmp_path, path) == 0)
+            ret = 0;
+        else
+            remove (tmp_path);
+    }
+    free (tmp_path);
+    free (path);
+    return ret;
+}
+
+
+/** Apply the brightness calibration to the samples of pixel i in all images. */
+static inline void calibrate_samples (const ptm_calibration_t *calibration, size_t n_images, size_t i,
+                                      float *b) {
+    for (size_t n = 0; n < n_images; ++n) {
+        const float *flat = calibration->flat_fields ? calibration->flat_fields[n] : NULL;
+        b[n] *= flat ? calibration->gains[n] * flat[i] : calibration->gains[n];
+    }
+}
+
+/** The fitting matrix for a pixel: the global one or the one of its tile. */
+static inline const float *matrix_at (const float *M, size_t tile_size, size_t tiles_x,
+                                      size_t matrix_size, size_t x, size_t y) {
+    return tile_size ? M + ((y / tile_size) * tiles_x + x / tile_size) * matrix_size : M;
+}
 
 void ptm_fit_poly_jsample (const ptm_image_info_t *info,
                            const JSAMPLE *buffer,
                            size_t pixel_stride,
                            const float *M,
+                           size_t tile_size,
+                           const ptm_calibration_t *calibration,
                            ptm_unscaled_coefficients_t *output) {
 
     // buffer = JSAMPLE[image][y][x][rgb]
@@ -701,104 +3871,551 @@ void ptm_fit_poly_jsample (const ptm_image_info_t *info,
     const size_t row_stride   = info->width  * pixel_stride;
     const size_t image_stride = info->height * row_stride;
 
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t y = 0; y < info->height; ++y) {
-        ptm_unscaled_coefficients_t *bl = output + (y * info->width);
-        float *b = calloc (info->n_decoders, sizeof (float)); // vector of samples as floats
-
-        for (size_t x = 0; x < info->width; ++x) {
-            const JSAMPLE *buf = buffer + (y * row_stride) + (x * pixel_stride);
-            // copy vector b into floats
-            for (size_t n = 0; n < info->n_decoders; ++n) {
-                b[n] = (float) *buf;
-                buf += image_stride;
-            }
-            // X = M * b
-            cblas_sgemv (CblasRowMajor, CblasNoTrans, PTM_COEFFICIENTS, info->n_decoders,
-                         1.0, M, info->n_decoders,
-                         b, 1,
-                         0.0, (float *) bl, 1);
-            ++bl;
+    const size_t tiles_x     = tile_size ? (info->width + tile_size - 1) / tile_size : 0;
+    const size_t matrix_size = PTM_COEFFICIENTS * info->n_decoders;
+
+    #pragma omp parallel
+    {
+        float *b = malloc (info->n_decoders * sizeof (float)); // vector of samples as floats
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            ptm_unscaled_coefficients_t *bl = output + (y * info->width);
+
+            for (size_t x = 0; x < info->width; ++x) {
+                const JSAMPLE *buf = buffer + (y * row_stride) + (x * pixel_stride);
+                // copy vector b into floats
+                for (size_t n = 0; n < info->n_decoders; ++n) {
+                    b[n] = (float) *buf;
+                    buf += image_stride;
+                }
+                if (calibration)
+                    calibrate_samples (calibration, info->n_decoders, y * info->width + x, b);
+                // X = M * b
+                cblas_sgemv (CblasRowMajor, CblasNoTrans, PTM_COEFFICIENTS, info->n_decoders,
+                             1.0, matrix_at (M, tile_size, tiles_x, matrix_size, x, y), info->n_decoders,
+                             b, 1,
+                             0.0, (float *) bl, 1);
+                ++bl;
+            }
         }
         free (b);
     }
 }
 
-void ptm_fit_poly_uint (const ptm_image_info_t *info,
-                        const unsigned int *buffer,
-                        size_t pixel_stride,
-                        const float *M,
-                        ptm_unscaled_coefficients_t *output) {
+void ptm_fit_poly_u16 (const ptm_image_info_t *info,
+                       const uint16_t *buffer,
+                       size_t pixel_stride,
+                       const float *M,
+                       size_t tile_size,
+                       const ptm_calibration_t *calibration,
+                       ptm_unscaled_coefficients_t *output) {
 
-    // buffer = JSAMPLE[image][y][x][L]
+    // buffer = uint16_t[image][y][x][rgb]
     // output = float[y][x][cu²..c1]
 
     const size_t row_stride   = info->width  * pixel_stride;
     const size_t image_stride = info->height * row_stride;
 
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t y = 0; y < info->height; ++y) {
-        ptm_unscaled_coefficients_t *bl = output + (y * info->width);
-        float *b = calloc (info->n_decoders, sizeof (float)); // vector of samples
-
-        for (size_t x = 0; x < info->width; ++x) {
-            const unsigned int *buf = buffer + (y * row_stride) + (x * pixel_stride);
-            // copy vector b into floats
-            for (size_t n = 0; n < info->n_decoders; ++n) {
-                b[n] = (float) *buf;
-                buf += image_stride;
-            }
-            // X = M * b
-            cblas_sgemv (CblasRowMajor, CblasNoTrans, PTM_COEFFICIENTS, info->n_decoders,
-                         1.0, M, info->n_decoders,
-                         b, 1,
-                         0.0, (float *) bl, 1);
-            ++bl;
+    // scale 16 bit samples down to the 8 bit range
+    const float scale = 255.0f / 65535.0f;
+
+    const size_t tiles_x     = tile_size ? (info->width + tile_size - 1) / tile_size : 0;
+    const size_t matrix_size = PTM_COEFFICIENTS * info->n_decoders;
+
+    #pragma omp parallel
+    {
+        float *b = malloc (info->n_decoders * sizeof (float)); // vector of samples as floats
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            ptm_unscaled_coefficients_t *bl = output + (y * info->width);
+
+            for (size_t x = 0; x < info->width; ++x) {
+                const uint16_t *buf = buffer + (y * row_stride) + (x * pixel_stride);
+                // copy vector b into floats
+                for (size_t n = 0; n < info->n_decoders; ++n) {
+                    b[n] = scale * *buf;
+                    buf += image_stride;
+                }
+                if (calibration)
+                    calibrate_samples (calibration, info->n_decoders, y * info->width + x, b);
+                // X = M * b
+                cblas_sgemv (CblasRowMajor, CblasNoTrans, PTM_COEFFICIENTS, info->n_decoders,
+                             1.0, matrix_at (M, tile_size, tiles_x, matrix_size, x, y), info->n_decoders,
+                             b, 1,
+                             0.0, (float *) bl, 1);
+                ++bl;
+            }
         }
         free (b);
     }
 }
 
+void ptm_fit_lambert (const ptm_image_info_t *info,
+                      const void *buffer,
+                      const float *M,
+                      const ptm_calibration_t *calibration,
+                      JSAMPLE *normals,
+                      JSAMPLE *albedo) {
+
+    // buffer = sample[image][y][x][rgb]
+    // M      = float[u,v,w][image]
+
+    const size_t row_samples = info->width * RGB_COEFFICIENTS;
+    const size_t n_lights    = info->n_decoders;
+
+    // scale 16 bit samples down to the 8 bit range
+    const float scale = info->sample_size == 2 ? 255.0f / 65535.0f : 1.0f;
+
+    #pragma omp parallel
+    {
+        // the albedo scaled normals, one row per component of the normal
+        float *g   = malloc (LAMBERT_COEFFICIENTS * row_samples * sizeof (float));
+        float *gu  = g;
+        float *gv  = g + row_samples;
+        float *gw  = g + 2 * row_samples;
+        float *row = malloc (row_samples * sizeof (float));
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            memset (g, 0, LAMBERT_COEFFICIENTS * row_samples * sizeof (float));
+
+            // the input images are stored bottom row first
+            const size_t offs = (info->height - 1 - y) * info->row_stride;
+            const size_t pixel = (info->height - 1 - y) * info->width;
+
+            // G = M * I, streaming one row of each image
+            for (size_t n = 0; n < n_lights; ++n) {
+                const size_t start = n * info->decoder_stride + offs;
+                if (info->sample_size == 2) {
+                    const uint16_t *src = (const uint16_t *) buffer + start;
+                    #pragma omp simd
+                    for (size_t i = 0; i < row_samples; ++i)
+                        row[i] = scale * src[i];
+                } else {
+                    const JSAMPLE *src = (const JSAMPLE *) buffer + start;
+                    #pragma omp simd
+                    for (size_t i = 0; i < row_samples; ++i)
+                        row[i] = src[i];
+                }
+                if (calibration) {
+                    const float gain = calibration->gains[n];
+                    const float *flat = calibration->flat_fields ? calibration->flat_fields[n] : NULL;
+                    #pragma omp simd
+                    for (size_t i = 0; i < row_samples; ++i)
+                        row[i] *= flat ? gain * flat[pixel + i / RGB_COEFFICIENTS] : gain;
+                }
+                const float mu = M[n];
+                const float mv = M[n_lights + n];
+                const float mw = M[2 * n_lights + n];
+                #pragma omp simd
+                for (size_t i = 0; i < row_samples; ++i) {
+                    gu[i] += mu * row[i];
+                    gv[i] += mv * row[i];
+                    gw[i] += mw * row[i];
+                }
+            }
+
+            const size_t out = y * row_samples;
+            #pragma omp simd
+            for (size_t x = 0; x < info->width; ++x) {
+                const size_t i = x * RGB_COEFFICIENTS;
+                // the normal from the luma
+                float nu = 0.299f * gu[i] + 0.587f * gu[i + 1] + 0.114f * gu[i + 2];
+                float nv = 0.299f * gv[i] + 0.587f * gv[i + 1] + 0.114f * gv[i + 2];
+                float nw = 0.299f * gw[i] + 0.587f * gw[i + 1] + 0.114f * gw[i + 2];
+                const float len = sqrtf (nu * nu + nv * nv + nw * nw);
+                // a black pixel has no normal, let it point up
+                const int valid = len > 1e-6f;
+                nu = valid ? nu / len : 0.0f;
+                nv = valid ? nv / len : 0.0f;
+                nw = valid ? nw / len : 1.0f;
+
+                if (normals) {
+                    normals[out + i]     = CLIP (128.0f + rintf (127.0f * nu));
+                    normals[out + i + 1] = CLIP (128.0f + rintf (127.0f * nv));
+                    normals[out + i + 2] = CLIP (128.0f + rintf (127.0f * nw));
+                }
+                if (albedo) {
+                    // project the albedo scaled normal of each channel on the normal
+                    for (int c = 0; c < RGB_COEFFICIENTS; ++c) {
+                        albedo[out + i + c] = CLIP (gu[i + c] * nu + gv[i + c] * nv + gw[i + c] * nw);
+                    }
+                }
+            }
+        }
+        free (row);
+        free (g);
+    }
+}
+
+/**
+ * Turn the YCbCr values of one pixel into LRGB.
+ *
+ * Converts the YCbCr values into RGB in place and fixes the polynome factors
+ * so that Y * R' ~ R.
+ */
+static inline void lrgb_from_ycbcr (ycbcr_coefficients_t *ycbcr, ptm_unscaled_coefficients_t *cfs) {
+    rgb_coefficients_t *rgb = (rgb_coefficients_t *) ycbcr;
+    float y  = ycbcr->y;
+    float cb = ycbcr->cb - CENTERJSAMPLE;
+    float cr = ycbcr->cr - CENTERJSAMPLE;
+    // See: https://github.com/libjpeg-turbo/libjpeg-turbo/blob/master/jdcolor.c
+    // See: https://en.wikipedia.org/wiki/YCbCr#JPEG_conversion
+    rgb->r = CLIP (y                 + 1.40200f * cr);
+    rgb->g = CLIP (y - 0.34414f * cb - 0.71414f * cr);
+    rgb->b = CLIP (y + 1.77200f * cb);
+
+    // finally fix the polynome factors so that Y * R' ~ R, a pixel that is
+    // black in all images would otherwise get infinite coefficients
+    float norm = 256.0f / fmaxf (y, 1.0f);
+    cfs->cu2 *= norm;
+    cfs->cv2 *= norm;
+    cfs->cuv *= norm;
+    cfs->cu  *= norm;
+    cfs->cv  *= norm;
+    cfs->c1  *= norm;
+}
+
+/** The most 8 bit samples we can add up in an uint16_t: 257 * 255 = 65535. */
+#define CBCR_MAX_U16_SUMS 257
+
 void ptm_cbcr_avg (const ptm_image_info_t *info,
                    const ycbcr_coefficients_t *buffer,
-                   ycbcr_coefficients_t *block) {
+                   ycbcr_coefficients_t *block,
+                   ptm_unscaled_coefficients_t *coeffs) {
+    const size_t n = info->n_decoders;
+    const size_t samples = info->width * 3;
+
+    #pragma omp parallel
+    {
+        // One row of sums.  If there are too many images for uint16_t we sum
+        // up to CBCR_MAX_U16_SUMS images at a time and carry over into total.
+        uint16_t *sums = malloc (samples * sizeof (uint16_t));
+        unsigned int *total = (n > CBCR_MAX_U16_SUMS) ? malloc (samples * sizeof (unsigned int)) : NULL;
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            if (total)
+                memset (total, 0, samples * sizeof (unsigned int));
+            for (size_t d0 = 0; d0 < n; d0 += CBCR_MAX_U16_SUMS) {
+                const size_t d1 = (d0 + CBCR_MAX_U16_SUMS < n) ? d0 + CBCR_MAX_U16_SUMS : n;
+                memset (sums, 0, samples * sizeof (uint16_t));
+                for (size_t d = d0; d < d1; ++d) {
+                    const JSAMPLE *row = (const JSAMPLE *) (buffer + (d * info->pixels) + (y * info->width));
+                    #pragma omp simd
+                    for (size_t i = 0; i < samples; ++i) {
+                        sums[i] += row[i];
+                    }
+                }
+                if (total) {
+                    #pragma omp simd
+                    for (size_t i = 0; i < samples; ++i) {
+                        total[i] += sums[i];
+                    }
+                }
+            }
 
-    typedef struct {
-        unsigned int y;
-        unsigned int cb;
-        unsigned int cr;
-    } cbcr_sums_t;
+            ycbcr_coefficients_t *bl = block + (y * info->width);
+            for (size_t i = 0; i < info->width; ++i) {
+                bl[i].y  = (total ? total[3 * i]     : sums[3 * i])     / n;
+                bl[i].cb = (total ? total[3 * i + 1] : sums[3 * i + 1]) / n;
+                bl[i].cr = (total ? total[3 * i + 2] : sums[3 * i + 2]) / n;
+                if (coeffs)
+                    lrgb_from_ycbcr (bl + i, coeffs + (y * info->width) + i);
+            }
+        }
+        free (total);
+        free (sums);
+    }
+}
 
-    cbcr_sums_t *sums = calloc (info->pixels, sizeof (cbcr_sums_t));
 
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t y = 0; y < info->height; ++y) {
-        for (size_t d = 0; d < info->n_decoders; ++d) {
-            const ycbcr_coefficients_t *row = buffer + (d * info->pixels) + (y * info->width);
-            cbcr_sums_t *s = sums + (y * info->width);
+void ptm_cbcr_avg_u16 (const ptm_image_info_t *info,
+                       const uint16_t *buffer,
+                       ycbcr_coefficients_t *block,
+                       ptm_unscaled_coefficients_t *coeffs) {
+    const size_t samples = info->width * 3;
+
+    // divide by the no. of images and by 257 to get from 16 to 8 bits
+    const unsigned int divisor = 257 * info->n_decoders;
+
+    #pragma omp parallel
+    {
+        unsigned int *sums = malloc (samples * sizeof (unsigned int));
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            memset (sums, 0, samples * sizeof (unsigned int));
+            for (size_t d = 0; d < info->n_decoders; ++d) {
+                const uint16_t *row = buffer + (d * info->decoder_stride) + (y * info->row_stride);
+                #pragma omp simd
+                for (size_t i = 0; i < samples; ++i) {
+                    sums[i] += row[i];
+                }
+            }
+
+            ycbcr_coefficients_t *bl = block + (y * info->width);
             for (size_t i = 0; i < info->width; ++i) {
-                s->y  += row->y;
-                s->cb += row->cb;
-                s->cr += row->cr;
-                ++row;
-                ++s;
+                bl[i].y  = sums[3 * i]     / divisor;
+                bl[i].cb = sums[3 * i + 1] / divisor;
+                bl[i].cr = sums[3 * i + 2] / divisor;
+                if (coeffs)
+                    lrgb_from_ycbcr (bl + i, coeffs + (y * info->width) + i);
             }
         }
+        free (sums);
     }
+}
 
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t y = 0; y < info->height; ++y) {
-        const cbcr_sums_t *s = sums + (y * info->width);
-        ycbcr_coefficients_t *bl = block + (y * info->width);
-        for (size_t i = 0; i < info->width; ++i) {
-            bl->y  = s->y  / info->n_decoders;
-            bl->cb = s->cb / info->n_decoders;
-            bl->cr = s->cr / info->n_decoders;
-            ++s;
-            ++bl;
+/** The no. of pixels ptm_cbcr_median() sorts at once. */
+#define CBCR_TILE 64
+
+/**
+ * Make the comparators of a sorting network for n values.
+ *
+ * Uses Batcher's odd-even merge sort for the next power of 2.  The values
+ * past n are taken to be larger than any value, so the comparators that touch
+ * them never swap and are left out.
+ *
+ * @param n     The no. of values.
+ * @param pairs [out] The indices of the comparators or NULL to just count them.
+ *
+ * @returns The no. of comparators.
+ */
+static int sorting_network (int n, int *pairs) {
+    int size = 1;
+    while (size < n)
+        size <<= 1;
+
+    int n_pairs = 0;
+    for (int p = 1; p < size; p <<= 1) {
+        for (int k = p; k >= 1; k >>= 1) {
+            for (int j = k % p; j + k < size; j += 2 * k) {
+                for (int i = 0; i < k && i + j + k < size; ++i) {
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < n) {
+                        if (pairs) {
+                            pairs[2 * n_pairs]     = i + j;
+                            pairs[2 * n_pairs + 1] = i + j + k;
+                        }
+                        ++n_pairs;
+                    }
+                }
+            }
+        }
+    }
+    return n_pairs;
+}
+
+void ptm_cbcr_median (const ptm_image_info_t *info,
+                      const void *buffer,
+                      ptm_chroma_enum_t method,
+                      ycbcr_coefficients_t *block,
+                      ptm_unscaled_coefficients_t *coeffs) {
+    const int n = info->n_decoders;
+    // with trim = (n - 1) / 2 the trimmed mean is the median
+    const int trim = (method == PTM_CHROMA_MEDIAN) ? (n - 1) / 2 : n / 4;
+    const int m = n - 2 * trim;
+    const size_t tiles_x = (info->width + CBCR_TILE - 1) / CBCR_TILE;
+
+    const int n_pairs = sorting_network (n, NULL);
+    int *pairs = malloc (2 * n_pairs * sizeof (int));
+    sorting_network (n, pairs);
+
+    #pragma omp parallel
+    {
+        // The values of CBCR_TILE pixels in all images, first by component,
+        // then by image.  The pixels are sorted side by side in SIMD lanes.
+        uint16_t *values = calloc (3 * n * CBCR_TILE, sizeof (uint16_t));
+
+        #pragma omp for schedule(static)
+        for (size_t t = 0; t < info->height * tiles_x; ++t) {
+            const size_t y  = t / tiles_x;
+            const size_t x0 = (t % tiles_x) * CBCR_TILE;
+            const size_t w  = (x0 + CBCR_TILE <= info->width) ? CBCR_TILE : info->width - x0;
+
+            for (int d = 0; d < n; ++d) {
+                const size_t offset = (d * info->decoder_stride) + (y * info->row_stride) + (x0 * 3);
+                uint16_t *v0 = values + (0 * n + d) * CBCR_TILE;
+                uint16_t *v1 = values + (1 * n + d) * CBCR_TILE;
+                uint16_t *v2 = values + (2 * n + d) * CBCR_TILE;
+                if (info->sample_size == 2) {
+                    const uint16_t *src = (const uint16_t *) buffer + offset;
+                    for (size_t i = 0; i < w; ++i) {
+                        v0[i] = src[3 * i];
+                        v1[i] = src[3 * i + 1];
+                        v2[i] = src[3 * i + 2];
+                    }
+                } else {
+                    const JSAMPLE *src = (const JSAMPLE *) buffer + offset;
+                    for (size_t i = 0; i < w; ++i) {
+                        v0[i] = src[3 * i];
+                        v1[i] = src[3 * i + 1];
+                        v2[i] = src[3 * i + 2];
+                    }
+                }
+            }
+
+            unsigned int sums[3][CBCR_TILE];
+            for (int c = 0; c < 3; ++c) {
+                uint16_t *v = values + c * n * CBCR_TILE;
+                for (int k = 0; k < n_pairs; ++k) {
+                    uint16_t *a = v + pairs[2 * k]     * CBCR_TILE;
+                    uint16_t *b = v + pairs[2 * k + 1] * CBCR_TILE;
+                    #pragma omp simd
+                    for (int i = 0; i < CBCR_TILE; ++i) {
+                        const uint16_t lo = a[i] < b[i] ? a[i] : b[i];
+                        const uint16_t hi = a[i] < b[i] ? b[i] : a[i];
+                        a[i] = lo;
+                        b[i] = hi;
+                    }
+                }
+                #pragma omp simd
+                for (int i = 0; i < CBCR_TILE; ++i)
+                    sums[c][i] = m / 2;
+                for (int d = trim; d < trim + m; ++d) {
+                    #pragma omp simd
+                    for (int i = 0; i < CBCR_TILE; ++i)
+                        sums[c][i] += v[d * CBCR_TILE + i];
+                }
+            }
+
+            // get from 16 to 8 bits like ptm_cbcr_avg_u16 ()
+            const unsigned int scale = (info->sample_size == 2) ? 257 : 1;
+            ycbcr_coefficients_t *bl = block + (y * info->width) + x0;
+            for (size_t i = 0; i < w; ++i) {
+                bl[i].y  = sums[0][i] / m / scale;
+                bl[i].cb = sums[1][i] / m / scale;
+                bl[i].cr = sums[2][i] / m / scale;
+                if (coeffs)
+                    lrgb_from_ycbcr (bl + i, coeffs + (y * info->width) + x0 + i);
+            }
+        }
+        free (values);
+    }
+    free (pairs);
+}
+
+void ptm_cbcr_calibrated (const ptm_image_info_t *info,
+                          const void *buffer,
+                          ptm_chroma_enum_t method,
+                          const ptm_calibration_t *calibration,
+                          ycbcr_coefficients_t *block,
+                          ptm_unscaled_coefficients_t *coeffs) {
+    const int n = info->n_decoders;
+    // the mean is the trimmed mean with nothing trimmed
+    const int trim = (method == PTM_CHROMA_MEAN) ? 0 :
+        (method == PTM_CHROMA_MEDIAN) ? (n - 1) / 2 : n / 4;
+    const int m = n - 2 * trim;
+    const size_t width = info->width;
+    // get from 16 to 8 bits like ptm_cbcr_avg_u16 ()
+    const float scale  = (info->sample_size == 2) ? 257.0f : 1.0f;
+    const float center = (info->sample_size == 2) ? 32768.0f : CENTERJSAMPLE;
+
+    const int n_pairs = trim ? sorting_network (n, NULL) : 0;
+    int *pairs = n_pairs ? malloc (2 * n_pairs * sizeof (int)) : NULL;
+    if (pairs)
+        sorting_network (n, pairs);
+
+    #pragma omp parallel
+    {
+        // The calibrated values of one row of all images, first by component,
+        // then by image.  The pixels of the row are sorted side by side in
+        // SIMD lanes.
+        float *values = malloc (3 * n * width * sizeof (float));
+        float *sums   = malloc (3 * width * sizeof (float));
+
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < info->height; ++y) {
+            for (int d = 0; d < n; ++d) {
+                const size_t offset = (d * info->decoder_stride) + (y * info->row_stride);
+                const float gain = calibration->gains[d];
+                const float *flat = calibration->flat_fields ? calibration->flat_fields[d] : NULL;
+                float *v0 = values + (0 * n + d) * width;
+                float *v1 = values + (1 * n + d) * width;
+                float *v2 = values + (2 * n + d) * width;
+                if (info->sample_size == 2) {
+                    const uint16_t *src = (const uint16_t *) buffer + offset;
+                    #pragma omp simd
+                    for (size_t x = 0; x < width; ++x) {
+                        v0[x] = src[3 * x];
+                        v1[x] = src[3 * x + 1];
+                        v2[x] = src[3 * x + 2];
+                    }
+                } else {
+                    const JSAMPLE *src = (const JSAMPLE *) buffer + offset;
+                    #pragma omp simd
+                    for (size_t x = 0; x < width; ++x) {
+                        v0[x] = src[3 * x];
+                        v1[x] = src[3 * x + 1];
+                        v2[x] = src[3 * x + 2];
+                    }
+                }
+                // scale the chroma around its center like the brightness,
+                // so that the saturation stays the same
+                if (flat)
+                    flat += y * width;
+                #pragma omp simd
+                for (size_t x = 0; x < width; ++x) {
+                    const float f = flat ? gain * flat[x] : gain;
+                    v0[x] *= f;
+                    v1[x] = center + f * (v1[x] - center);
+                    v2[x] = center + f * (v2[x] - center);
+                }
+            }
+
+            for (int c = 0; c < 3; ++c) {
+                float *v = values + c * n * width;
+                for (int k = 0; k < n_pairs; ++k) {
+                    float *a = v + pairs[2 * k]     * width;
+                    float *b = v + pairs[2 * k + 1] * width;
+                    #pragma omp simd
+                    for (size_t x = 0; x < width; ++x) {
+                        const float lo = fminf (a[x], b[x]);
+                        const float hi = fmaxf (a[x], b[x]);
+                        a[x] = lo;
+                        b[x] = hi;
+                    }
+                }
+                float *sum = sums + c * width;
+                memset (sum, 0, width * sizeof (float));
+                for (int d = trim; d < trim + m; ++d) {
+                    #pragma omp simd
+                    for (size_t x = 0; x < width; ++x)
+                        sum[x] += v[d * width + x];
+                }
+            }
+
+            // round like ptm_cbcr_avg () and ptm_cbcr_median () do
+            ycbcr_coefficients_t *bl = block + (y * width);
+            JSAMPLE *out = (JSAMPLE *) bl;
+            for (size_t i = 0; i < 3 * width; ++i) {
+                const float sum = sums[(i % 3) * width + i / 3];
+                out[i] = trim ?
+                    CLIP (floorf (floorf ((sum + m / 2) / m) / scale)) :
+                    CLIP (floorf (sum / (scale * m)));
+            }
+            if (coeffs) {
+                for (size_t x = 0; x < width; ++x)
+                    lrgb_from_ycbcr (bl + x, coeffs + (y * width) + x);
+            }
         }
+        free (sums);
+        free (values);
+    }
+    free (pairs);
+}
+
+void ptm_lrgb_from_ycbcr (const ptm_image_info_t *info,
+                          ptm_block_t block,
+                          ptm_unscaled_coefficients_t *coeffs) {
+    ycbcr_coefficients_t *ycbcr = (ycbcr_coefficients_t *) block;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < info->pixels; ++i) {
+        lrgb_from_ycbcr (ycbcr + i, coeffs + i);
     }
-    free (sums);
 }
 
 
@@ -806,34 +4423,95 @@ void ptm_cbcr_avg (const ptm_image_info_t *info,
  * See: [Malzbender2001] equations 16 and 17.
  */
 void ptm_normal (const ptm_unscaled_coefficients_t *coeffs, float *nu, float *nv, float *nw) {
-    float divisor = 4 * coeffs->cu2 * coeffs->cv2 - coeffs->cuv * coeffs->cuv;
-
-    *nu = (coeffs->cuv * coeffs->cv - 2 * coeffs->cv2 * coeffs->cu) / divisor;
-    *nv = (coeffs->cuv * coeffs->cu - 2 * coeffs->cu2 * coeffs->cv) / divisor;
-    *nw = sqrtf (1.0f - *nu * *nu + *nv * *nv);
+    normal_from_coeffs (coeffs->cu2, coeffs->cv2, coeffs->cuv, coeffs->cu, coeffs->cv, nu, nv, nw);
 }
 
-void ptm_scale_coefficients (ptm_header_t *ptm_header,
-                             const ptm_unscaled_coefficients_t *unscaled,
-                             ptm_block_t *scaled) {
-
-    const size_t image_size = ptm_header->dimen[1] * ptm_header->dimen[0];
+/** Evaluate an unscaled polynomial at u, v. */
+static inline float poly_at (const ptm_unscaled_coefficients_t *c, float u, float v) {
+    return c->cu2 * u * u + c->cv2 * v * v + c->cuv * u * v + c->cu * u + c->cv * v + c->c1;
+}
 
-    // get the minimum and maximum coefficients
-    ptm_unscaled_coefficients_t min_coefficients;
-    ptm_unscaled_coefficients_t max_coefficients;
+void ptm_normal_albedo_map (const ptm_header_t *ptm_header,
+                            const ptm_unscaled_coefficients_t *coeffs,
+                            ptm_block_t *blocks,
+                            JSAMPLE *normals,
+                            JSAMPLE *albedo) {
+    const size_t width      = ptm_header->dimen[0];
+    const size_t height     = ptm_header->dimen[1];
+    const size_t image_size = width * height;
+    const int n_blocks      = ptm_header->format->ptm_blocks;
+    const int color_components = ptm_header->format->color_components;
+
+    // RGB formats: use the luma of the three polynomials
+    const float weights[3] = { 0.299f, 0.587f, 0.114f };
+
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < height; ++y) {
+        // the PTM is stored bottom row first
+        const size_t offs = (height - 1 - y) * width;
+        const size_t out  = y * width * RGB_COEFFICIENTS;
+        #pragma omp simd
+        for (size_t x = 0; x < width; ++x) {
+            const ptm_unscaled_coefficients_t *c = coeffs + offs + x;
+            float a[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+            for (int b = 0; b < n_blocks; ++b) {
+                const float w = n_blocks == 1 ? 1.0f : weights[b];
+                const ptm_unscaled_coefficients_t *cb = c + b * image_size;
+                a[0] += w * cb->cu2;
+                a[1] += w * cb->cv2;
+                a[2] += w * cb->cuv;
+                a[3] += w * cb->cu;
+                a[4] += w * cb->cv;
+            }
+            float nu, nv, nw;
+            normal_from_coeffs (a[0], a[1], a[2], a[3], a[4], &nu, &nv, &nw);
+
+            if (normals) {
+                JSAMPLE *n = normals + out + x * RGB_COEFFICIENTS;
+                n[0] = CLIP (128.0f + rintf (127.0f * nu));
+                n[1] = CLIP (128.0f + rintf (127.0f * nv));
+                n[2] = CLIP (128.0f + rintf (127.0f * nw));
+            }
+            if (albedo) {
+                JSAMPLE *p = albedo + out + x * RGB_COEFFICIENTS;
+                if (color_components == 0) {
+                    p[0] = CLIP (poly_at (c,                  nu, nv));
+                    p[1] = CLIP (poly_at (c + image_size,     nu, nv));
+                    p[2] = CLIP (poly_at (c + 2 * image_size, nu, nv));
+                } else if (color_components == 3) {
+                    const rgb_coefficients_t *rgb = (rgb_coefficients_t *) blocks[n_blocks] + offs + x;
+                    const float L = poly_at (c, nu, nv) / 255.0f;
+                    p[0] = CLIP (L * rgb->r);
+                    p[1] = CLIP (L * rgb->g);
+                    p[2] = CLIP (L * rgb->b);
+                } else {
+                    const ycbcr_coefficients_t *ycbcr = (ycbcr_coefficients_t *) blocks[n_blocks] + offs + x;
+                    const float L  = poly_at (c, nu, nv);
+                    const float cb = ycbcr->cb - CENTERJSAMPLE;
+                    const float cr = ycbcr->cr - CENTERJSAMPLE;
+                    p[0] = CLIP (L                 + 1.40200f * cr);
+                    p[1] = CLIP (L - 0.34414f * cb - 0.71414f * cr);
+                    p[2] = CLIP (L + 1.77200f * cb);
+                }
+            }
+        }
+    }
+}
 
-    set_coeffs (&min_coefficients,  FLT_MAX);
-    set_coeffs (&max_coefficients, -FLT_MAX);
+void ptm_coefficients_range (const ptm_unscaled_coefficients_t *unscaled, size_t width, size_t height,
+                             ptm_unscaled_coefficients_t *min_coefficients,
+                             ptm_unscaled_coefficients_t *max_coefficients) {
+    set_coeffs (min_coefficients,  FLT_MAX);
+    set_coeffs (max_coefficients, -FLT_MAX);
 
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
-        const ptm_unscaled_coefficients_t *c = unscaled + (y * ptm_header->dimen[0]);
+    #pragma omp parallel for schedule(static)
+    for (size_t y = 0; y < height; ++y) {
+        const ptm_unscaled_coefficients_t *c = unscaled + (y * width);
         ptm_unscaled_coefficients_t min;
         ptm_unscaled_coefficients_t max;
         set_coeffs (&min,  FLT_MAX);
         set_coeffs (&max, -FLT_MAX);
-        for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
+        for (size_t x = 0; x < width; ++x) {
             min_coeffs (&min, c);
             max_coeffs (&max, c);
             ++c;
@@ -841,41 +4519,72 @@ void ptm_scale_coefficients (ptm_header_t *ptm_header,
         #pragma omp critical (min_max_coeffs)
         {
             // update the global min/max coefficients
-            min_coeffs (&min_coefficients, &min);
-            max_coeffs (&max_coefficients, &max);
+            min_coeffs (min_coefficients, &min);
+            max_coeffs (max_coefficients, &max);
         }
     }
+}
 
-    const float *min = (float *) &min_coefficients;
-    const float *max = (float *) &max_coefficients;
-
-    // mul is faster than div on many cpus
-    float inv_scale [PTM_COEFFICIENTS];
+void ptm_set_scale_bias (ptm_header_t *ptm_header,
+                         const ptm_unscaled_coefficients_t *min_coefficients,
+                         const ptm_unscaled_coefficients_t *max_coefficients) {
+    const float *min = (const float *) min_coefficients;
+    const float *max = (const float *) max_coefficients;
 
     // ptm_print_matrix ("max_coeffs", max, 1, PTM_COEFFICIENTS);
     // ptm_print_matrix ("min_coeffs", min, 1, PTM_COEFFICIENTS);
 
     for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
-        // we have to fit the floating point range into the range 0-255
-        ptm_header->scale[i] = (max[i] - min[i]) / 256.0f;
-        ptm_header->bias[i]  = -256.0f / (max[i] - min[i]) * min[i];
-        inv_scale[i] = 1.0f / ptm_header->scale[i];
+        // we have to fit the floating point range into the range 0-255,
+        // any scale will do if the coefficient is constant
+        const float range = (max[i] > min[i]) ? max[i] - min[i] : 1.0f;
+        ptm_header->scale[i] = range / 256.0f;
+        ptm_header->bias[i]  = -256.0f / range * min[i];
     }
+}
 
+void ptm_quantize_coefficients (const ptm_header_t *ptm_header,
+                                const ptm_unscaled_coefficients_t *unscaled,
+                                size_t n_pixels,
+                                JSAMPLE *scaled) {
+    // mul is faster than div on many cpus
+    float inv_scale [PTM_COEFFICIENTS];
+    for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+        inv_scale[i] = 1.0f / ptm_header->scale[i];
+    }
     const int *bias = ptm_header->bias;
 
+    JSAMPLE *s = scaled;
+    const float *u = (const float *) unscaled;
+    for (size_t x = 0; x < n_pixels; ++x) {
+        for (int n = 0; n < PTM_COEFFICIENTS; ++n, ++s, ++u) {
+            /* Encode the PTM coefficients from floats to bytes */
+            *s = CLIP ((*u * inv_scale[n]) + bias[n]);
+        }
+    }
+}
+
+void ptm_scale_coefficients (ptm_header_t *ptm_header,
+                             const ptm_unscaled_coefficients_t *unscaled,
+                             ptm_block_t *scaled) {
+
+    const size_t image_size = ptm_header->dimen[1] * ptm_header->dimen[0];
+
+    // get the minimum and maximum coefficients
+    ptm_unscaled_coefficients_t min_coefficients;
+    ptm_unscaled_coefficients_t max_coefficients;
+    ptm_coefficients_range (unscaled, ptm_header->dimen[0], ptm_header->dimen[1],
+                            &min_coefficients, &max_coefficients);
+    ptm_set_scale_bias (ptm_header, &min_coefficients, &max_coefficients);
+
     for (int i = 0; i < ptm_header->format->ptm_blocks; ++i) {
         // we are more probably memory-bound than cpu-bound here
-        #pragma omp parallel for schedule(dynamic)
+        #pragma omp parallel for schedule(static)
         for (size_t y = 0; y < ptm_header->dimen[1]; ++y) {
-            JSAMPLE *s = scaled[i] + (y * ptm_header->dimen[0] * PTM_COEFFICIENTS);
-            const float *u = (const float *) (unscaled + (i * image_size) + (y * ptm_header->dimen[0]));
-            for (size_t x = 0; x < ptm_header->dimen[0]; ++x) {
-                for (int n = 0; n < PTM_COEFFICIENTS; ++n, ++s, ++u) {
-                    /* Encode the PTM coefficients from floats to bytes */
-                    *s = CLIP ((*u * inv_scale[n]) + bias[n]);
-                }
-            }
+            ptm_quantize_coefficients (ptm_header,
+                                       unscaled + (i * image_size) + (y * ptm_header->dimen[0]),
+                                       ptm_header->dimen[0],
+                                       scaled[i] + (y * ptm_header->dimen[0] * PTM_COEFFICIENTS));
         }
     }
 }
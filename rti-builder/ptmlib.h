@@ -10,12 +10,17 @@
 #define PTMLIB_H
 
 #include <stdio.h>            /* size_t, FILE */
+#include <stdint.h>           /* uint64_t */
 
 #include "jpeglib.h"          /* JSAMPLE */
 
 /** The no. of coefficients used by PTM to describe one pixel. */
 #define PTM_COEFFICIENTS      6
 
+/** The no. of coefficients of the Lambertian model, ie. the albedo scaled
+    normal. */
+#define LAMBERT_COEFFICIENTS  3
+
 /** The no. of extra channels used by PTM to describe one pixel in RGB color
     mode. */
 #define RGB_COEFFICIENTS      3
@@ -33,6 +38,34 @@
 /** The maximal no. of JPEG streams that a PTM file can contain. */
 #define MAX_JPEG_STREAMS      RGB_COEFFICIENTS * PTM_COEFFICIENTS
 
+/** The initial value for ptm_fnv1a(). */
+#define PTM_FNV1A_INIT        0xcbf29ce484222325ULL
+
+/** The maximal length of an error message in ptm_ctx_t. */
+#define PTM_ERROR_LENGTH      256
+
+/** The error codes returned by the library functions. */
+typedef enum {
+    PTM_OK = 0,
+    PTM_ERROR_IO,      /**< The file could not be read or written. */
+    PTM_ERROR_FORMAT,  /**< The file is not a valid PTM. */
+    PTM_ERROR_JPEG,    /**< libjpeg reported an error. */
+    PTM_ERROR_MEMORY,  /**< Out of memory. */
+    PTM_STOPPED        /**< A callback asked to stop. */
+} ptm_error_t;
+
+/** The error state of the library functions.
+
+    The library keeps no mutable global state.  The functions that read or
+    write files take a context and return an error code, 0 on success.  The
+    first error is recorded in the context with a message.  Use one context
+    per thread.  Where a context is NULL the message is printed to stderr.
+*/
+typedef struct {
+    ptm_error_t error;                /**< The first error or PTM_OK. */
+    char message[PTM_ERROR_LENGTH];   /**< A message describing the error. */
+} ptm_ctx_t;
+
 /** Scaled PTM coefficients as expected by libjpeg for de/compression. */
 typedef struct {
     /* little-endian cu2 first */
@@ -80,9 +113,25 @@ typedef enum {
     PTM_FORMAT_LUM,
     PTM_FORMAT_LRGB,
     PTM_FORMAT_JPEG_RGB,
-    PTM_FORMAT_JPEG_LRGB
+    PTM_FORMAT_JPEG_LRGB,
+    PTM_FORMAT_ZLIB_RGB,    /**< Lossless, not in the PTM specification */
+    PTM_FORMAT_ZLIB_LRGB    /**< Lossless, not in the PTM specification */
 } ptm_formats_enum_t;
 
+/** An enumeration of the bases we fit to.  Used to key the matrix cache. */
+typedef enum {
+    PTM_BASIS_PTM = 1,            /**< The biquadratic polynomial of [Malzbender2001]_ */
+    PTM_BASIS_LAMBERT = 2,        /**< The Lambertian model of photometric stereo */
+    PTM_BASIS_PTM_NEAR_FIELD = 3  /**< The polynomial with near-field lights */
+} ptm_basis_enum_t;
+
+/** How to find the chroma of a pixel of an LRGB PTM from all images. */
+typedef enum {
+    PTM_CHROMA_MEAN = 0,        /**< The mean of all images */
+    PTM_CHROMA_MEDIAN,          /**< The median of all images */
+    PTM_CHROMA_TRIMMED_MEAN     /**< The mean of the middle half of the images */
+} ptm_chroma_enum_t;
+
 /** A struct that describes a supported format. */
 typedef struct {
     ptm_formats_enum_t id; /**< The internally used format id */
@@ -95,11 +144,27 @@ typedef struct {
                                 with PTM.  Either 0 = RGB, 2 = LUM, or 3 = LRGB */
     int jpeg_streams;      /**< The no. of JPEG streams if the file is
                                 compressed else 0*/
+    int zlib_streams;      /**< The no. of zlib streams if the file is
+                                compressed losslessly else 0 */
     const char *name;      /**< The format name.  eg. "PTM_FORMAT_RGB" */
 } ptm_format_t;
 
 /** An array containing the PTM file formats we support. */
-extern const ptm_format_t ptm_formats[6];
+extern const ptm_format_t ptm_formats[8];
+
+/**
+ * The brightness calibration of the input images.
+ *
+ * The samples of each image are multiplied by the gain of the image and by
+ * the flat-field correction of the pixel.  The fits apply this in float while
+ * loading the samples, so nothing is clipped or rounded.
+ */
+typedef struct {
+    const float *gains;          /**< The gain of each image. */
+    float * const *flat_fields;  /**< The flat-field correction of each image
+                                    as returned by ptm_flat_field(), or NULL.
+                                    Any of them may be NULL. */
+} ptm_calibration_t;
 
 /** Holds information about the input images and other. */
 typedef struct {
@@ -111,6 +176,9 @@ typedef struct {
     size_t decoder_stride;  /**< The decoder stride in the image buffer, eg. how
                                much to jump to get from one image to the
                                next. */
+    size_t sample_size;     /**< The size of one sample in bytes: 1 for 8 bit
+                               samples, 2 for 16 bit samples.  The strides
+                               above count samples, not bytes. */
     unsigned int n_decoders; /**< The no. of decoders == no. of images. */
 } ptm_image_info_t;
 
@@ -126,7 +194,8 @@ typedef struct {
     float scale            [PTM_COEFFICIENTS];
     int bias               [PTM_COEFFICIENTS];
 
-    /* The following are used only for compressed PTMs */
+    /* The following are used only for compressed PTMs.  Of the lossless
+       formats only compressed_size is used. */
     int compression_param  [1];  /**< The JPEG compression quality. */
     int transforms         [MAX_JPEG_STREAMS];
     int motion_vector_x    [MAX_JPEG_STREAMS];
@@ -135,21 +204,263 @@ typedef struct {
     int reference_planes   [MAX_JPEG_STREAMS];
     size_t compressed_size [MAX_JPEG_STREAMS];
     size_t side_info_sizes [MAX_JPEG_STREAMS];
+
+    /* The following are not stored in the file */
+    int progressive;             /**< Write progressive JPEG streams. */
+    int restart_rows;            /**< Put a restart marker into the JPEG
+                                      streams every restart_rows rows, a
+                                      multiple of 8, or 0 for none. */
+    int planar;                  /**< The blocks are planar.  See
+                                      ptm_block_t.  Set it before reading
+                                      the PTM. */
 } ptm_header_t;
 
 /** An array holding one block of either scaled PTM coefficients or RGB
-    values. */
+    values.
+
+    By default the block is interleaved: it holds the coefficients of one
+    pixel after the other, as uncompressed PTMs store them.  If the planar
+    flag in the header is set, the block holds one plane after the other,
+    each plane with one byte of every pixel, as compressed PTMs store them.
+    Plane c then starts at block + c * width * height.  The color block of
+    PTM_FORMAT_LUM holds the planes Y, Cb and Cr.
+
+    The readers, ptm_write_ptm(), ptm_normal_map() and the renderers work
+    with both layouts.  Relighting from planar blocks is faster, and the
+    compressed formats need no conversion.  The fitting functions work with
+    interleaved blocks only.
+*/
 typedef JSAMPLE *ptm_block_t;
 
+/** How far ptm_read_compressed_blocks_progressive() has got. */
+typedef struct {
+    int stream;        /**< The JPEG stream being decoded. */
+    int scan;          /**< The no. of scans of that stream decoded so far. */
+    int streams_done;  /**< The no. of streams completely decoded. */
+    int done;          /**< Non-zero if the whole PTM has been decoded. */
+} ptm_progress_t;
+
+/** Called by ptm_read_compressed_blocks_progressive() whenever there is more
+    of the PTM to show.  Returns 0 to go on reading, non-zero to stop. */
+typedef int (*ptm_progress_callback_t) (const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                                        const ptm_progress_t *progress, void *user_data);
+
+/** The magic bytes at the start of a PTM index file. */
+#define PTM_INDEX_MAGIC       "PTM_IDX1"
+
+/** The no. of rows in one tile of a PTM index. */
+#define PTM_INDEX_TILE_ROWS   64
+
+/** The byte order mark of a PTM index. */
+#define PTM_INDEX_BYTE_ORDER  0x01020304
+
+/** The header of a PTM index file.
+
+    A PTM index is a sidecar file, named like the PTM with .idx appended, that
+    tells where everything is in the PTM.  It is written in the byte order of
+    the writer and meant to be mmapped.  It holds, in this order, the header,
+    the stream table, the plane table, and the tile table.  The tables are
+    aligned to 8 bytes.
+
+    A stream is one JPEG or zlib stream of a compressed PTM or one block of an
+    uncompressed PTM.  The interleaved block of a PTM_FORMAT_LUM is one
+    stream.  A plane is one byte of a pixel of a stream.  A tile is a band of
+    rows of a stream.
+*/
+typedef struct {
+    char     magic[8];        /**< PTM_INDEX_MAGIC */
+    uint32_t byte_order;      /**< PTM_INDEX_BYTE_ORDER */
+    uint32_t header_size;     /**< The size of this header. */
+    uint32_t format;          /**< The ptm_formats_enum_t of the PTM. */
+    uint32_t n_streams;       /**< The no. of entries in the stream table. */
+    uint32_t n_planes;        /**< The no. of entries in the plane table. */
+    uint32_t n_tiles;         /**< The no. of entries in the tile table. */
+    uint64_t width;           /**< The width of the PTM. */
+    uint64_t height;          /**< The height of the PTM. */
+    uint64_t ptm_size;        /**< The size of the PTM file in bytes. */
+    uint64_t checksum;        /**< The ptm_fnv1a() of the whole PTM file. */
+    uint64_t streams;         /**< The offset of the stream table in the index. */
+    uint64_t planes;          /**< The offset of the plane table in the index. */
+    uint64_t tiles;           /**< The offset of the tile table in the index. */
+} ptm_index_header_t;
+
+/** One entry of the stream table of a PTM index. */
+typedef struct {
+    uint64_t offset;          /**< The offset of the stream in the PTM file. */
+    uint64_t size;            /**< The size of the stream in bytes. */
+    uint64_t side_info_size;  /**< The size of the side information that
+                                   follows the stream. */
+    uint32_t first_tile;      /**< The first entry of the stream in the tile
+                                   table. */
+    uint32_t n_tiles;         /**< The no. of tiles of the stream.  0 if the
+                                   stream cannot be entered in the middle. */
+    uint32_t tile_rows;       /**< The no. of rows of each tile but the last. */
+    uint32_t planes;          /**< The no. of planes of the stream. */
+} ptm_index_stream_t;
+
+/** One entry of the plane table of a PTM index: the range of the values of
+    one byte of a pixel, after JPEG decoding. */
+typedef struct {
+    uint8_t min;
+    uint8_t max;
+} ptm_index_plane_t;
+
+/** A PTM index mapped into memory.
+
+    The tile table holds the offsets of the tiles in the PTM file.  The tiles
+    of an uncompressed stream start at its rows.  The tiles of a JPEG stream
+    start at its restart intervals, the first one at the start of the scan
+    data.  Restart markers reset the DC prediction, so a reader can decode one
+    tile by feeding the decompressor the tables of the stream, from the start
+    of the stream to the start of the scan data, followed by the tile.
+*/
+typedef struct {
+    const ptm_index_header_t *header;
+    const ptm_index_stream_t *streams;  /**< header->n_streams entries */
+    const ptm_index_plane_t  *planes;   /**< header->n_planes entries */
+    const uint64_t           *tiles;    /**< header->n_tiles entries */
+    size_t                    size;     /**< The size of the index file. */
+} ptm_index_t;
+
+/** Information about an input image file as found by ptm_probe_input(). */
+typedef struct {
+    size_t width;      /**< The width of the image. */
+    size_t height;     /**< The height of the image. */
+    int components;    /**< The no. of components after decoding. */
+    int sample_size;   /**< The size of a decoded sample: 1 or 2 bytes. */
+} ptm_input_info_t;
+
+/** A reader for one input image file format.
+
+    The readers decode into the color space the caller asks for: JCS_RGB,
+    JCS_YCbCr or JCS_GRAYSCALE.  8 bit formats yield JSAMPLEs, 16 bit formats
+    yield native-endian uint16_t samples.  The YCbCr conversion follows JFIF,
+    with the chroma centered at half the sample range.
+*/
+typedef struct {
+    const char *name;  /**< The format name, eg. "JPEG" */
+
+    /** Test the magic bytes at the start of a file.  Returns non-zero if
+        the file is in this format. */
+    int (*match)  (const unsigned char *magic, size_t size);
+
+    /** Read just enough of the file to fill in the info.  Returns 0 on
+        success.  May record the reason of a failure in ctx. */
+    int (*probe)  (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space, ptm_input_info_t *info);
+
+    /** Decode the whole file from memory into the rows, which must be large
+        enough to hold info->width * info->components samples each.  The
+        image is shrunk by scale_denom while decoding, info must hold the
+        shrunk dimensions.  Returns 0 on success. */
+    int (*decode) (const unsigned char *data, size_t size, J_COLOR_SPACE color_space,
+                   unsigned int scale_denom, const ptm_input_info_t *info, void **rows);
+
+    /** The largest scale_denom the decoder supports.  Must be a power of 2. */
+    unsigned int max_scale_denom;
+} ptm_input_format_t;
+
+/** An array containing the input image file formats we support. */
+extern const ptm_input_format_t ptm_input_formats[];
+
+/** The geometry of the dome for the near-field correction of the lights.
+
+    The lights of a small dome are not infinitely far away, so the direction
+    of a light differs across the image.  The .lp file gives the direction of
+    each light as seen from the center of the dome.  All lengths are in pixels
+    of the image being fitted.
+*/
+typedef struct {
+    float radius;       /**< The radius of the dome. */
+    float center_x;     /**< The point of the image under the center of the dome. */
+    float center_y;
+    size_t tile_size;   /**< The light directions are computed once per tile of
+                             tile_size x tile_size pixels. */
+} ptm_near_field_t;
+
+/** Geometric transformations applied to the input images while decoding.
+
+    The image is first cropped, then shrunk by an integer factor with a box
+    filter, then rotated.  The crop rectangle is in the coordinates of the
+    input image.
+*/
+typedef struct {
+    size_t crop_x;        /**< The left edge of the crop rectangle. */
+    size_t crop_y;        /**< The top edge of the crop rectangle. */
+    size_t crop_width;    /**< The width of the crop rectangle, 0 for no crop. */
+    size_t crop_height;   /**< The height of the crop rectangle, 0 for no crop. */
+    unsigned int shrink;  /**< Shrink the image by this factor, 1 for none. */
+    int rotate;           /**< Rotate the image clockwise by 0, 90, 180 or 270 degrees. */
+} ptm_transform_t;
+
 /** Information pertaining to one input image file. */
 typedef struct {
-    FILE *fp;       /**< The handle of the open file. */
-    char *filename; /**< The filename of the input image. */
+    char *filename; /**< The path of the input image. */
+    const ptm_input_format_t *input_format; /**< The file format of the image. */
     float u, v, w;  /**< The cartesian coordinates of the light that illuminated
                          this image. */
-    struct jpeg_decompress_struct dinfo;  /**< Used by libjpeg. */
 } decoder_t;
 
+/** The maximum no. of stages a ptm_stats_t can hold. */
+#define PTM_MAX_STAGES 16
+
+/** Measurements of one stage of processing, eg. decoding. */
+typedef struct {
+    const char *name;      /**< The name of the stage, eg. "decode". */
+    double wall;           /**< The elapsed wall-clock time in seconds. */
+    double cpu;            /**< The CPU time of all threads in seconds. */
+    double mpixel_lights;  /**< The work done in megapixels times lights, or 0
+                                if that makes no sense for this stage. */
+    size_t bytes_read;     /**< The no. of bytes read. */
+    size_t bytes_written;  /**< The no. of bytes written. */
+} ptm_stage_t;
+
+/** Measurements of all stages of processing one PTM. */
+typedef struct {
+    ptm_stage_t stages[PTM_MAX_STAGES]; /**< The stages done so far. */
+    int n_stages;          /**< The no. of stages done so far. */
+    double wall_start;     /**< The wall-clock time of ptm_stats_init(). */
+    double wall_end;       /**< The wall-clock time the last stage ended. */
+    double stage_wall;     /**< The wall-clock time the current stage started. */
+    double stage_cpu;      /**< The CPU time the current stage started. */
+    int shared_cpu;        /**< Other work ran in this process at the same
+                                time, so the CPU times include it.  Set it
+                                to leave them out of the JSON. */
+} ptm_stats_t;
+
+/** A surface normal packed into 3 bytes.  The components are scaled by 127. */
+typedef struct {
+    int8_t nu;
+    int8_t nv;
+    int8_t nw;
+} ptm_normal_t;
+
+/** The rendering modes for relighting. */
+typedef enum {
+    PTM_RENDER_DEFAULT = 0,  /**< Evaluate the polynomial. */
+    PTM_RENDER_DIFFUSE_GAIN, /**< Exaggerate the curvature of the reflectance
+                                  function.  See: [Malzbender2001]_ Diffuse Gain */
+    PTM_RENDER_SPECULAR,     /**< Add Phong highlights computed from the surface
+                                  normals.  See: [Malzbender2001]_ Specular Enhancement */
+    PTM_RENDER_NORMALS       /**< Show the surface normals as RGB colors. */
+} ptm_render_mode_t;
+
+/** The parameters for relighting. */
+typedef struct {
+    ptm_render_mode_t mode;  /**< The rendering mode. */
+    float gain;              /**< The diffuse gain, > 1 to exaggerate. */
+    float kd;                /**< The weight of the diffuse color in specular mode. */
+    float ks;                /**< The weight of the highlights in specular mode. */
+    float exponent;          /**< The Phong exponent in specular mode. */
+} ptm_render_params_t;
+
+/** A pool of threads that reads whole files into memory ahead of their use.
+    See ptm_prefetch_start(). */
+typedef struct ptm_prefetcher ptm_prefetcher_t;
+
+/** A region of memory that the big buffers of one encoder run are carved
+    from.  See ptm_arena_create(). */
+typedef struct ptm_arena ptm_arena_t;
+
 /** Clip against inter-sample overflow: While all samples may be in the range
     [0..255] the reconstructed curve may well go beyond that range.  Made an
     inline function instead of a macro to avoid multiple evaluation of POLY. */
@@ -169,6 +480,22 @@ inline JSAMPLE CLIP (const float f) {
  */
 const ptm_format_t *ptm_get_format (const char *format_name);
 
+/**
+ * Initialize a context.
+ *
+ * @param ctx [out] The context.
+ */
+void ptm_ctx_init (ptm_ctx_t *ctx);
+
+/**
+ * Return a short description of an error code.
+ *
+ * @param error The error code.
+ *
+ * @returns The description.
+ */
+const char *ptm_strerror (ptm_error_t error);
+
 /**
  * Allocate a PTM header structure.  Free this structure with free().
  *
@@ -182,10 +509,24 @@ ptm_header_t *ptm_alloc_header ();
  *
  * @param ptm_header A pointer to an initialized ptm_header_t struct.
  *
- * @return A pointer to the allocated block struct.
+ * @return A pointer to the allocated block struct or NULL if out of memory.
  */
 ptm_block_t *ptm_alloc_blocks (const ptm_header_t *ptm_header);
 
+/**
+ * Allocate the blocks from an arena.
+ *
+ * Like ptm_alloc_blocks() but the blocks go away with ptm_arena_reset().  Do
+ * not call ptm_free_blocks() on them.  The blocks are zeroed with
+ * ptm_first_touch().
+ *
+ * @param arena      The arena.
+ * @param ptm_header A pointer to an initialized ptm_header_t struct.
+ *
+ * @return A pointer to the allocated block struct or NULL if out of memory.
+ */
+ptm_block_t *ptm_arena_alloc_blocks (ptm_arena_t *arena, const ptm_header_t *ptm_header);
+
 /**
  * Free the structure allocated by ptm_free_blocks().
  *
@@ -197,11 +538,12 @@ void ptm_free_blocks (const ptm_header_t *ptm_header, ptm_block_t *blocks);
 /**
  * Read the header section of a PTM file.
  *
- * @param fp A file pointer to a file openfor reading.
+ * @param ctx The context or NULL.
+ * @param fp  A file pointer to a file open for reading.
  *
- * @returns A ptm_header_t struct filled with information.
+ * @returns A ptm_header_t struct filled with information or NULL on error.
  */
-ptm_header_t *ptm_read_header (FILE *fp);
+ptm_header_t *ptm_read_header (ptm_ctx_t *ctx, FILE *fp);
 
 /**
  * Write the header section of a PTM file.
@@ -214,35 +556,631 @@ void ptm_write_header (FILE *fp, const ptm_header_t *ptm_header);
 /**
  * Read the blocks from a PTM file.
  *
- * Does automatic JPEG decoding if the PTM format requires it.
+ * Does automatic JPEG or zlib decoding if the PTM format requires it.
  *
+ * @param ctx        The context or NULL.
  * @param fp         File pointer.
  * @param ptm_header A pointer to an initialized ptm_header_t struct.
  * @param blocks     A pointer to an allocated ptm_block_t struct.
+ *
+ * @returns 0 on success or an error code.
  */
-void ptm_read_ptm  (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks);
+int ptm_read_ptm (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks);
+
+/**
+ * Read the blocks from a compressed PTM file and show the progress.
+ *
+ * For viewers that want to relight the PTM before it has been read
+ * completely, eg. from slow network storage.  The streams are read in small
+ * chunks.  After each stream, and after each scan of a progressive stream,
+ * the callback is called with the blocks as decoded so far.  Coefficients not
+ * yet decoded are 0, and the red streams of an RGB PTM stand in for the green
+ * and blue ones until those arrive.  The callback is called a last time when
+ * the PTM is complete.
+ *
+ * Progressive streams give the most useful intermediate results.  Write them
+ * with the progressive flag in the header set.
+ *
+ * @param ctx        The context or NULL.
+ * @param fp         File pointer.
+ * @param ptm_header A pointer to an initialized ptm_header_t struct.
+ * @param blocks     A pointer to an allocated ptm_block_t struct.
+ * @param callback   The callback or NULL.
+ * @param user_data  Passed to the callback.
+ *
+ * @returns 0 on success, PTM_STOPPED if the callback stopped reading, or an
+ *          error code.
+ */
+int ptm_read_compressed_blocks_progressive (ptm_ctx_t *ctx, FILE *fp,
+                                            const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                                            ptm_progress_callback_t callback, void *user_data);
 
 /**
  * Write the blocks to a PTM file.
  *
- * Does automatic JPEG encoding if the PTM format requires it.
+ * Does automatic JPEG encoding if the PTM format requires it.  If the
+ * progressive flag in the header is set, the JPEG streams are progressive.
+ *
+ * The lossless formats store each byte plane of the blocks in its own zlib
+ * stream, after predicting each sample from its neighbours as in LOCO-I.
+ * The streams are compressed and decompressed in parallel.  These formats
+ * are not part of the PTM specification; other viewers cannot read them.
  *
+ * @param ctx        The context or NULL.
  * @param fp         File pointer.
  * @param ptm_header A pointer to an initialized ptm_header_t struct.
  * @param blocks     A pointer to an initialized ptm_block_t struct.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_write_ptm (ptm_ctx_t *ctx, FILE *fp, ptm_header_t *ptm_header, ptm_block_t *blocks);
+
+/** Called by ptm_write_ptm_rows() to get one row of a block.  The row must be
+    filled with the scaled coefficients or the color values, laid out as in
+    the block.  Row 0 is the bottom row.  Returns 0 on success. */
+typedef int (*ptm_row_callback_t) (int block, size_t y, JSAMPLE *row, void *user_data);
+
+/**
+ * Write a PTM file whose blocks are produced one row at a time.
+ *
+ * Like ptm_write_ptm() but the blocks need not be held in memory.  Use this
+ * for PTMs that are too large to be held in memory.  Of the compressed formats
+ * only the compressed streams are held in memory, unless they are
+ * progressive.
+ *
+ * @param ctx        The context or NULL.
+ * @param fp         File pointer.
+ * @param ptm_header A pointer to an initialized ptm_header_t struct.  Scale
+ *                   and bias must be set.
+ * @param get_row    The callback that produces the rows.
+ * @param user_data  Passed to the callback.
+ *
+ * @returns 0 on success, PTM_STOPPED if the callback failed, or an error
+ *          code.
  */
-void ptm_write_ptm (FILE *fp, ptm_header_t *ptm_header, ptm_block_t *blocks);
+int ptm_write_ptm_rows (ptm_ctx_t *ctx, FILE *fp, ptm_header_t *ptm_header,
+                        ptm_row_callback_t get_row, void *user_data);
+
+/**
+ * Write the index of a PTM file.
+ *
+ * Reads the PTM file back and writes the index next to it.  The JPEG streams
+ * are decoded once to find the range of the planes.  Write the PTM with
+ * restart_rows set in the header to get tiles in the JPEG streams.
+ *
+ * @param ctx      The context or NULL.
+ * @param ptm_path The PTM file.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_write_index (ptm_ctx_t *ctx, const char *ptm_path);
+
+/**
+ * Map the index of a PTM file into memory.
+ *
+ * @param ctx      The context or NULL.
+ * @param ptm_path The PTM file, not the index file.
+ *
+ * @returns The index or NULL.  If the PTM has no index returns NULL without
+ *          setting an error.  Close the index with ptm_index_close().
+ */
+ptm_index_t *ptm_index_open (ptm_ctx_t *ctx, const char *ptm_path);
+
+/**
+ * Unmap an index.
+ *
+ * @param index The index or NULL.
+ */
+void ptm_index_close (ptm_index_t *index);
+
+/**
+ * Test if an index belongs to a PTM file.
+ *
+ * Compares the sizes of the file and of its streams with those in the index.
+ * Does not compute the checksum.
+ *
+ * @param index      The index.
+ * @param fp         File pointer, just after the header.
+ * @param ptm_header A pointer to an initialized ptm_header_t struct.
+ *
+ * @returns Non-zero if the index belongs to the file, 0 if it is stale.
+ */
+int ptm_index_matches (const ptm_index_t *index, FILE *fp, const ptm_header_t *ptm_header);
+
+/**
+ * Read the blocks from a PTM file with the help of its index.
+ *
+ * Like ptm_read_ptm(), but maps the file into memory and decodes the JPEG
+ * streams in parallel.  Reads nothing if the index is stale, see
+ * ptm_index_matches().
+ *
+ * @param ctx        The context or NULL.
+ * @param fp         File pointer, just after the header.  Its position is
+ *                   undefined afterwards.
+ * @param ptm_header A pointer to an initialized ptm_header_t struct.
+ * @param blocks     A pointer to an allocated ptm_block_t struct.
+ * @param index      The index of the file.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_read_ptm_indexed (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header,
+                          ptm_block_t *blocks, const ptm_index_t *index);
 
 /**
  * Write a JPEG file from a PTM and lighting position.
  *
- * @param fp A file pointer open for writing.
+ * @param ctx The context or NULL.
+ * @param fp  A file pointer open for writing.
+ * @param ptm_header
+ * @param blocks
+ * @param u   The u coordinate of the light.
+ * @param v   The v coordinate of the light.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_write_jpeg (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                    float u, float v);
+
+/**
+ * Write a JPEG file from a PTM and lighting position using a rendering mode.
+ *
+ * The enhanced modes need the surface normals.  If you render many images
+ * from the same PTM, compute the normal map once with ptm_normal_map() and
+ * pass it in.  If normals is NULL and the mode needs them, they are computed
+ * for this call only.
+ *
+ * @param ctx     The context or NULL.
+ * @param fp      A file pointer open for writing.
+ * @param ptm_header
+ * @param blocks
+ * @param normals The normal map or NULL.
+ * @param params  The rendering mode and its parameters.
+ * @param u       The u coordinate of the light.
+ * @param v       The v coordinate of the light.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_write_jpeg_enhanced (ptm_ctx_t *ctx, FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                             const ptm_normal_t *normals, const ptm_render_params_t *params,
+                             float u, float v);
+
+/**
+ * Set the rendering parameters to their defaults.
+ *
+ * @param params [out] The parameters.
+ */
+void ptm_render_defaults (ptm_render_params_t *params);
+
+/**
+ * Parse a command line option that sets a rendering mode.
+ *
+ * Recognizes:
+ *
+ *   --diffuse-gain[=GAIN]
+ *   --specular[=KD,KS,EXPONENT]
+ *   --normals
+ *
+ * @param arg    The command line argument.
+ * @param params [in,out] The parameters.
+ *
+ * @returns 1 if the option was recognized, 0 if not, -1 if the value is bad.
+ */
+int ptm_parse_render_option (const char *arg, ptm_render_params_t *params);
+
+/**
+ * Compute the surface normal of each pixel.
+ *
+ * The normals are derived from the luminance polynomial of LRGB and LUM PTMs
+ * and from the luma of the three polynomials of RGB PTMs.  Computed in
+ * parallel.
+ *
+ * @param ptm_header
+ * @param blocks
+ *
+ * @returns The normals in the same order as the PTM pixels.  Free with free().
+ */
+ptm_normal_t *ptm_normal_map (const ptm_header_t *ptm_header, ptm_block_t *blocks);
+
+/**
+ * Compute the normal map and the albedo from the fitted coefficients.
+ *
+ * Call this after fitting and before scaling the coefficients.  For the LRGB
+ * and LUM formats the color block must already be filled.  The normals are
+ * found as in ptm_normal_map() but at full precision.  The albedo is the color
+ * of the pixel when lighted from the direction of its normal.  Computed in
+ * parallel.
+ *
+ * Both outputs are RGB images, top row first, 3 bytes per pixel.  The normals
+ * are encoded as 128 + 127 * n.
+ *
+ * @param ptm_header
+ * @param coeffs   The unscaled coefficients as fitted.
+ * @param blocks   The blocks.  Only the color block is used.
+ * @param normals  [out] The normal map or NULL.
+ * @param albedo   [out] The albedo or NULL.
+ */
+void ptm_normal_albedo_map (const ptm_header_t *ptm_header,
+                            const ptm_unscaled_coefficients_t *coeffs,
+                            ptm_block_t *blocks,
+                            JSAMPLE *normals,
+                            JSAMPLE *albedo);
+
+/**
+ * Render the PTM into memory.
+ *
+ * Like ptm_write_jpeg_enhanced() but renders into a buffer, with the rows in
+ * parallel.
+ *
+ * @param ctx     The context or NULL.
  * @param ptm_header
  * @param blocks
- * @param u The u coordinate of the light.
- * @param v The v coordinate of the light.
+ * @param normals The normal map or NULL.
+ * @param params  The rendering mode and its parameters.
+ * @param u       The u coordinate of the light.
+ * @param v       The v coordinate of the light.
+ * @param out     [out] The image, top row first, 3 bytes per pixel in the
+ *                color space of ptm_render_color_space().
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_render (ptm_ctx_t *ctx, const ptm_header_t *ptm_header, ptm_block_t *blocks,
+                const ptm_normal_t *normals, const ptm_render_params_t *params,
+                float u, float v, JSAMPLE *out);
+
+/**
+ * The color space of a rendered PTM.
+ *
+ * @returns JCS_YCbCr for PTM_FORMAT_LUM, except for the normals, else JCS_RGB.
+ */
+J_COLOR_SPACE ptm_render_color_space (const ptm_header_t *ptm_header, const ptm_render_params_t *params);
+
+/**
+ * Write the header of a YUV4MPEG2 stream.
+ *
+ * The frames are YCbCr 4:4:4 with the full range of samples, as in JPEG.
+ *
+ * @param fp     The file to write to.
+ * @param width
+ * @param height
+ * @param fps    The no. of frames per second.
  */
-void ptm_write_jpeg (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *blocks, float u, float v);
+void ptm_write_y4m_header (FILE *fp, size_t width, size_t height, int fps);
+
+/**
+ * Write one frame of a YUV4MPEG2 stream.
+ *
+ * @param ctx         The context or NULL.
+ * @param fp          The file to write to.
+ * @param width
+ * @param height
+ * @param pixels      The image, top row first, 3 bytes per pixel.
+ * @param color_space JCS_RGB or JCS_YCbCr.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_write_y4m_frame (ptm_ctx_t *ctx, FILE *fp, size_t width, size_t height,
+                         const JSAMPLE *pixels, J_COLOR_SPACE color_space);
+
+/**
+ * Write an 8 bit RGB image as PNG.
+ *
+ * @param fp      The file to write to.
+ * @param width
+ * @param height
+ * @param rgb     The image, top row first, 3 bytes per pixel.
+ *
+ * @returns 0 on success.
+ */
+int ptm_write_png (FILE *fp, size_t width, size_t height, const JSAMPLE *rgb);
+
+/**
+ * Find the reader for an image file.
+ *
+ * @param magic  The first bytes of the file.
+ * @param size   The no. of bytes in magic.  16 bytes are enough.
+ *
+ * @returns The input format or NULL if the file format is not supported.
+ */
+const ptm_input_format_t *ptm_find_input_format (const unsigned char *magic, size_t size);
+
+/**
+ * Probe an input image file.
+ *
+ * Finds the file format and reads the image dimensions without decoding the
+ * image.
+ *
+ * @param ctx         The context or NULL.
+ * @param path        The image file.
+ * @param color_space The color space to decode into.
+ * @param format      [out] The file format.
+ * @param info        [out] The image dimensions.
+ *
+ * @returns 0 on success or an error code.
+ */
+int ptm_probe_input (ptm_ctx_t *ctx, const char *path, J_COLOR_SPACE color_space,
+                     const ptm_input_format_t **format, ptm_input_info_t *info);
+
+/**
+ * Test if a transformation does nothing.
+ *
+ * @returns non-zero if the images can be decoded without transformation.
+ */
+int ptm_transform_is_identity (const ptm_transform_t *transform);
+
+/**
+ * Calculate the dimensions of a transformed image.
+ *
+ * @param transform The transformation.
+ * @param in        The dimensions of the input image.
+ * @param out       [out] The dimensions of the transformed image.
+ *
+ * @returns 0 on success, non-zero if the crop rectangle is outside the image.
+ */
+int ptm_transform_info (const ptm_transform_t *transform, const ptm_input_info_t *in,
+                        ptm_input_info_t *out);
+
+/**
+ * Find the scale_denom to decode an image with.
+ *
+ * Lets the decoder do as much of the shrinking as possible.  With libjpeg this
+ * avoids most of the IDCT work.  The scale_denom must divide the shrink factor
+ * and the origin of the crop rectangle.
+ *
+ * @param transform       The transformation.
+ * @param max_scale_denom The largest scale_denom the decoder supports.
+ *
+ * @returns The scale_denom.
+ */
+unsigned int ptm_transform_prescale (const ptm_transform_t *transform, unsigned int max_scale_denom);
+
+/**
+ * Get the dimensions of an image decoded with a scale_denom.
+ */
+void ptm_transform_prescaled_info (const ptm_input_info_t *in, unsigned int scale_denom,
+                                   ptm_input_info_t *out);
+
+/**
+ * Crop, shrink and rotate one decoded image.
+ *
+ * @param transform   The transformation.
+ * @param scale_denom The scale_denom the image was decoded with.
+ * @param in          The dimensions of the decoded image.
+ * @param src         The decoded image, rows packed without padding.
+ * @param out         The dimensions of the transformed image as calculated by
+ *                    ptm_transform_info().
+ * @param rows        [out] The rows of the transformed image.
+ */
+void ptm_transform_image (const ptm_transform_t *transform, unsigned int scale_denom,
+                          const ptm_input_info_t *in, const void *src,
+                          const ptm_input_info_t *out, void **rows);
+
+/**
+ * Rotate the light direction of an image along with the image.
+ *
+ * @param transform The transformation.
+ * @param decoder   The decoder holding the light direction.
+ */
+void ptm_transform_light (const ptm_transform_t *transform, decoder_t *decoder);
+
+/**
+ * Find where a point of the input image ends up in the transformed image.
+ *
+ * @param transform The transformation.
+ * @param in        The dimensions of the input image.
+ * @param x         [in,out] The x coordinate of the point in pixels.
+ * @param y         [in,out] The y coordinate of the point in pixels.
+ */
+void ptm_transform_point (const ptm_transform_t *transform, const ptm_input_info_t *in,
+                          float *x, float *y);
+
+/** The largest correction ptm_flat_field() applies to a dark pixel. */
+#define PTM_FLAT_FIELD_MAX 16.0f
+
+/**
+ * Compute the flat-field correction from an image of a uniform white target.
+ *
+ * The correction of each pixel is the mean brightness of the image divided by
+ * the brightness of the pixel, but at most PTM_FLAT_FIELD_MAX.  The brightness
+ * is the Y component of YCbCr images and the luma of RGB images.
+ *
+ * @param info        The dimensions of the image.
+ * @param color_space The color space of the image.
+ * @param image       The image, rows packed without padding.
+ *
+ * @returns One float per pixel or NULL if out of memory.  Free this with free().
+ */
+float *ptm_flat_field (const ptm_input_info_t *info, J_COLOR_SPACE color_space, const void *image);
+
+
+/**
+ * Get the monotonic wall-clock time.
+ *
+ * @returns The time in seconds since some arbitrary point.
+ */
+double ptm_wall_time (void);
+
+/**
+ * Get the CPU time used by this process.
+ *
+ * This is the sum over all threads, so with N busy threads it runs N times
+ * faster than the wall-clock.
+ *
+ * @returns The CPU time in seconds.
+ */
+double ptm_cpu_time (void);
+
+/**
+ * Get the peak resident set size of this process.
+ *
+ * @returns The peak RSS in bytes.
+ */
+size_t ptm_peak_rss (void);
+
+/**
+ * Start measuring.
+ *
+ * @param stats The stats to initialize.
+ */
+void ptm_stats_init (ptm_stats_t *stats);
+
+/**
+ * Start measuring a stage.
+ *
+ * @param stats The stats.
+ */
+void ptm_stats_start (ptm_stats_t *stats);
+
+/**
+ * Stop measuring a stage.
+ *
+ * Records the time since the last call to ptm_stats_start().  The caller may
+ * fill in the work done and bytes read and written in the returned stage.
+ *
+ * @param stats The stats.
+ * @param name  The name of the stage.  Must be a string constant.
+ *
+ * @returns The stage or NULL if PTM_MAX_STAGES stages were already recorded.
+ */
+ptm_stage_t *ptm_stats_stop (ptm_stats_t *stats, const char *name);
+
+/**
+ * Write the stats as a JSON object.
+ *
+ * Writes the totals, the peak RSS of the process, and an array with one
+ * object per stage.  Throughput is in megapixels times lights per second.
+ * The CPU times are left out if shared_cpu is set.
+ *
+ * @param fp    A file pointer open for writing.
+ * @param stats The stats.
+ */
+void ptm_stats_write_json (FILE *fp, const ptm_stats_t *stats);
+
+/**
+ * Write a string as a quoted and escaped JSON string.
+ *
+ * @param fp A file pointer open for writing.
+ * @param s  The string.
+ */
+void ptm_write_json_string (FILE *fp, const char *s);
+
+/**
+ * Read a whole file into memory.
+ *
+ * Reads with a few large reads instead of many small ones.
+ *
+ * @param path  The file to read.
+ * @param data  [out] The file contents.  Free this with free().
+ * @param size  [out] The file size.
+ *
+ * @returns 0 on success or an errno value.
+ */
+int ptm_read_file (const char *path, unsigned char **data, size_t *size);
+
+/**
+ * Start reading a list of files into memory in the background.
+ *
+ * The files are read in list order by n_threads threads.  At most window
+ * files are held in memory: a file that was read must be released with
+ * ptm_prefetch_release() before more files are read.  Consumers should get
+ * files in (approximately) list order or they may wait forever.
+ *
+ * @param paths     The files to read.  Must remain valid until
+ *                  ptm_prefetch_stop().
+ * @param n_files   The no. of files.
+ * @param n_threads The no. of reader threads.
+ * @param window    The max. no. of files held in memory.
+ *
+ * @returns A prefetcher.  Stop it with ptm_prefetch_stop().
+ */
+ptm_prefetcher_t *ptm_prefetch_start (const char * const *paths, int n_files, int n_threads, int window);
+
+/**
+ * Get a file from the prefetcher.  Waits until the file has been read.
+ *
+ * @param prefetcher The prefetcher.
+ * @param i          The index of the file in the list.
+ * @param data       [out] The file contents.  Owned by the prefetcher.
+ * @param size       [out] The file size.
+ *
+ * @returns 0 on success or an errno value.
+ */
+int ptm_prefetch_get (ptm_prefetcher_t *prefetcher, int i, const unsigned char **data, size_t *size);
+
+/**
+ * Tell the prefetcher that a file is no longer needed.
+ *
+ * Frees the file contents and lets the readers go on.
+ *
+ * @param prefetcher The prefetcher.
+ * @param i          The index of the file in the list.
+ */
+void ptm_prefetch_release (ptm_prefetcher_t *prefetcher, int i);
+
+/**
+ * Stop the prefetcher and free all its resources.
+ *
+ * @param prefetcher The prefetcher.
+ */
+void ptm_prefetch_stop (ptm_prefetcher_t *prefetcher);
+
+/**
+ * Create an arena.
+ *
+ * An arena hands out memory with a bump pointer and frees it all at once with
+ * ptm_arena_reset().  The memory is mapped in big chunks backed by huge pages
+ * where the system has them.  After a reset the chunks are reused, so a batch
+ * of similar runs maps and faults in its buffers only once.  If a run needed
+ * more than one chunk, the next run gets one chunk big enough for all.
+ *
+ * The memory is not initialized.  Its pages are placed on the NUMA node of
+ * the thread that first writes to them.
+ *
+ * @returns An arena.  Free it with ptm_arena_destroy().
+ */
+ptm_arena_t *ptm_arena_create ();
+
+/**
+ * Allocate memory from an arena.
+ *
+ * The memory is aligned to a cache line.  May be called from many threads.
+ *
+ * @param arena The arena.
+ * @param size  The size in bytes.
+ *
+ * @returns The memory or NULL if out of memory.
+ */
+void *ptm_arena_alloc (ptm_arena_t *arena, size_t size);
+
+/**
+ * Free all memory allocated from an arena.  The arena keeps its chunks.
+ *
+ * @param arena The arena.
+ */
+void ptm_arena_reset (ptm_arena_t *arena);
+
+/**
+ * Free an arena and all its chunks.
+ *
+ * @param arena The arena or NULL.
+ */
+void ptm_arena_destroy (ptm_arena_t *arena);
+
+/**
+ * Zero a stack of images in parallel, row by row.
+ *
+ * The rows are split between the threads the same way as in the fitting,
+ * chroma and scaling functions, which all use a static schedule over the
+ * rows.  On a NUMA machine the memory of each row then lands on the node of
+ * the thread that will work on it, if called before anything else touches
+ * the memory and with the same no. of threads.  Pin the threads to make the
+ * mapping stick.
+ *
+ * @param buffer   The images, one after the other.
+ * @param n_images The no. of images.
+ * @param height   The no. of rows of an image.
+ * @param row_size The size of a row in bytes.
+ */
+void ptm_first_touch (void *buffer, size_t n_images, size_t height, size_t row_size);
 
 /**
  * Does the singular value decomposition.
@@ -254,6 +1192,91 @@ void ptm_write_jpeg (FILE *fp, const ptm_header_t *ptm_header, ptm_block_t *bloc
  */
 float *ptm_svd (decoder_t **decoders, int n_decoders);
 
+/**
+ * Does the singular value decomposition for each tile of the image.
+ *
+ * Like ptm_svd() but corrects the light directions for the position of each
+ * tile under the dome.  The tiles are numbered row by row starting from the
+ * bottom left, like the rows in the image buffer.  Computed in parallel.
+ *
+ * @param decoders   An array of decoders.
+ * @param n_decoders The number of decoders.
+ * @param near_field The geometry of the dome.
+ * @param width      The width of the image.
+ * @param height     The height of the image.
+ *
+ * @returns One n_coeffs by n_lights matrix for each tile.
+ */
+float *ptm_svd_near_field (decoder_t **decoders, int n_decoders,
+                           const ptm_near_field_t *near_field, size_t width, size_t height);
+
+/**
+ * Does the singular value decomposition for photometric stereo.
+ *
+ * Like ptm_svd() but for the Lambertian model: I = albedo * (n · l).  The w
+ * component of the light is recomputed from u and v.
+ *
+ * @param decoders   An array of decoders.
+ * @param n_decoders The number of decoders.
+ *
+ * @returns A LAMBERT_COEFFICIENTS by n_lights matrix of floats.
+ */
+float *ptm_svd_lambert (decoder_t **decoders, int n_decoders);
+
+/**
+ * Update a 64 bit FNV-1a hash.
+ *
+ * @param hash The hash so far.  Start with PTM_FNV1A_INIT.
+ * @param data The data to hash.
+ * @param size The size of data in bytes.
+ *
+ * @returns The updated hash.
+ */
+uint64_t ptm_fnv1a (uint64_t hash, const void *data, size_t size);
+
+/**
+ * Hash the light positions of the decoders.
+ *
+ * Two runs with the same hash will yield the same SVD matrix.
+ *
+ * @param decoders   An array of decoders.
+ * @param n_decoders The number of decoders.
+ * @param basis      The basis the matrix is for.
+ *
+ * @returns The hash.
+ */
+uint64_t ptm_light_hash (decoder_t **decoders, int n_decoders, ptm_basis_enum_t basis);
+
+/**
+ * Read a matrix from the on-disk cache.
+ *
+ * @param cache_dir The cache directory.
+ * @param key       The key, eg. from ptm_light_hash().
+ * @param m         The expected no. of rows.
+ * @param n         The expected no. of columns.
+ *
+ * @returns An m by n matrix of floats or NULL if the matrix is not in the
+ *          cache.  Free the matrix with free().
+ */
+float *ptm_cache_read_matrix (const char *cache_dir, uint64_t key, int m, int n);
+
+/**
+ * Write a matrix into the on-disk cache.
+ *
+ * The cache directory is created if it does not exist.  The file is written
+ * under a temporary name and then renamed, so concurrent encoders sharing one
+ * cache directory never see a partial file.
+ *
+ * @param cache_dir The cache directory.
+ * @param key       The key, eg. from ptm_light_hash().
+ * @param M         An m by n matrix of floats.
+ * @param m         The no. of rows.
+ * @param n         The no. of columns.
+ *
+ * @returns 0 on success, -1 on error.
+ */
+int ptm_cache_write_matrix (const char *cache_dir, uint64_t key, const float *M, int m, int n);
+
 
 /**
  * Do the polynomial fit for all pixels in the image.
@@ -265,20 +1288,69 @@ float *ptm_svd (decoder_t **decoders, int n_decoders);
  * @param info
  * @param buffer       The input buffer (filled by libjpeg).
  * @param pixel_stride The spacing of the pixels in buffer.
- * @param M            The SVD matrix.
+ * @param M            The SVD matrix, or one per tile.
+ * @param tile_size    The size of the tiles or 0 if M is global.  See
+ *                     ptm_svd_near_field().
+ * @param calibration  The brightness calibration or NULL.
  * @param output       The output PTM coefficients.
  */
 void ptm_fit_poly_jsample (const ptm_image_info_t *info,
                            const JSAMPLE *buffer,
                            size_t pixel_stride,
                            const float *M,
+                           size_t tile_size,
+                           const ptm_calibration_t *calibration,
                            ptm_unscaled_coefficients_t *output);
 
-void ptm_fit_poly_uint (const ptm_image_info_t *info,
-                        const unsigned int *buffer,
-                        size_t pixel_stride,
-                        const float *M,
-                        ptm_unscaled_coefficients_t *output);
+/**
+ * Do the polynomial fit for all pixels in the image from 16 bit samples.
+ *
+ * Like ptm_fit_poly_jsample() but for 16 bit input images.  The coefficients
+ * are scaled down to the 8 bit range, so that they can be treated exactly like
+ * coefficients fitted to 8 bit images, but no precision is lost before the
+ * fit.
+ *
+ * @param info
+ * @param buffer       The input buffer.
+ * @param pixel_stride The spacing of the pixels in buffer.
+ * @param M            The SVD matrix, or one per tile.
+ * @param tile_size    The size of the tiles or 0 if M is global.  See
+ *                     ptm_svd_near_field().
+ * @param calibration  The brightness calibration or NULL.
+ * @param output       The output PTM coefficients.
+ */
+void ptm_fit_poly_u16 (const ptm_image_info_t *info,
+                       const uint16_t *buffer,
+                       size_t pixel_stride,
+                       const float *M,
+                       size_t tile_size,
+                       const ptm_calibration_t *calibration,
+                       ptm_unscaled_coefficients_t *output);
+
+/**
+ * Estimate the normals and the albedo by photometric stereo.
+ *
+ * Solves the Lambertian model for all pixels in the image directly from the
+ * RGB input images without fitting a PTM.  The normal is estimated from the
+ * luma, the albedo for each color channel.  The images are streamed row by
+ * row and the solve is vectorised over the pixels of a row.  Computed in
+ * parallel.
+ *
+ * The outputs are like those of ptm_normal_albedo_map().
+ *
+ * @param info
+ * @param buffer      The input buffer of RGB images, 8 or 16 bit samples.
+ * @param M           The matrix returned by ptm_svd_lambert().
+ * @param calibration The brightness calibration or NULL.
+ * @param normals     [out] The normal map or NULL.
+ * @param albedo      [out] The albedo or NULL.
+ */
+void ptm_fit_lambert (const ptm_image_info_t *info,
+                      const void *buffer,
+                      const float *M,
+                      const ptm_calibration_t *calibration,
+                      JSAMPLE *normals,
+                      JSAMPLE *albedo);
 
 /**
  * Find the average YCbCr values of a pixel in all images.
@@ -288,13 +1360,135 @@ void ptm_fit_poly_uint (const ptm_image_info_t *info,
  * between exposures.  This is true for diffuse objects.  If this is not the
  * case you'd better use RGB formats.
  *
+ * The sums are kept in uint16_t for up to 257 images, one row at a time.
+ * Computed in parallel.
+ *
+ * If coeffs is given, the average YCbCr values are turned into LRGB in the
+ * same pass, like ptm_lrgb_from_ycbcr() does.
+ *
  * @param info    An info struct containing the buffer size.
  * @param buffer  Source buffer of YCbCr values.
  * @param block   The destination buffer for the average YCbCr values.
+ * @param coeffs  The coefficients fitted to Y or NULL.
  */
 void ptm_cbcr_avg (const ptm_image_info_t *info,
                    const ycbcr_coefficients_t *buffer,
-                   ycbcr_coefficients_t *block);
+                   ycbcr_coefficients_t *block,
+                   ptm_unscaled_coefficients_t *coeffs);
+
+/**
+ * Find the average YCbCr values of a pixel in all images from 16 bit samples.
+ *
+ * Like ptm_cbcr_avg() but for 16 bit input images.  The output is 8 bit.
+ *
+ * @param info    An info struct containing the buffer size.
+ * @param buffer  Source buffer of 16 bit YCbCr values.
+ * @param block   The destination buffer for the average YCbCr values.
+ * @param coeffs  The coefficients fitted to Y or NULL.
+ */
+void ptm_cbcr_avg_u16 (const ptm_image_info_t *info,
+                       const uint16_t *buffer,
+                       ycbcr_coefficients_t *block,
+                       ptm_unscaled_coefficients_t *coeffs);
+
+/**
+ * Find the median or the trimmed mean YCbCr values of a pixel in all images.
+ *
+ * Like ptm_cbcr_avg() but robust against the highlights and the shadows in
+ * some of the images.  The images are processed in tiles of 64 pixels by all
+ * images.  The values of each pixel are sorted with a sorting network, the 64
+ * pixels side by side in SIMD lanes, so there are no branches to mispredict.
+ * Computed in parallel.
+ *
+ * @param info    An info struct containing the buffer size.
+ * @param buffer  Source buffer of 8 or 16 bit YCbCr values.
+ * @param method  PTM_CHROMA_MEDIAN or PTM_CHROMA_TRIMMED_MEAN.
+ * @param block   The destination buffer for the YCbCr values.  Always 8 bit.
+ * @param coeffs  The coefficients fitted to Y or NULL.  See ptm_cbcr_avg().
+ */
+void ptm_cbcr_median (const ptm_image_info_t *info,
+                      const void *buffer,
+                      ptm_chroma_enum_t method,
+                      ycbcr_coefficients_t *block,
+                      ptm_unscaled_coefficients_t *coeffs);
+
+/**
+ * Find the average YCbCr values of a pixel in all calibrated images.
+ *
+ * Like ptm_cbcr_avg() or ptm_cbcr_median(), depending on the method, but the
+ * values are calibrated in float first.  Y is multiplied by the gain and the
+ * flat-field correction, Cb and Cr are scaled around their center by the same
+ * factor, so that the saturation of the pixel stays the same.  Computed in
+ * parallel.
+ *
+ * @param info        An info struct containing the buffer size.
+ * @param buffer      Source buffer of 8 or 16 bit YCbCr values.
+ * @param method      The method of averaging.
+ * @param calibration The brightness calibration.
+ * @param block       The destination buffer for the YCbCr values.  Always 8 bit.
+ * @param coeffs      The coefficients fitted to Y or NULL.  See ptm_cbcr_avg().
+ */
+void ptm_cbcr_calibrated (const ptm_image_info_t *info,
+                          const void *buffer,
+                          ptm_chroma_enum_t method,
+                          const ptm_calibration_t *calibration,
+                          ycbcr_coefficients_t *block,
+                          ptm_unscaled_coefficients_t *coeffs);
+
+/**
+ * Turn the Y fit and the average YCbCr values into an LRGB image.
+ *
+ * Converts the average YCbCr values into RGB in place and then fixes the
+ * polynome factors so that Y * R' ~ R.  Computed in parallel.  Prefer passing
+ * the coefficients to ptm_cbcr_avg(), which does this in the same pass.
+ *
+ * @param info    An info struct containing the buffer size.
+ * @param block   The average YCbCr values as output by ptm_cbcr_avg().
+ *                Converted to RGB values.
+ * @param coeffs  The coefficients fitted to Y.  Normalized.
+ */
+void ptm_lrgb_from_ycbcr (const ptm_image_info_t *info,
+                          ptm_block_t block,
+                          ptm_unscaled_coefficients_t *coeffs);
+
+/**
+ * Find the range of the float coefficients.
+ *
+ * @param unscaled The unscaled (float) coefficients.
+ * @param width    The width of the image.
+ * @param height   The height of the image.
+ * @param min      [out] The minimum of each coefficient.
+ * @param max      [out] The maximum of each coefficient.
+ */
+void ptm_coefficients_range (const ptm_unscaled_coefficients_t *unscaled, size_t width, size_t height,
+                             ptm_unscaled_coefficients_t *min,
+                             ptm_unscaled_coefficients_t *max);
+
+/**
+ * Set the scale and bias in the PTM header to fit a range of coefficients.
+ *
+ * @param ptm_header The PTM header.
+ * @param min        The minimum of each coefficient.
+ * @param max        The maximum of each coefficient.
+ */
+void ptm_set_scale_bias (ptm_header_t *ptm_header,
+                         const ptm_unscaled_coefficients_t *min,
+                         const ptm_unscaled_coefficients_t *max);
+
+/**
+ * Scale a run of float coefficients into unsigned chars.
+ *
+ * Uses the scale and bias set in the PTM header.
+ *
+ * @param ptm_header The PTM header.
+ * @param unscaled   The unscaled (float) coefficients.
+ * @param n_pixels   The no. of pixels to scale.
+ * @param scaled     The scaled (unsigned char) coefficients.
+ */
+void ptm_quantize_coefficients (const ptm_header_t *ptm_header,
+                                const ptm_unscaled_coefficients_t *unscaled,
+                                size_t n_pixels,
+                                JSAMPLE *scaled);
 
 /**
  * Scale the float coefficients into unsigned chars.
@@ -314,6 +1508,12 @@ void ptm_scale_coefficients (ptm_header_t *ptm_header,
 /**
  * Find the surface normal from the PTM coefficients.
  *
+ * The normal points to the maximum of the polynomial.  If the maximum is
+ * outside the unit circle the normal is clamped to the horizon.  If the
+ * polynomial has no maximum the normal points straight up.
+ *
+ * See: [Malzbender2001]_ Specular Enhancement
+ *
  * @param [in] coeffs  The PTM coefficients at the point of interest.
  * @param [out] nu  normal
  * @param [out] nv  normal
@@ -0,0 +1,294 @@
+/*
+ * Regression tests for ptmlib.
+ *
+ * Usage: test-ptmlib
+ *
+ * Writes small PTMs into memory, reads them back and checks that the blocks
+ * survive the round trip.  Checks the chroma averages.  Exits with 0 if all
+ * tests pass.
+ *
+ * Author: Marcello Perathoner <marcello@perathoner.de>
+ *
+ * License: GPL3
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ptmlib.h"
+
+/** The bytes the payloads start with: all the bytes fscanf () skips as
+    whitespace. */
+static const JSAMPLE whitespace[] = { '\v', ' ', '\t', '\n', '\r', '\f', ' ', '\n' };
+
+/**
+ * Write a PTM into memory, read it back and compare the blocks.
+ *
+ * The blocks are read in the layout of the header.
+ *
+ * @returns 0 if the blocks survive the round trip, else an error code with the
+ *          message in ctx.
+ */
+int round_trip (ptm_ctx_t *ctx, ptm_header_t *ptm_header, ptm_block_t *blocks) {
+    const size_t image_size = ptm_header->dimen[0] * ptm_header->dimen[1];
+    char *data = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream (&data, &size);
+    int err = ptm_write_ptm (ctx, fp, ptm_header, blocks);
+    fclose (fp);
+
+    ptm_header_t *read_header = NULL;
+    ptm_block_t *read_blocks = NULL;
+    if (!err) {
+        fp = fmemopen (data, size, "rb");
+        read_header = ptm_read_header (ctx, fp);
+        if (read_header)
+            read_header->planar = ptm_header->planar;
+        read_blocks = read_header ? ptm_alloc_blocks (read_header) : NULL;
+        err = read_blocks == NULL || ptm_read_ptm (ctx, fp, read_header, read_blocks);
+        fclose (fp);
+    }
+    for (int b = 0; b < ptm_header->format->blocks && !err; ++b) {
+        err = memcmp (blocks[b], read_blocks[b],
+                      image_size * (b < ptm_header->format->ptm_blocks ? PTM_COEFFICIENTS : RGB_COEFFICIENTS));
+        if (err)
+            snprintf (ctx->message, sizeof (ctx->message), "block %d differs", b);
+    }
+
+    if (read_header)
+        ptm_free_blocks (read_header, read_blocks);
+    free (read_header);
+    free (data);
+    return err;
+}
+
+/**
+ * Allocate a header and the blocks of a small PTM.
+ */
+ptm_header_t *alloc_ptm (const char *format_name, size_t width, size_t height,
+                         int planar, ptm_block_t **blocks) {
+    ptm_header_t *ptm_header = ptm_alloc_header ();
+    ptm_header->format   = ptm_get_format (format_name);
+    ptm_header->dimen[0] = width;
+    ptm_header->dimen[1] = height;
+    ptm_header->planar   = planar;
+    for (int i = 0; i < PTM_COEFFICIENTS; ++i) {
+        ptm_header->scale[i] = 1.0f;
+        ptm_header->bias[i]  = 0;
+    }
+    *blocks = ptm_alloc_blocks (ptm_header);
+    return ptm_header;
+}
+
+/**
+ * Write a PTM whose payload starts with whitespace and read it back.
+ *
+ * @returns 0 if the blocks survive the round trip.
+ */
+int test_whitespace_payload (const char *format_name) {
+    ptm_block_t *blocks;
+    ptm_header_t *ptm_header = alloc_ptm (format_name, 4, 3, 0, &blocks);
+    const size_t image_size = ptm_header->dimen[0] * ptm_header->dimen[1];
+    for (int b = 0; b < ptm_header->format->blocks; ++b) {
+        const size_t size = image_size * (b < ptm_header->format->ptm_blocks ? PTM_COEFFICIENTS : RGB_COEFFICIENTS);
+        for (size_t i = 0; i < size; ++i) {
+            blocks[b][i] = whitespace[(i + b) % sizeof (whitespace)];
+        }
+    }
+
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    int err = round_trip (&ctx, ptm_header, blocks);
+
+    fprintf (stderr, "%s: whitespace at the start of the payload: %s%s%s\n", format_name,
+             err ? "FAILED (" : "ok", err ? ctx.message : "", err ? ")" : "");
+
+    ptm_free_blocks (ptm_header, blocks);
+    free (ptm_header);
+    return err ? 1 : 0;
+}
+
+/**
+ * Write a lossless compressed PTM of random blocks and read it back.
+ *
+ * @returns 0 if the blocks survive the round trip.
+ */
+int test_zlib_round_trip (const char *format_name, size_t width, size_t height, int planar) {
+    ptm_block_t *blocks;
+    ptm_header_t *ptm_header = alloc_ptm (format_name, width, height, planar, &blocks);
+    const size_t image_size = width * height;
+    srand (width * height + planar);
+    for (int b = 0; b < ptm_header->format->blocks; ++b) {
+        const size_t size = image_size * (b < ptm_header->format->ptm_blocks ? PTM_COEFFICIENTS : RGB_COEFFICIENTS);
+        for (size_t i = 0; i < size; ++i) {
+            blocks[b][i] = rand () % 256;
+        }
+    }
+
+    ptm_ctx_t ctx;
+    ptm_ctx_init (&ctx);
+    int err = round_trip (&ctx, ptm_header, blocks);
+
+    fprintf (stderr, "%s: %zux%zu %s round trip: %s%s%s\n", format_name, width, height,
+             planar ? "planar" : "interleaved",
+             err ? "FAILED (" : "ok", err ? ctx.message : "", err ? ")" : "");
+
+    ptm_free_blocks (ptm_header, blocks);
+    free (ptm_header);
+    return err ? 1 : 0;
+}
+
+static int compare_uint (const void *a, const void *b) {
+    const unsigned int x = *(const unsigned int *) a;
+    const unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Compare ptm_cbcr_median() against a naive median and trimmed mean.
+ *
+ * The width is not a multiple of the tile size, so the last tile of each row
+ * is a partial one.
+ *
+ * @returns 0 if both agree on all pixels.
+ */
+int test_cbcr_median (ptm_chroma_enum_t method, const char *method_name,
+                      int n, size_t sample_size) {
+    ptm_image_info_t info = { 67, 2, 67 * 2, 67 * 3, 67 * 2 * 3, sample_size, n };
+    const int trim = (method == PTM_CHROMA_MEDIAN) ? (n - 1) / 2 : n / 4;
+    const int m = n - 2 * trim;
+    const unsigned int scale = (sample_size == 2) ? 257 : 1;
+
+    void *buffer = malloc (n * info.decoder_stride * sample_size);
+    srand (n);
+    for (size_t i = 0; i < n * info.decoder_stride; ++i) {
+        if (sample_size == 2)
+            ((uint16_t *) buffer)[i] = rand () % 65536;
+        else
+            ((JSAMPLE *) buffer)[i] = rand () % 256;
+    }
+
+    ycbcr_coefficients_t *block = malloc (info.pixels * sizeof (ycbcr_coefficients_t));
+    ptm_cbcr_median (&info, buffer, method, block, NULL);
+
+    int err = 0;
+    char message[80] = "";
+    unsigned int *values = malloc (n * sizeof (unsigned int));
+    for (size_t i = 0; i < 3 * info.pixels && !err; ++i) {
+        for (int d = 0; d < n; ++d) {
+            const size_t offset = d * info.decoder_stride + i;
+            values[d] = (sample_size == 2) ? ((uint16_t *) buffer)[offset] : ((JSAMPLE *) buffer)[offset];
+        }
+        qsort (values, n, sizeof (unsigned int), compare_uint);
+        unsigned int sum = m / 2;
+        for (int d = trim; d < trim + m; ++d)
+            sum += values[d];
+        const unsigned int expected = sum / m / scale;
+        const unsigned int got = ((const JSAMPLE *) block)[i];
+        err = got != expected;
+        if (err)
+            snprintf (message, sizeof (message), "pixel %zu component %zu is %u not %u",
+                      i / 3, i % 3, got, expected);
+    }
+
+    fprintf (stderr, "%s of %d %zu bit images: %s%s%s\n", method_name, n, 8 * sample_size,
+             err ? "FAILED (" : "ok", err ? message : "", err ? ")" : "");
+
+    free (values);
+    free (block);
+    free (buffer);
+    return err ? 1 : 0;
+}
+
+/**
+ * Average a stack of saturated YCbCr images with and without a gain.
+ *
+ * The RGB values in an LRGB block must scale with the gain, else the colors
+ * lose saturation.
+ *
+ * @returns 0 if the calibrated RGB values are the gain times the
+ *          uncalibrated ones.
+ */
+int test_calibrated_chroma (ptm_chroma_enum_t method, const char *method_name) {
+    const int n = 16;
+    const float g = 1.2f;
+    ptm_image_info_t info = { 67, 3, 67 * 3, 67 * 3, 67 * 3 * 3, 1, n };
+
+    JSAMPLE *buffer = malloc (n * info.decoder_stride);
+    srand (42);
+    for (size_t p = 0; p < info.pixels; ++p) {
+        // every pixel has its own color
+        const int cb = rand () % 81 - 40;
+        const int cr = rand () % 81 - 40;
+        for (int d = 0; d < n; ++d) {
+            JSAMPLE *ycbcr = buffer + d * info.decoder_stride + 3 * p;
+            ycbcr[0] = 60 + rand () % 51;
+            ycbcr[1] = CENTERJSAMPLE + cb + rand () % 5 - 2;
+            ycbcr[2] = CENTERJSAMPLE + cr + rand () % 5 - 2;
+        }
+    }
+
+    float gains[16];
+    for (int d = 0; d < n; ++d)
+        gains[d] = g;
+    const ptm_calibration_t calibration = { gains, NULL };
+
+    const size_t size = info.pixels * sizeof (ycbcr_coefficients_t);
+    ycbcr_coefficients_t *plain = malloc (size);
+    ycbcr_coefficients_t *calibrated = malloc (size);
+    ptm_unscaled_coefficients_t *coeffs = calloc (info.pixels * PTM_COEFFICIENTS, sizeof (float));
+
+    if (method == PTM_CHROMA_MEAN)
+        ptm_cbcr_avg (&info, (const ycbcr_coefficients_t *) buffer, plain, coeffs);
+    else
+        ptm_cbcr_median (&info, buffer, method, plain, coeffs);
+    ptm_cbcr_calibrated (&info, buffer, method, &calibration, calibrated, coeffs);
+
+    // allow for the rounding of Y, Cb and Cr in both blocks
+    int err = 0;
+    char message[80] = "";
+    const JSAMPLE *a = (const JSAMPLE *) plain;
+    const JSAMPLE *b = (const JSAMPLE *) calibrated;
+    for (size_t i = 0; i < 3 * info.pixels && !err; ++i) {
+        err = fabsf (b[i] - g * a[i]) > 5.0f;
+        if (err)
+            snprintf (message, sizeof (message), "%u is not %g * %u", b[i], g, a[i]);
+    }
+
+    fprintf (stderr, "%s: a gain scales the LRGB colors: %s%s%s\n", method_name,
+             err ? "FAILED (" : "ok", err ? message : "", err ? ")" : "");
+
+    free (coeffs);
+    free (calibrated);
+    free (plain);
+    free (buffer);
+    return err ? 1 : 0;
+}
+
+int main () {
+    int failed = 0;
+    failed += test_whitespace_payload ("PTM_FORMAT_RGB");
+    failed += test_whitespace_payload ("PTM_FORMAT_LRGB");
+    for (int planar = 0; planar <= 1; ++planar) {
+        failed += test_zlib_round_trip ("PTM_FORMAT_ZLIB_RGB",  1, 1, planar);
+        failed += test_zlib_round_trip ("PTM_FORMAT_ZLIB_RGB",  7, 3, planar);
+        failed += test_zlib_round_trip ("PTM_FORMAT_ZLIB_LRGB", 1, 1, planar);
+        failed += test_zlib_round_trip ("PTM_FORMAT_ZLIB_LRGB", 7, 3, planar);
+    }
+    const int ns[] = { 1, 2, 3, 36, 64 };
+    for (size_t i = 0; i < sizeof (ns) / sizeof (ns[0]); ++i) {
+        for (size_t sample_size = 1; sample_size <= 2; ++sample_size) {
+            failed += test_cbcr_median (PTM_CHROMA_MEDIAN,       "median",  ns[i], sample_size);
+            failed += test_cbcr_median (PTM_CHROMA_TRIMMED_MEAN, "trimmed", ns[i], sample_size);
+        }
+    }
+    failed += test_calibrated_chroma (PTM_CHROMA_MEAN,    "mean");
+    failed += test_calibrated_chroma (PTM_CHROMA_MEDIAN,  "median");
+    failed += test_calibrated_chroma (PTM_CHROMA_TRIMMED_MEAN, "trimmed");
+    return failed ? 1 : 0;
+}
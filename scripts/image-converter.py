@@ -8,6 +8,11 @@ With the help of this script you may crop / resize / rotate your images before
 processing them with the ptm-encoder.  Temporary files are created for the
 encoder, the original files are kept intact.
 
+N.B. The ptm-encoder can crop, shrink by an integer factor and rotate by
+multiples of 90 degrees by itself, see its --crop, --shrink and --rotate
+options.  That is much faster and needs no temporary files.  Use this script
+only for other transformations.
+
 Write a shell script and :command:`chmod +x` it.  The shell script must process
 the source image, apply all wanted transformations and save the destination
 image.  The source image path and filename will be $1 and the destination path